@@ -0,0 +1,111 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "logger.h"
+
+#define ARENA_ALIGN 16
+#define DEFAULT_BLOCK_SZ 4096
+
+/* Blocks are chained when one fills up; after a reset the arena keeps a
+ * single block large enough for everything the last line needed */
+struct arena_block {
+    struct arena_block *prev;
+    size_t size;
+    _Alignas(ARENA_ALIGN) char data[];
+};
+
+static int arena_grow(struct arena *arena, size_t size);
+
+void arena_init(struct arena *arena, size_t size)
+{
+    arena->block = NULL;
+    arena->used = 0;
+    arena->peak = 0;
+    arena->mallocs = 0;
+    arena_grow(arena, (size > 0) ? size : DEFAULT_BLOCK_SZ);
+}
+
+/* Returns 'size' bytes aligned for any type, or NULL if out of memory */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    if (arena->block == NULL || arena->block->size - arena->used < size) {
+        size_t new_sz = (arena->block != NULL) ? arena->block->size * 2 : DEFAULT_BLOCK_SZ;
+        if (arena_grow(arena, (new_sz > size) ? new_sz : size) == -1) {
+            return NULL;
+        }
+    }
+
+    void *ptr = arena->block->data + arena->used;
+    arena->used += size;
+    arena->peak += size;
+    return ptr;
+}
+
+/* Gives back the end of 'ptr', which must be the most recent allocation, so
+ * that only its first 'size' bytes stay in use. Lets a buffer be sized for the
+ * worst case and trimmed once it has been filled. 'peak' still counts the
+ * whole buffer, so the block kept after a reset fits it again. */
+void arena_shrink(struct arena *arena, void *ptr, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    size_t end = (char *) ptr - arena->block->data + size;
+    if (end < arena->used) {
+        arena->used = end;
+    }
+}
+
+char *arena_strdup(struct arena *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(arena, len);
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+/* Frees everything allocated since the last reset. If the line needed more
+ * than one block, they are replaced by one that fits it all, so the same
+ * work next time does not allocate. */
+void arena_reset(struct arena *arena)
+{
+    if (arena->block != NULL && arena->block->prev != NULL) {
+        size_t peak = arena->peak;
+        arena_destroy(arena);
+        arena_grow(arena, peak);
+    }
+    arena->used = 0;
+    arena->peak = 0;
+}
+
+void arena_destroy(struct arena *arena)
+{
+    struct arena_block *block = arena->block;
+    while (block != NULL) {
+        struct arena_block *prev = block->prev;
+        free(block);
+        block = prev;
+    }
+    arena->block = NULL;
+    arena->used = 0;
+}
+
+int arena_grow(struct arena *arena, size_t size)
+{
+    struct arena_block *block = malloc(sizeof(struct arena_block) + size);
+    if (block == NULL) {
+        perror("arena malloc");
+        return -1;
+    }
+    LOG("New arena block of %zu bytes\n", size);
+    block->prev = arena->block;
+    block->size = size;
+    arena->block = block;
+    arena->used = 0;
+    arena->mallocs++;
+    return 0;
+}
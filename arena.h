@@ -0,0 +1,30 @@
+/**
+ * @file
+ *
+ * Bump allocator for memory that only lives as long as one command line.
+ * Allocation moves a pointer forward and everything is released at once by
+ * arena_reset(), which keeps the memory for the next line.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+struct arena_block;
+
+struct arena {
+    struct arena_block *block;  /*!< Block allocations come from */
+    size_t used;                /*!< Bytes used in 'block' */
+    size_t peak;                /*!< Bytes used since the last reset */
+    unsigned long mallocs;      /*!< Blocks allocated so far */
+};
+
+void arena_init(struct arena *arena, size_t size);
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_shrink(struct arena *arena, void *ptr, size_t size);
+char *arena_strdup(struct arena *arena, const char *str);
+void arena_reset(struct arena *arena);
+void arena_destroy(struct arena *arena);
+
+#endif
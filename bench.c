@@ -0,0 +1,1740 @@
+/**
+ * @file
+ *
+ * Micro-benchmarks for ash's hot paths. Each result is printed as a single
+ * tab-separated line: benchmark name, parameter, value, and unit.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <math.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "complete.h"
+#include "copy.h"
+#include "elist.h"
+#include "history.h"
+#include "jobs.h"
+#include "parallel.h"
+#include "parse.h"
+#include "pathhash.h"
+#include "stats.h"
+#include "trace.h"
+#include "ui.h"
+#include "vars.h"
+#include "wildcard.h"
+
+extern char **environ;
+
+typedef void (*bench_fn)(void);
+
+/* From shell.c, which is linked in with its main() renamed */
+void run_parsed(struct parsed_line *parsed, const char *line);
+
+/* Keeps the compiler from optimizing away benchmarked calls */
+static volatile const void *bench_sink;
+
+/* Heap allocations and getcwd() calls made by ash's code, counted through
+ * the linker's --wrap */
+static unsigned long num_allocs;
+static unsigned long num_getcwds;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_getcwd(char *buf, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    num_allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    num_allocs++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    num_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+char *__wrap_getcwd(char *buf, size_t size)
+{
+    num_getcwds++;
+    return __real_getcwd(buf, size);
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, long param, double value, const char *unit)
+{
+    printf("%s\t%ld\t%.2f\t%s\n", name, param, value, unit);
+    fflush(stdout);
+}
+
+/* Add and lookup cost should stay flat regardless of the history size */
+static void bench_history(void)
+{
+    static const unsigned int sizes[] = { 100, 10000, 1000000 };
+    const int ops = 2000000;
+    char cmd[64];
+
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        hist_init(sizes[s]);
+
+        /* Fill first so every timed add also evicts */
+        for (unsigned int i = 0; i < sizes[s]; i++) {
+            snprintf(cmd, sizeof(cmd), "ls -l /tmp/dir%u | wc -l", i);
+            hist_add(cmd);
+        }
+
+        unsigned long allocs = num_allocs;
+        double start = now_ns();
+        for (int i = 0; i < ops; i++) {
+            snprintf(cmd, sizeof(cmd), "ls -l /tmp/dir%d | wc -l", i);
+            hist_add(cmd);
+        }
+        report("hist_add", sizes[s], (now_ns() - start) / ops, "ns/op");
+        report("hist_add_allocs", sizes[s], (double) (num_allocs - allocs) / ops, "allocs/op");
+
+        unsigned int last = hist_last_cnum();
+        start = now_ns();
+        for (int i = 0; i < ops; i++) {
+            bench_sink = hist_search_cnum(last - (i * 7919u) % sizes[s]);
+        }
+        report("hist_search_cnum", sizes[s], (now_ns() - start) / ops, "ns/op");
+
+        hist_destroy();
+    }
+}
+
+/* Startup cost of attaching a large history file, plus first lookups */
+static void bench_history_file(void)
+{
+    static const unsigned int sizes[] = { 10000, 1000000, 5000000 };
+    char path[] = "/tmp/ash-bench-history-XXXXXX";
+
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int fd = mkstemp(path);
+        FILE *file = fdopen(fd, "w");
+        fprintf(file, "#ash-history %020u\n", sizes[s]);
+        for (unsigned int i = 0; i < sizes[s]; i++) {
+            fprintf(file, "grep -r pattern%u src | sort | uniq -c\n", i);
+        }
+        fclose(file);
+
+        double start = now_ns();
+        hist_init(100);
+        hist_load_file(path, sizes[s] * 2);
+        report("hist_load_file", sizes[s], (now_ns() - start) / 1e3, "us");
+
+        char prefix[64];
+        snprintf(prefix, sizeof(prefix), "grep -r pattern%u ", sizes[s] - 50);
+        start = now_ns();
+        bench_sink = hist_search_cnum(hist_last_cnum() - 10);
+        bench_sink = hist_search_prefix(prefix);
+        report("hist_file_recent_lookup", sizes[s], (now_ns() - start) / 1e3, "us");
+
+        start = now_ns();
+        bench_sink = hist_search_cnum(1);
+        report("hist_file_oldest_lookup", sizes[s], (now_ns() - start) / 1e3, "us");
+
+        hist_destroy();
+        unlink(path);
+        strcpy(path + strlen(path) - 6, "XXXXXX");
+    }
+}
+
+/* Linear scan used by hist_search_prefix before it was indexed */
+static const char *scan_prefix(char **cmds, int n, const char *prefix)
+{
+    for (int i = n - 1; i >= 0; i--) {
+        if (strncmp(cmds[i], prefix, strlen(prefix)) == 0) {
+            return cmds[i];
+        }
+    }
+    return NULL;
+}
+
+/* '!prefix' lookups through the radix index versus a backwards scan */
+static void bench_history_prefix(void)
+{
+    static const unsigned int sizes[] = { 1000, 100000, 1000000 };
+    const int ops = 100000;
+    char cmd[64];
+
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        char **cmds = malloc(sizeof(char *) * sizes[s]);
+        hist_init(sizes[s]);
+        for (unsigned int i = 0; i < sizes[s]; i++) {
+            snprintf(cmd, sizeof(cmd), "make -C build%u target", i);
+            hist_add(cmd);
+            cmds[i] = strdup(cmd);
+        }
+
+        /* An old entry, so the scan has to walk most of the history */
+        char prefix[64];
+        snprintf(prefix, sizeof(prefix), "make -C build%u ", sizes[s] / 10);
+
+        double start = now_ns();
+        for (int i = 0; i < ops; i++) {
+            bench_sink = hist_search_prefix(prefix);
+        }
+        report("hist_prefix_indexed", sizes[s], (now_ns() - start) / ops, "ns/op");
+
+        int scan_ops = ops / (sizes[s] / 1000);
+        start = now_ns();
+        for (int i = 0; i < scan_ops; i++) {
+            bench_sink = scan_prefix(cmds, sizes[s], prefix);
+        }
+        report("hist_prefix_scan", sizes[s], (now_ns() - start) / scan_ops, "ns/op");
+
+        for (unsigned int i = 0; i < sizes[s]; i++) {
+            free(cmds[i]);
+        }
+        free(cmds);
+        hist_destroy();
+    }
+}
+
+/* Per-keystroke latency of the Ctrl-R fuzzy search over a large history */
+static void bench_history_search(void)
+{
+    static const char *words[] = {
+        "git", "commit", "-m", "make", "docker", "run", "grep", "-r", "ssh",
+        "kubectl", "logs", "deploy", "build", "test", "src/", "tail", "-f",
+        "/var/log/syslog", "fix", "release", "python3", "script.py", "ls",
+    };
+    static const char *queries[] = { "git commit fix", "dock run", "tail syslog", "ls" };
+    const int num_words = sizeof(words) / sizeof(words[0]);
+    const unsigned int entries = 300000;
+    const char *matches[32];
+    char cmd[128];
+
+    hist_init(entries);
+    srand(521);
+    unsigned long allocs = num_allocs;
+    for (unsigned int i = 0; i < entries; i++) {
+        int len = 0;
+        int num = 2 + rand() % 5;
+        for (int w = 0; w < num; w++) {
+            len += snprintf(cmd + len, sizeof(cmd) - len, "%s%s",
+                    w ? " " : "", words[rand() % num_words]);
+        }
+        snprintf(cmd + len, sizeof(cmd) - len, " %u", i % 977);
+        hist_add(cmd);
+    }
+    /* Mostly the search index's posting lists */
+    report("hist_fill_allocs", entries, (double) (num_allocs - allocs) / entries, "allocs/op");
+
+    for (int q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+        /* Type the query one character at a time */
+        char typed[64] = "";
+        double total = 0;
+        double worst = 0;
+        size_t len = strlen(queries[q]);
+        for (size_t i = 0; i < len; i++) {
+            typed[i] = queries[q][i];
+            double start = now_ns();
+            bench_sink = matches[hist_fuzzy_search(typed, matches, 32) > 0 ? 0 : 0];
+            double elapsed = now_ns() - start;
+            total += elapsed;
+            worst = (elapsed > worst) ? elapsed : worst;
+        }
+        printf("# query '%s'\n", queries[q]);
+        report("hist_fuzzy_keystroke_avg", entries, total / len / 1e3, "us");
+        report("hist_fuzzy_keystroke_max", entries, worst / 1e3, "us");
+    }
+    hist_destroy();
+}
+
+/* Runs 'true' n times with fork and either execvp or execv on a known path,
+ * returning commands per second */
+static double spawn_rate(const char *path, int n)
+{
+    char *argv[] = { "true", NULL };
+    double start = now_ns();
+    for (int i = 0; i < n; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (path != NULL) {
+                execv(path, argv);
+            } else {
+                execvp(argv[0], argv);
+            }
+            _exit(127);
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return n / ((now_ns() - start) / 1e9);
+}
+
+/* PATH hashing: lookup cost, directories probed and resulting spawn rate */
+static void bench_path_hash(void)
+{
+    const int ops = 100000;
+    const int spawns = 2000;
+
+    path_hash_reset();
+    unsigned long probes = path_hash_probes();
+    const char *path = path_lookup("true");
+    if (path == NULL) {
+        return;
+    }
+    /* execvp makes one failed execve per directory before the right one */
+    report("execvp_execve_per_cmd", 0, path_hash_probes() - probes, "syscalls");
+    report("hashed_execve_per_cmd", 0, 1, "syscalls");
+
+    double start = now_ns();
+    for (int i = 0; i < ops / 100; i++) {
+        path_hash_reset();
+        bench_sink = path_lookup("true");
+    }
+    report("path_lookup_cold", 0, (now_ns() - start) / (ops / 100), "ns/op");
+
+    start = now_ns();
+    for (int i = 0; i < ops; i++) {
+        bench_sink = path_lookup("true");
+    }
+    report("path_lookup_hashed", 0, (now_ns() - start) / ops, "ns/op");
+
+    report("spawn_execvp", spawns, spawn_rate(NULL, spawns), "cmds/s");
+    report("spawn_hashed_execv", spawns, spawn_rate(path_lookup("true"), spawns), "cmds/s");
+}
+
+/* Same as spawn_rate, but launching with posix_spawn */
+static double posix_spawn_rate(const char *path, int n)
+{
+    char *argv[] = { "true", NULL };
+    double start = now_ns();
+    for (int i = 0; i < n; i++) {
+        pid_t pid;
+        if (posix_spawn(&pid, path, NULL, NULL, argv, environ) == 0) {
+            waitpid(pid, NULL, 0);
+        }
+    }
+    return n / ((now_ns() - start) / 1e9);
+}
+
+/* fork+exec versus posix_spawn as the shell's resident memory grows */
+static void bench_spawn(void)
+{
+    static const size_t heap_mb[] = { 0, 256, 1024, 2048 };
+    const int spawns = 1000;
+    const char *path = path_lookup("true");
+    if (path == NULL) {
+        return;
+    }
+
+    for (int h = 0; h < sizeof(heap_mb) / sizeof(heap_mb[0]); h++) {
+        /* Touch every page so it is really part of the RSS */
+        size_t heap_sz = heap_mb[h] << 20;
+        char *heap = malloc(heap_sz);
+        if (heap_sz > 0 && heap == NULL) {
+            continue;
+        }
+        memset(heap, 1, heap_sz);
+
+        report("fork_exec_rss_mb", heap_mb[h], spawn_rate(path, spawns), "cmds/s");
+        report("posix_spawn_rss_mb", heap_mb[h], posix_spawn_rate(path, spawns), "cmds/s");
+        free(heap);
+    }
+}
+
+/* Runs 'template' once per line of 'input' with 'jobs' workers */
+static double parallel_rate(char **template, unsigned int jobs, const char *input,
+        int out_fd, int n)
+{
+    struct parallel_opts opts = {
+        .max_jobs = jobs, .keep_order = false, .ungrouped = false,
+        .arg_file = NULL, .template = template
+    };
+    FILE *in = fmemopen((void *) input, strlen(input), "r");
+    double start = now_ns();
+    parallel_run(&opts, in, out_fd);
+    double rate = n / ((now_ns() - start) / 1e9);
+    fclose(in);
+    return rate;
+}
+
+/* Throughput of the 'parallel' builtin as workers are added, for commands
+ * that are cheap to run (bound by spawning) and ones that wait on a timer */
+static void bench_parallel(void)
+{
+    const int cheap_tasks = 4000;
+    const int sleep_tasks = 256;
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    int out_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    char *input = malloc(cheap_tasks * 8);
+    size_t len = 0;
+    for (int i = 0; i < cheap_tasks; i++) {
+        len += sprintf(input + len, "%d\n", i);
+    }
+
+    /* Every sleep takes 10ms, the argument line */
+    char *sleep_input = malloc(sleep_tasks * 5 + 1);
+    for (int i = 0; i < sleep_tasks; i++) {
+        memcpy(sleep_input + i * 5, "0.01\n", 5);
+    }
+    sleep_input[sleep_tasks * 5] = '\0';
+
+    char *true_cmd[] = { "true", NULL };
+    char *sleep_cmd[] = { "sleep", NULL };
+
+    /* Go past the core count too: waiting commands keep scaling */
+    long max_jobs = (nproc < 16) ? 16 : nproc;
+    for (long jobs = 1; ; jobs *= 2) {
+        if (jobs > max_jobs) {
+            jobs = max_jobs;
+        }
+        report("parallel_true_jobs", jobs,
+                parallel_rate(true_cmd, jobs, input, out_fd, cheap_tasks), "cmds/s");
+        report("parallel_sleep_jobs", jobs,
+                parallel_rate(sleep_cmd, jobs, sleep_input, out_fd, sleep_tasks), "cmds/s");
+        if (jobs == max_jobs) {
+            break;
+        }
+    }
+
+    free(sleep_input);
+    free(input);
+    close(out_fd);
+}
+
+/* Runs the shell binary on 'script', given as a regular file (mapped by the
+ * shell) or through a pipe (read in blocks), and returns lines per second */
+static double script_rate(const char *shell, const char *script, size_t len,
+        int num_lines, bool from_file)
+{
+    char path[] = "/tmp/ash-bench-XXXXXX";
+    int fds[2] = { -1, -1 };
+    int in_fd;
+    if (from_file) {
+        in_fd = mkstemp(path);
+        if (in_fd == -1 || write(in_fd, script, len) != len) {
+            perror("script file");
+            return 0;
+        }
+        lseek(in_fd, 0, SEEK_SET);
+    } else {
+        if (pipe(fds) == -1) {
+            perror("pipe");
+            return 0;
+        }
+        in_fd = fds[0];
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    if (fds[1] != -1) {
+        posix_spawn_file_actions_addclose(&actions, fds[1]);
+    }
+
+    char *argv[] = { (char *) shell, NULL };
+    double start = now_ns();
+    pid_t pid;
+    int err = posix_spawn(&pid, shell, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(in_fd);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", shell, strerror(err));
+        return 0;
+    }
+    if (fds[1] != -1) {
+        if (write(fds[1], script, len) != len) {
+            perror("script pipe");
+        }
+        close(fds[1]);
+    }
+    waitpid(pid, NULL, 0);
+    double rate = num_lines / ((now_ns() - start) / 1e9);
+
+    if (from_file) {
+        unlink(path);
+    }
+    return rate;
+}
+
+/* Script throughput for 100k-line scripts of builtins and comments, of
+ * pipelines naming commands that do not exist (parsed but never spawned),
+ * and of builtins with 1% short external commands. ASH_BIN selects the shell
+ * binary (default ./ash), so builds can be compared. */
+static void bench_script(void)
+{
+    const int num_lines = 100000;
+    const char *shell = getenv("ASH_BIN") ? getenv("ASH_BIN") : "./ash";
+    static const char *builtin_lines[] = {
+        "cd .", "# comment", "cd /", "cd /tmp", "# another comment"
+    };
+    static const struct {
+        const char *name;
+        const char *line;     /* Every line, or NULL for the builtins */
+        const char *extra;    /* Every 100th line, if set */
+    } scripts[] = {
+        { "builtins", NULL, NULL },
+        { "unknown_cmds", "ash-bench-missing -a b c | ash-bench-x d > /dev/null", NULL },
+        { "builtins_1pct_true", NULL, "true > /dev/null" },
+    };
+
+    char *script = malloc(num_lines * 64);
+    char name[64];
+    for (int s = 0; s < sizeof(scripts) / sizeof(scripts[0]); s++) {
+        size_t len = 0;
+        for (int i = 0; i < num_lines; i++) {
+            const char *line = scripts[s].line ? scripts[s].line : builtin_lines[i % 5];
+            if (scripts[s].extra != NULL && i % 100 == 99) {
+                line = scripts[s].extra;
+            }
+            len += sprintf(script + len, "%s\n", line);
+        }
+
+        snprintf(name, sizeof(name), "script_file_%s", scripts[s].name);
+        report(name, num_lines, script_rate(shell, script, len, num_lines, true), "lines/s");
+        snprintf(name, sizeof(name), "script_pipe_%s", scripts[s].name);
+        report(name, num_lines, script_rate(shell, script, len, num_lines, false), "lines/s");
+    }
+    free(script);
+}
+
+static double copy_time(const char *src, const char *dst, int out_flags,
+        const char *how, size_t size)
+{
+    static const char *method_names[] = {
+        "copy_file_range", "splice", "sendfile", "read_write"
+    };
+    unlink(dst);
+    int in_fd = open(src, O_RDONLY);
+    int out_fd = open(dst, O_WRONLY | O_CREAT | out_flags, 0644);
+    if (in_fd == -1 || out_fd == -1) {
+        perror("copy bench open");
+        return 0;
+    }
+
+    enum copy_method method = COPY_READ_WRITE;
+    struct rusage self_start, children_start, self_end, children_end;
+    getrusage(RUSAGE_SELF, &self_start);
+    getrusage(RUSAGE_CHILDREN, &children_start);
+    double start = now_ns();
+    ssize_t copied;
+    if (strcmp(how, "cat") == 0) {
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+        char *argv[] = { "cat", (char *) src, NULL };
+        pid_t pid;
+        int status = -1;
+        if (posix_spawnp(&pid, "cat", &actions, NULL, argv, environ) == 0) {
+            waitpid(pid, &status, 0);
+        }
+        posix_spawn_file_actions_destroy(&actions);
+        copied = (status == 0) ? size : -1;
+    } else if (strcmp(how, "read_write") == 0) {
+        copied = copy_fd_read_write(in_fd, out_fd);
+    } else {
+        copied = copy_fd(in_fd, out_fd, &method);
+    }
+    double elapsed = now_ns() - start;
+    getrusage(RUSAGE_SELF, &self_end);
+    getrusage(RUSAGE_CHILDREN, &children_end);
+    close(in_fd);
+    close(out_fd);
+    unlink(dst);
+
+    /* CPU time spent copying, in this process or in cat */
+    double cpu = 0;
+    struct rusage *ends[] = { &self_end, &children_end };
+    struct rusage *starts[] = { &self_start, &children_start };
+    for (int i = 0; i < 2; i++) {
+        cpu += (ends[i]->ru_utime.tv_sec - starts[i]->ru_utime.tv_sec)
+            + (ends[i]->ru_utime.tv_usec - starts[i]->ru_utime.tv_usec) / 1e6
+            + (ends[i]->ru_stime.tv_sec - starts[i]->ru_stime.tv_sec)
+            + (ends[i]->ru_stime.tv_usec - starts[i]->ru_stime.tv_usec) / 1e6;
+    }
+
+    if (copied != size) {
+        fprintf(stderr, "copy bench: %s copied %zd of %zu bytes\n", how, copied, size);
+        return 0;
+    }
+    /* copy_fd results are named after the method it ended up using */
+    char name[64];
+    snprintf(name, sizeof(name), "copy_%s%s%s%s", how,
+            (out_flags & O_APPEND) ? "_append" : "",
+            (strcmp(how, "copy_fd") == 0) ? "_" : "",
+            (strcmp(how, "copy_fd") == 0) ? method_names[method] : "");
+    report(name, size >> 20, size / (elapsed / 1e9) / (1024 * 1024), "MiB/s");
+    strcat(name, "_cpu");
+    report(name, size >> 20, cpu * 1e3, "ms");
+    return elapsed;
+}
+
+/* File-to-file copy throughput of what 'cat src > dst' does inside the shell
+ * (copy_fd), a plain read/write loop and a spawned cat, two rounds each. The source size is
+ * ASH_BENCH_COPY_MB (default 2048), in the directory ASH_BENCH_DIR (/tmp). */
+static void bench_copy(void)
+{
+    size_t mib = getenv("ASH_BENCH_COPY_MB") ? atol(getenv("ASH_BENCH_COPY_MB")) : 2048;
+    const char *dir = getenv("ASH_BENCH_DIR") ? getenv("ASH_BENCH_DIR") : "/tmp";
+    char src[PATH_MAX];
+    char dst[PATH_MAX];
+    snprintf(src, sizeof(src), "%s/ash-bench-copy-src", dir);
+    snprintf(dst, sizeof(dst), "%s/ash-bench-copy-dst", dir);
+
+    int fd = open(src, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char *block = malloc(1 << 20);
+    if (fd == -1 || block == NULL) {
+        perror("copy bench source");
+        return;
+    }
+    for (size_t i = 0; i < (1 << 20); i++) {
+        block[i] = (char) (i * 31 + (i >> 12));
+    }
+    for (size_t i = 0; i < mib; i++) {
+        if (write(fd, block, 1 << 20) != 1 << 20) {
+            perror("copy bench source");
+            close(fd);
+            unlink(src);
+            free(block);
+            return;
+        }
+    }
+    /* Keep writeback of the source out of the measurements */
+    fsync(fd);
+    close(fd);
+    free(block);
+
+    size_t size = mib << 20;
+    for (int round = 0; round < 2; round++) {
+        copy_time(src, dst, O_TRUNC, "copy_fd", size);
+        copy_time(src, dst, O_APPEND, "copy_fd", size);
+        copy_time(src, dst, O_TRUNC, "read_write", size);
+        copy_time(src, dst, O_TRUNC, "cat", size);
+    }
+    unlink(src);
+}
+
+/* MiB/s through 2-8 stage pipelines run by the shell ('head -c N /dev/zero |
+ * cat | ... > /dev/null') with the default 64 KiB pipes, larger ones set with
+ * ASH_PIPE_SIZE, and 1 MiB pipes with the stages pinned to CPUs. The amount
+ * of data is ASH_BENCH_PIPE_MB (default 512). */
+static void bench_pipeline(void)
+{
+    const char *shell = getenv("ASH_BIN") ? getenv("ASH_BIN") : "./ash";
+    size_t mib = getenv("ASH_BENCH_PIPE_MB") ? atol(getenv("ASH_BENCH_PIPE_MB")) : 512;
+    static const struct {
+        const char *name;
+        const char *size;
+        const char *cpus;
+    } configs[] = {
+        { "default", NULL, NULL },
+        { "256K", "256K", NULL },
+        { "1M", "1M", NULL },
+        { "1M_pinned", "1M", "auto" },
+    };
+
+    char script[512];
+    char name[64];
+    for (int stages = 2; stages <= 8; stages++) {
+        size_t len = snprintf(script, sizeof(script), "head -c %zuM /dev/zero", mib);
+        for (int i = 1; i < stages; i++) {
+            len += snprintf(script + len, sizeof(script) - len, " | cat");
+        }
+        len += snprintf(script + len, sizeof(script) - len, " > /dev/null\n");
+
+        for (int c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+            if (configs[c].size != NULL) {
+                setenv("ASH_PIPE_SIZE", configs[c].size, 1);
+            } else {
+                unsetenv("ASH_PIPE_SIZE");
+            }
+            if (configs[c].cpus != NULL) {
+                setenv("ASH_PIPE_CPUS", configs[c].cpus, 1);
+            } else {
+                unsetenv("ASH_PIPE_CPUS");
+            }
+
+            double runs_per_sec = script_rate(shell, script, len, 1, true);
+            snprintf(name, sizeof(name), "pipeline_%s", configs[c].name);
+            report(name, stages, mib * runs_per_sec, "MiB/s");
+        }
+    }
+    unsetenv("ASH_PIPE_SIZE");
+    unsetenv("ASH_PIPE_CPUS");
+}
+
+/* Commands per second through the shell's own parse and launch path
+ * (parse_line() and run_parsed()), for builtins, external commands and a
+ * pipeline */
+static void bench_shell(void)
+{
+    static const struct {
+        const char *name;
+        const char *line;
+        int iters;
+    } lines[] = {
+        { "shell_builtin", "true", 200000 },
+        { "shell_builtin_redirect", "echo x > /dev/null", 50000 },
+        { "shell_external", "/bin/true", 2000 },
+        { "shell_external_redirect", "/bin/echo x > /dev/null", 2000 },
+        { "shell_pipeline2", "/bin/true | /bin/true", 1000 },
+    };
+    static bool initialized;
+    if (!initialized) {
+        jobs_init();
+        hist_init(100);
+        initialized = true;
+    }
+
+    struct arena arena;
+    arena_init(&arena, 0);
+    char buf[128];
+    for (int l = 0; l < sizeof(lines) / sizeof(lines[0]); l++) {
+        double start = now_ns();
+        for (int i = 0; i < lines[l].iters; i++) {
+            struct parsed_line parsed;
+            arena_reset(&arena);
+            strcpy(buf, lines[l].line);
+            parse_line(buf, &arena, &parsed);
+            run_parsed(&parsed, lines[l].line);
+        }
+        double elapsed = now_ns() - start;
+        report(lines[l].name, lines[l].iters, lines[l].iters / (elapsed / 1e9), "cmds/s");
+    }
+    arena_destroy(&arena);
+}
+
+/* Commands per second for scripts of simple utilities, which the shell now
+ * runs itself, against the same commands started from /bin */
+static void bench_utils(void)
+{
+    const char *shell = getenv("ASH_BIN") ? getenv("ASH_BIN") : "./ash";
+    static const char *lines[] = {
+        "echo hello world", "true", "test -d /tmp", "printf '%s %d\\n' x 1",
+        "pwd", "false", "echo log > /dev/null", "[ a = b ]",
+    };
+    static const char *external_lines[] = {
+        "/bin/echo hello world", "/bin/true", "/usr/bin/test -d /tmp",
+        "/usr/bin/printf '%s %d\\n' x 1", "/bin/pwd", "/bin/false",
+        "/bin/echo log > /dev/null", "/usr/bin/[ a = b ]",
+    };
+    static const struct {
+        const char *name;
+        const char **lines;
+        int num_lines;
+    } scripts[] = {
+        { "utils_builtin", lines, 100000 },
+        { "utils_external", external_lines, 5000 },
+    };
+
+    char name[64];
+    for (int s = 0; s < sizeof(scripts) / sizeof(scripts[0]); s++) {
+        int num_lines = scripts[s].num_lines;
+        char *script = malloc(num_lines * 64);
+        size_t len = 0;
+        for (int i = 0; i < num_lines; i++) {
+            len += sprintf(script + len, "%s\n", scripts[s].lines[i % 8]);
+        }
+        snprintf(name, sizeof(name), "script_%s", scripts[s].name);
+        report(name, num_lines, script_rate(shell, script, len, num_lines, true), "cmds/s");
+        free(script);
+    }
+}
+
+/* The tokenizer before the lexer: whitespace-only splitting with strspn()
+ * and strcspn(), one token per call */
+static char *next_token(char **str_ptr, const char *delim)
+{
+    if (*str_ptr == NULL) {
+        return NULL;
+    }
+
+    size_t tok_start = strspn(*str_ptr, delim);
+    size_t tok_end = strcspn(*str_ptr + tok_start, delim);
+    if (tok_end == 0) {
+        *str_ptr = NULL;
+        return NULL;
+    }
+
+    char *current_ptr = *str_ptr + tok_start;
+    *str_ptr += tok_start + tok_end;
+    if (**str_ptr == '\0') {
+        *str_ptr = NULL;
+    } else {
+        **str_ptr = '\0';
+        (*str_ptr)++;
+    }
+    return current_ptr;
+}
+
+/* The parse path before arenas: an elist of tokens, an elist of commands
+ * and a malloc'd command_line per stage, all freed after the line */
+static void parse_elist(char *command)
+{
+    struct elist *tokens = elist_create(26);
+    char *next_tok = command;
+    char *tok;
+    while ((tok = next_token(&next_tok, " \t\n\r")) != NULL) {
+        elist_add(tokens, tok);
+    }
+    elist_add(tokens, NULL);
+
+    struct elist *cmds = elist_create(30);
+    char **arr = (char **) elist_elements(tokens);
+    size_t start = 0;
+    bool in_redir = false, out_redir = false, append = false;
+    char *in_file = NULL, *out_file = NULL;
+    for (size_t i = 0; i < elist_size(tokens) - 1; i++) {
+        if (strcmp(arr[i], "<") == 0) {
+            arr[i] = NULL;
+            in_redir = true;
+            in_file = arr[i + 1];
+            continue;
+        } else if (strcmp(arr[i], ">") == 0 || strcmp(arr[i], ">>") == 0) {
+            append = (arr[i][1] == '>');
+            arr[i] = NULL;
+            out_redir = true;
+            out_file = arr[i + 1];
+            continue;
+        }
+
+        if (i == elist_size(tokens) - 2 || strcmp(arr[i], "|") == 0) {
+            struct command_line *cmd = malloc(sizeof(struct command_line));
+            cmd->append = append;
+            cmd->stdin_file = in_redir ? in_file : NULL;
+            cmd->stdout_file = out_redir ? out_file : NULL;
+            cmd->tokens = arr + start;
+            cmd->stdout_pipe = (strcmp(arr[i], "|") == 0);
+            if (cmd->stdout_pipe) {
+                arr[i] = NULL;
+                start = i + 1;
+            }
+            elist_add(cmds, cmd);
+            in_redir = out_redir = append = false;
+        }
+    }
+
+    bench_sink = elist_get(cmds, 0);
+    for (size_t i = 0; i < elist_size(cmds); i++) {
+        free(elist_get(cmds, i));
+    }
+    elist_destroy(cmds);
+    elist_destroy(tokens);
+}
+
+/* Latency and heap allocations per line of the parse path, against the
+ * elist-based version it replaced */
+static void bench_parse(void)
+{
+    static const char *lines[] = {
+        "ls -la /tmp",
+        "cat < in.txt | grep -v foo | sort | uniq -c > out.txt",
+        "cc -O2 -g -Wall -Wextra -fPIC -DLOGGER=0 -I. -Iinclude -c a.c -o a.o "
+            "-MMD -MP -MF a.d -std=c99 -pedantic -Wshadow -Wformat=2 -Wundef "
+            "-Wpointer-arith -Wcast-align -Wstrict-prototypes -Wwrite-strings "
+            "-Wmissing-prototypes -Wredundant-decls -Wnested-externs",
+    };
+    const int iters = 200000;
+    char buf[1024];
+    struct arena arena;
+    arena_init(&arena, 0);
+
+    for (int l = 0; l < sizeof(lines) / sizeof(lines[0]); l++) {
+        size_t len = strlen(lines[l]) + 1;
+        struct parsed_line parsed;
+
+        /* One untimed round lets the arena grow to fit the line */
+        memcpy(buf, lines[l], len);
+        parse_line(buf, &arena, &parsed);
+        arena_reset(&arena);
+
+        unsigned long allocs = num_allocs;
+        double start = now_ns();
+        for (int i = 0; i < iters; i++) {
+            memcpy(buf, lines[l], len);
+            parse_line(buf, &arena, &parsed);
+            bench_sink = parsed.cmds;
+            arena_reset(&arena);
+        }
+        double elapsed = now_ns() - start;
+        report("parse_arena_ns", len - 1, elapsed / iters, "ns/line");
+        report("parse_arena_allocs", len - 1, (double) (num_allocs - allocs) / iters,
+                "allocs/line");
+
+        allocs = num_allocs;
+        start = now_ns();
+        for (int i = 0; i < iters; i++) {
+            memcpy(buf, lines[l], len);
+            parse_elist(buf);
+        }
+        elapsed = now_ns() - start;
+        report("parse_elist_ns", len - 1, elapsed / iters, "ns/line");
+        report("parse_elist_allocs", len - 1, (double) (num_allocs - allocs) / iters,
+                "allocs/line");
+    }
+    arena_destroy(&arena);
+}
+
+/* Fills 'buf' with a generated command line of about 'len' bytes. 'mixed'
+ * adds quoted arguments, escapes and operators without spaces around them;
+ * otherwise the words are plain and space-separated, which the old
+ * tokenizer can split too. */
+static size_t gen_command_line(char *buf, size_t len, bool mixed)
+{
+    static const char *plain[] = {
+        "grep", "-rn", "--include=a.c", "/usr/local/share/doc/packages/readline",
+        "x", "-O2", "some_rather_long_identifier_name", "a.out",
+    };
+    static const char *special[] = {
+        "'two words'", "\"say \\\"hi\\\"\"", "a\\ b", "ls|wc", "out>>log",
+        "<in.txt", "\"$HOME/dir with spaces/file\"", "-x",
+    };
+    size_t pos = 0;
+    unsigned int seed = 7;
+    while (true) {
+        seed = seed * 1103515245 + 12345;
+        unsigned int pick = (seed >> 16) % 8;
+        const char *word = (mixed && (seed >> 24) % 3 == 0) ? special[pick] : plain[pick];
+        size_t word_len = strlen(word);
+        if (pos + word_len + 2 > len) {
+            break;
+        }
+        memcpy(buf + pos, word, word_len);
+        pos += word_len;
+        buf[pos++] = ' ';
+    }
+    buf[pos] = '\0';
+    return pos;
+}
+
+/* Lexer throughput on long generated command lines, against the old
+ * strspn/strcspn tokenizer on the lines it can handle */
+static void bench_lexer(void)
+{
+    static const size_t sizes[] = { 1024, 4096, 16384, 65536 };
+    const size_t total = 256 * 1024 * 1024;
+    struct arena arena;
+    arena_init(&arena, 0);
+
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        char *line = malloc(sizes[s]);
+        char *buf = malloc(sizes[s]);
+        size_t iters = total / sizes[s];
+
+        for (int mixed = 0; mixed <= 1; mixed++) {
+            size_t len = gen_command_line(line, sizes[s], mixed);
+            size_t num_tokens = 0;
+
+            double start = now_ns();
+            for (size_t i = 0; i < iters; i++) {
+                memcpy(buf, line, len + 1);
+                char **tokens = tokenize(buf, &arena, &num_tokens);
+                size_t num_cmds;
+                const char *error;
+                bench_sink = setup_commands(tokens, num_tokens, &arena, &num_cmds, &error);
+                arena_reset(&arena);
+            }
+            double elapsed = now_ns() - start;
+            report(mixed ? "lexer_mixed" : "lexer_plain", len,
+                    (double) len * iters / elapsed * 1e9 / (1024 * 1024), "MiB/s");
+        }
+
+        size_t len = gen_command_line(line, sizes[s], false);
+        char **tokens = malloc(len * sizeof(char *));
+        double start = now_ns();
+        for (size_t i = 0; i < iters; i++) {
+            memcpy(buf, line, len + 1);
+            char *next_tok = buf;
+            char *tok;
+            size_t count = 0;
+            while ((tok = next_token(&next_tok, " \t\n\r")) != NULL) {
+                tokens[count++] = tok;
+            }
+            bench_sink = tokens[count - 1];
+        }
+        double elapsed = now_ns() - start;
+        report("lexer_strspn_plain", len,
+                (double) len * iters / elapsed * 1e9 / (1024 * 1024), "MiB/s");
+
+        free(tokens);
+        free(buf);
+        free(line);
+    }
+    arena_destroy(&arena);
+}
+
+/* The prompt as it was built before segments were cached: a fresh getcwd()
+ * buffer, a malloc'd home directory and a malloc'd prompt every time */
+static char *prompt_line_uncached(const char *user, const char *host)
+{
+    char *cwd = malloc(PATH_MAX);
+    getcwd(cwd, PATH_MAX);
+    char *home_dir = malloc(strlen("/home/") + strlen(user) + 1);
+    strcpy(home_dir, "/home/");
+    strcat(home_dir, user);
+    char *shown = cwd;
+    if (strncmp(cwd, home_dir, strlen(home_dir)) == 0) {
+        shown = cwd + strlen(home_dir) - 1;
+        *shown = '~';
+    }
+    free(home_dir);
+
+    char cmd_num[25];
+    snprintf(cmd_num, 25, "%u", prompt_cmd_num());
+    const char *status = get_prompt_status() ? "😭" : "😋";
+    const char *format_str = "[%s]-[%s]-[%s@%s:%s]$ ";
+    size_t prompt_sz = strlen(format_str) + strlen(status) + strlen(cmd_num)
+        + strlen(user) + strlen(host) + strlen(shown) + 1;
+    char *prompt_str = malloc(prompt_sz);
+    snprintf(prompt_str, prompt_sz, format_str, status, cmd_num, user, host, shown);
+    free(cwd);
+    return prompt_str;
+}
+
+static void prompt_report(const char *name, int iters, double elapsed,
+        unsigned long allocs, unsigned long getcwds)
+{
+    char metric[64];
+    snprintf(metric, sizeof(metric), "%s_ns", name);
+    report(metric, iters, elapsed / iters, "ns/prompt");
+    snprintf(metric, sizeof(metric), "%s_allocs", name);
+    report(metric, iters, (double) (num_allocs - allocs) / iters, "allocs/prompt");
+    snprintf(metric, sizeof(metric), "%s_getcwd", name);
+    report(metric, iters, (double) (num_getcwds - getcwds) / iters, "calls/prompt");
+}
+
+/* Cost of drawing the prompt between commands: unchanged, with the status and
+ * command number patched in, after a cd, and the old uncached version */
+static void bench_prompt(void)
+{
+    const int iters = 1000000;
+    init_ui();
+    hist_init(100);
+    prompt_line();
+
+    unsigned long allocs = num_allocs, getcwds = num_getcwds;
+    double start = now_ns();
+    for (int i = 0; i < iters; i++) {
+        bench_sink = prompt_line();
+    }
+    prompt_report("prompt_unchanged", iters, now_ns() - start, allocs, getcwds);
+
+    allocs = num_allocs, getcwds = num_getcwds;
+    start = now_ns();
+    for (int i = 0; i < iters; i++) {
+        set_prompt_status(i & 1);
+        if ((i & 1023) == 0) {
+            hist_add("true");
+        }
+        bench_sink = prompt_line();
+    }
+    prompt_report("prompt_patched", iters, now_ns() - start, allocs, getcwds);
+
+    allocs = num_allocs, getcwds = num_getcwds;
+    start = now_ns();
+    for (int i = 0; i < iters; i++) {
+        prompt_cwd_changed();
+        bench_sink = prompt_line();
+    }
+    prompt_report("prompt_after_cd", iters, now_ns() - start, allocs, getcwds);
+
+    char host[HOST_NAME_MAX + 1];
+    snprintf(host, sizeof(host), "%s", prompt_hostname());
+    const char *user = prompt_username();
+    allocs = num_allocs, getcwds = num_getcwds;
+    start = now_ns();
+    for (int i = 0; i < iters; i++) {
+        set_prompt_status(i & 1);
+        char *prompt = prompt_line_uncached(user, host);
+        bench_sink = prompt;
+        free(prompt);
+    }
+    prompt_report("prompt_uncached", iters, now_ns() - start, allocs, getcwds);
+    hist_destroy();
+}
+
+/* Expanding a wildcard over directories of 1000 and 100000 files: read
+ * again every time, from the listing cache, and with the C library's glob()
+ * for comparison. Directory reads per expansion show the cache working. */
+static void bench_wildcard(void)
+{
+    const char *base = getenv("ASH_BENCH_DIR") ? getenv("ASH_BENCH_DIR") : "/tmp";
+    const int sizes[] = { 1000, 100000 };
+
+    struct arena arena;
+    arena_init(&arena, 0);
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        char dir[PATH_MAX / 2];
+        char path[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s/ash-bench-wildcard-XXXXXX", base);
+        if (mkdtemp(dir) == NULL) {
+            perror("mkdtemp");
+            break;
+        }
+        for (int i = 0; i < sizes[s]; i++) {
+            snprintf(path, sizeof(path), "%s/file%06d.%s", dir, i, (i % 10 == 7) ? "log" : "txt");
+            close(open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+        }
+        /* Let the clock move past the directory's mtime, or the first
+         * listing would be read again as racy */
+        usleep(50000);
+
+        char pattern[PATH_MAX];
+        snprintf(pattern, sizeof(pattern), "%s/file*7.log", dir);
+        int iters = 2000000 / sizes[s];
+        size_t num;
+
+        double start = now_ns();
+        for (int i = 0; i < iters; i++) {
+            wildcard_cache_clear();
+            arena_reset(&arena);
+            bench_sink = wildcard_expand(pattern, &arena, &num);
+        }
+        report("wildcard_uncached", sizes[s], (now_ns() - start) / iters / 1e3, "us");
+
+        unsigned long reads = wildcard_dir_reads();
+        start = now_ns();
+        for (int i = 0; i < iters; i++) {
+            arena_reset(&arena);
+            bench_sink = wildcard_expand(pattern, &arena, &num);
+        }
+        report("wildcard_cached", sizes[s], (now_ns() - start) / iters / 1e3, "us");
+        report("wildcard_cached_dir_reads", sizes[s],
+                (double) (wildcard_dir_reads() - reads) / iters, "reads/op");
+
+        start = now_ns();
+        for (int i = 0; i < iters; i++) {
+            glob_t g;
+            glob(pattern, 0, NULL, &g);
+            globfree(&g);
+        }
+        report("libc_glob", sizes[s], (now_ns() - start) / iters / 1e3, "us");
+
+        for (int i = 0; i < sizes[s]; i++) {
+            snprintf(path, sizeof(path), "%s/file%06d.%s", dir, i, (i % 10 == 7) ? "log" : "txt");
+            unlink(path);
+        }
+        rmdir(dir);
+    }
+    wildcard_cache_clear();
+    arena_destroy(&arena);
+}
+
+/* Lines full of variables against the same lines written out, lookups in a
+ * table of a few hundred variables, and what keeping envp ready saves:
+ * setting a variable, exported or not, should not rebuild it, where libc's
+ * setenv() (how PIPESTATUS used to be set) copies the string every time. */
+static void bench_vars(void)
+{
+    static const struct {
+        const char *name;
+        const char *line;
+    } lines[] = {
+        { "vars_line", "cc -c $SRC/$NAME.c -o $DST/${NAME}.o -DVERSION=$VERSION "
+            "-I$SRC/include -I$PREFIX/include -L$PREFIX/lib \"$MSG\" $?" },
+        { "vars_literal", "cc -c /home/user/src/parse.c -o /home/user/build/parse.o "
+            "-DVERSION=1.4.2 -I/home/user/src/include -I/usr/local/include "
+            "-L/usr/local/lib \"built by ash\" 0" },
+    };
+    const int iters = 200000;
+    char buf[512];
+    char name[32];
+
+    vars_init();
+    for (int i = 0; i < 256; i++) {
+        snprintf(name, sizeof(name), "BENCH_VAR_%d", i);
+        var_set(name, strlen(name), "some value", i % 4 == 0);
+    }
+    var_set("SRC", 3, "/home/user/src", false);
+    var_set("DST", 3, "/home/user/build", false);
+    var_set("NAME", 4, "parse", false);
+    var_set("VERSION", 7, "1.4.2", false);
+    var_set("PREFIX", 6, "/usr/local", false);
+    var_set("MSG", 3, "built by ash", false);
+
+    struct arena arena;
+    arena_init(&arena, 0);
+    for (int l = 0; l < sizeof(lines) / sizeof(lines[0]); l++) {
+        size_t len = strlen(lines[l].line) + 1;
+        struct parsed_line parsed;
+        memcpy(buf, lines[l].line, len);
+        parse_line(buf, &arena, &parsed);
+        arena_reset(&arena);
+
+        unsigned long allocs = num_allocs;
+        double start = now_ns();
+        for (int i = 0; i < iters; i++) {
+            memcpy(buf, lines[l].line, len);
+            parse_line(buf, &arena, &parsed);
+            bench_sink = parsed.cmds;
+            arena_reset(&arena);
+        }
+        double elapsed = now_ns() - start;
+        report(lines[l].name, len - 1, elapsed / iters, "ns/line");
+        snprintf(name, sizeof(name), "%s_allocs", lines[l].name);
+        report(name, len - 1, (double) (num_allocs - allocs) / iters, "allocs/line");
+    }
+    arena_destroy(&arena);
+
+    const int lookups = 10000000;
+    double start = now_ns();
+    for (int i = 0; i < lookups; i++) {
+        bench_sink = var_get("BENCH_VAR_17", 12);
+    }
+    report("var_get_hit", 256, (now_ns() - start) / lookups, "ns");
+    start = now_ns();
+    for (int i = 0; i < lookups; i++) {
+        bench_sink = var_get("BENCH_MISSING", 13);
+    }
+    report("var_get_miss", 256, (now_ns() - start) / lookups, "ns");
+
+    const int sets = 1000000;
+    const char *values[] = { "0", "0 1 0", "1" };
+    for (int exported = 0; exported <= 1; exported++) {
+        unsigned long builds = vars_envp_builds();
+        start = now_ns();
+        for (int i = 0; i < sets; i++) {
+            var_set("BENCH_STATUS", 12, values[i % 3], exported);
+        }
+        report(exported ? "var_set_exported" : "var_set", sets,
+                (now_ns() - start) / sets, "ns");
+        report(exported ? "var_set_exported_envp_builds" : "var_set_envp_builds", sets,
+                (double) (vars_envp_builds() - builds) / sets, "builds/op");
+    }
+    start = now_ns();
+    for (int i = 0; i < sets; i++) {
+        setenv("BENCH_STATUS", values[i % 3], 1);
+    }
+    report("libc_setenv", sets, (now_ns() - start) / sets, "ns");
+    unsetenv("BENCH_STATUS");
+}
+
+/* Last-level cache misses so far, from the CPU's counter, or -1 where perf
+ * events are not available (VMs, containers, perf_event_paranoid) */
+static long long cache_misses(void)
+{
+    static int fd = -2;
+    if (fd == -2) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd == -1) {
+            printf("# cache misses not measured: no hardware perf events\n");
+        }
+    }
+    long long count;
+    if (fd == -1 || read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return -1;
+    }
+    return count;
+}
+
+struct bench_item {
+    uint64_t key;
+    uint64_t value;
+};
+
+/* Lists of structs by pointer (elist, one malloc per element) against by
+ * value (vlist): building the short lists the shell keeps (jobs, most
+ * posting lists), finding an element, and removing one. The elist's items
+ * are allocated between other allocations, as they would be in a running
+ * shell, so they are not next to each other. */
+static void bench_vlist(void)
+{
+    static const size_t sizes[] = { 1000, 100000 };
+    const int short_iters = 1000000;
+
+    /* Three jobs, looked up and removed */
+    struct bench_item items[3] = { { 1, 10 }, { 2, 20 }, { 3, 30 } };
+    unsigned long allocs = num_allocs;
+    double start = now_ns();
+    for (int i = 0; i < short_iters; i++) {
+        struct elist *list = elist_create(0);
+        for (int j = 0; j < 3; j++) {
+            elist_add(list, &items[j]);
+        }
+        bench_sink = elist_get(list, elist_index_of(list, &items[2], sizeof(items[2])));
+        elist_destroy(list);
+    }
+    report("short_elist", 3, (now_ns() - start) / short_iters, "ns/list");
+    report("short_elist_allocs", 3, (double) (num_allocs - allocs) / short_iters, "allocs/list");
+
+    allocs = num_allocs;
+    start = now_ns();
+    for (int i = 0; i < short_iters; i++) {
+        struct vlist list;
+        vlist_init(&list, sizeof(struct bench_item *));
+        for (int j = 0; j < 3; j++) {
+            struct bench_item *item = &items[j];
+            vlist_add(&list, &item);
+        }
+        struct bench_item *last = &items[2];
+        bench_sink = vlist_get(&list, vlist_index_of(&list, &last));
+        vlist_destroy(&list);
+    }
+    report("short_vlist", 3, (now_ns() - start) / short_iters, "ns/list");
+    report("short_vlist_allocs", 3, (double) (num_allocs - allocs) / short_iters, "allocs/list");
+
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t num = sizes[s];
+        struct elist *by_ptr = elist_create(num);
+        struct vlist by_value;
+        vlist_init(&by_value, sizeof(struct bench_item));
+        allocs = num_allocs;
+        vlist_reserve(&by_value, num);
+        for (size_t i = 0; i < num; i++) {
+            struct bench_item item = { i, i * 2 };
+            vlist_add(&by_value, &item);
+        }
+        report("vlist_fill_allocs", num, (double) (num_allocs - allocs), "allocs");
+
+        void **spacers = malloc(num * sizeof(void *));
+        srand(num);
+        for (size_t i = 0; i < num; i++) {
+            struct bench_item *item = malloc(sizeof(struct bench_item));
+            item->key = i;
+            item->value = i * 2;
+            elist_add(by_ptr, item);
+            spacers[i] = malloc(16 + rand() % 256);
+        }
+        for (size_t i = 0; i < num; i++) {
+            free(spacers[i]);
+        }
+        free(spacers);
+
+        const int lookups = (int) (20000000 / num);
+        struct {
+            const char *name;
+            struct elist *by_ptr;
+        } kinds[] = { { "index_of_elist", by_ptr }, { "index_of_vlist", NULL } };
+        for (int k = 0; k < 2; k++) {
+            long long misses = cache_misses();
+            start = now_ns();
+            for (int i = 0; i < lookups; i++) {
+                struct bench_item key = { (i * 7919u) % num, (i * 7919u) % num * 2 };
+                if (kinds[k].by_ptr != NULL) {
+                    bench_sink = elist_get(by_ptr, elist_index_of(by_ptr, &key, sizeof(key)));
+                } else {
+                    bench_sink = vlist_get(&by_value, vlist_index_of(&by_value, &key));
+                }
+            }
+            report(kinds[k].name, num, (now_ns() - start) / lookups, "ns/lookup");
+            if (misses != -1) {
+                char name[48];
+                snprintf(name, sizeof(name), "%s_cache_misses", kinds[k].name);
+                report(name, num, (double) (cache_misses() - misses) / lookups, "misses/lookup");
+            }
+        }
+
+        /* Emptying the list from the front, one element at a time */
+        start = now_ns();
+        for (size_t i = 0; i < num; i++) {
+            free(elist_get(by_ptr, 0));
+            elist_remove(by_ptr, 0);
+        }
+        report("remove_elist", num, (now_ns() - start) / num, "ns/op");
+        start = now_ns();
+        for (size_t i = 0; i < num; i++) {
+            vlist_swap_remove(&by_value, 0);
+        }
+        report("swap_remove_vlist", num, (now_ns() - start) / num, "ns/op");
+
+        elist_destroy(by_ptr);
+        vlist_destroy(&by_value);
+    }
+}
+
+/* Tab completion over a PATH of a large directory and a small one (like
+ * ~/bin). Completing a prefix should only cost a stat() per directory;
+ * adding a command to the small directory reads only that one again. */
+static void bench_complete(void)
+{
+    const char *base = getenv("ASH_BENCH_DIR") ? getenv("ASH_BENCH_DIR") : "/tmp";
+    const int sizes[] = { 1000, 30000 };
+    char *saved_path = getenv("PATH") ? strdup(getenv("PATH")) : NULL;
+
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        char big_dir[PATH_MAX / 4];
+        char small_dir[PATH_MAX / 4];
+        char path[PATH_MAX];
+        snprintf(big_dir, sizeof(big_dir), "%s/ash-bench-complete-XXXXXX", base);
+        snprintf(small_dir, sizeof(small_dir), "%s/ash-bench-complete-XXXXXX", base);
+        if (mkdtemp(big_dir) == NULL || mkdtemp(small_dir) == NULL) {
+            perror("mkdtemp");
+            break;
+        }
+        for (int i = 0; i < sizes[s]; i++) {
+            snprintf(path, sizeof(path), "%s/cmd%05d", big_dir, i);
+            close(open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0755));
+        }
+        snprintf(path, sizeof(path), "%s:%s", small_dir, big_dir);
+        setenv("PATH", path, 1);
+        usleep(50000);
+
+        const char **matches;
+        int iters = 200;
+        double start = now_ns();
+        for (int i = 0; i < iters; i++) {
+            complete_reset();
+            complete_command("cmd", &matches);
+        }
+        report("complete_build", sizes[s], (now_ns() - start) / iters / 1e3, "us");
+
+        /* Prefixes matching 10, 100 and every name */
+        const char *prefixes[] = { "cmd0012", "cmd001", "cmd" };
+        size_t num = 0;
+        unsigned long reads = complete_dir_reads();
+        iters = 100000;
+        for (int p = 0; p < sizeof(prefixes) / sizeof(prefixes[0]); p++) {
+            char name[64];
+            start = now_ns();
+            for (int i = 0; i < iters; i++) {
+                num = complete_command(prefixes[p], &matches);
+                bench_sink = matches;
+            }
+            snprintf(name, sizeof(name), "complete_prefix_%zu", num);
+            report(name, sizes[s], (now_ns() - start) / iters / 1e3, "us");
+        }
+        report("complete_prefix_dir_reads", sizes[s],
+                (double) (complete_dir_reads() - reads) / (iters * 3), "reads/op");
+
+        /* A new command in the small directory, found by the next completion */
+        iters = 50;
+        double elapsed = 0;
+        for (int i = 0; i < iters; i++) {
+            snprintf(path, sizeof(path), "%s/new%03d", small_dir, i);
+            close(open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0755));
+            start = now_ns();
+            complete_command("new", &matches);
+            elapsed += now_ns() - start;
+        }
+        report("complete_new_command", sizes[s], elapsed / iters / 1e3, "us");
+
+        /* What completion costs without an index: read every directory */
+        iters = 200;
+        start = now_ns();
+        for (int i = 0; i < iters; i++) {
+            glob_t g;
+            snprintf(path, sizeof(path), "%s/cmd001*", big_dir);
+            glob(path, 0, NULL, &g);
+            snprintf(path, sizeof(path), "%s/cmd001*", small_dir);
+            glob(path, GLOB_APPEND, NULL, &g);
+            for (size_t j = 0; j < g.gl_pathc; j++) {
+                access(g.gl_pathv[j], X_OK);
+            }
+            globfree(&g);
+        }
+        report("complete_scan", sizes[s], (now_ns() - start) / iters / 1e3, "us");
+
+        for (int i = 0; i < sizes[s]; i++) {
+            snprintf(path, sizeof(path), "%s/cmd%05d", big_dir, i);
+            unlink(path);
+        }
+        for (int i = 0; i < 50; i++) {
+            snprintf(path, sizeof(path), "%s/new%03d", small_dir, i);
+            unlink(path);
+        }
+        rmdir(big_dir);
+        rmdir(small_dir);
+    }
+
+    if (saved_path != NULL) {
+        setenv("PATH", saved_path, 1);
+        free(saved_path);
+    }
+    complete_reset();
+}
+
+/* Starts ./ash with 'argv' and writes 'input' (if any) to it through a pipe,
+ * or a terminal if 'tty' is set. Returns the ns until the output of the first
+ * command ("A1B") arrived, or -1; 'total' gets the ns until it exited. */
+static double startup_run(char *argv[], const char *input, bool tty, double *total)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    int read_fd, write_fd;
+    int in_fds[2] = { -1, -1 };
+    int out_fds[2] = { -1, -1 };
+    if (tty) {
+        /* A new session, so the terminal becomes the shell's own */
+        read_fd = write_fd = posix_openpt(O_RDWR | O_NOCTTY);
+        if (read_fd == -1 || grantpt(read_fd) == -1 || unlockpt(read_fd) == -1) {
+            perror("posix_openpt");
+            return -1;
+        }
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO,
+                ptsname(read_fd), O_RDWR, 0);
+        posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDERR_FILENO);
+    } else {
+        if (pipe2(in_fds, O_CLOEXEC) == -1 || pipe2(out_fds, O_CLOEXEC) == -1) {
+            perror("pipe");
+            return -1;
+        }
+        posix_spawn_file_actions_adddup2(&actions, in_fds[0], STDIN_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, out_fds[1], STDOUT_FILENO);
+        read_fd = out_fds[0];
+        write_fd = in_fds[1];
+    }
+
+    pid_t pid;
+    double start = now_ns();
+    int err = posix_spawn(&pid, "./ash", &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (!tty) {
+        close(in_fds[0]);
+        close(out_fds[1]);
+    }
+    if (err != 0) {
+        fprintf(stderr, "startup: cannot run ./ash\n");
+        close(read_fd);
+        if (write_fd != read_fd) {
+            close(write_fd);
+        }
+        return -1;
+    }
+
+    if (input != NULL && write(write_fd, input, strlen(input)) == -1) {
+        perror("startup write");
+    }
+    if (!tty) {
+        close(write_fd);
+    }
+
+    /* Keep the tail of the output in case the marker is split across reads */
+    char buf[4096];
+    size_t len = 0;
+    double first = -1;
+    ssize_t read_sz;
+    while ((read_sz = read(read_fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+        len += read_sz;
+        buf[len] = '\0';
+        if (first < 0 && strstr(buf, "A1B") != NULL) {
+            first = now_ns() - start;
+            if (tty && write(write_fd, "exit\n", 5) == -1) {
+                perror("startup write");
+            }
+        }
+        if (len > sizeof(buf) / 2) {
+            memmove(buf, buf + len - 8, 8);
+            len = 8;
+        }
+    }
+    waitpid(pid, NULL, 0);
+    *total = now_ns() - start;
+    close(read_fd);
+    return first;
+}
+
+/* Time from exec to the first command's output and to exit, for a script
+ * on stdin, 'ash -c' and an interactive session on a terminal (which loads
+ * readline and the history file) */
+static void bench_startup(void)
+{
+    static const char *first_cmd = "printf 'A%sB\\n' 1\n";
+    char *script_argv[] = { "ash", NULL };
+    char *c_argv[] = { "ash", "-c", "printf 'A%sB\\n' 1", NULL };
+    const struct {
+        const char *name;
+        char **argv;
+        const char *input;
+        bool tty;
+        int iters;
+    } modes[] = {
+        { "startup_script", script_argv, first_cmd, false, 500 },
+        { "startup_c", c_argv, NULL, false, 500 },
+        { "startup_interactive", script_argv, first_cmd, true, 200 },
+    };
+
+    char hist_file[] = "/tmp/ash-bench-histXXXXXX";
+    int hist_fd = mkstemp(hist_file);
+    if (hist_fd == -1) {
+        perror("mkstemp");
+        return;
+    }
+    close(hist_fd);
+    setenv("HISTFILE", hist_file, 1);
+
+    for (int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        double first = 0, total = 0;
+        int runs = 0;
+        for (int i = 0; i < modes[m].iters; i++) {
+            double run_total;
+            double run_first = startup_run(modes[m].argv, modes[m].input,
+                    modes[m].tty, &run_total);
+            if (run_first < 0) {
+                break;
+            }
+            first += run_first;
+            total += run_total;
+            runs++;
+        }
+        if (runs == 0) {
+            continue;
+        }
+        char metric[64];
+        snprintf(metric, sizeof(metric), "%s_first_cmd", modes[m].name);
+        report(metric, runs, first / runs / 1e3, "us");
+        snprintf(metric, sizeof(metric), "%s_exit", modes[m].name);
+        report(metric, runs, total / runs / 1e3, "us");
+    }
+
+    unsetenv("HISTFILE");
+    unlink(hist_file);
+}
+
+/* Cost of adding a finished command to the statistics, spread over 64
+ * command names, and how far the histogram's p99 is from the exact one */
+static void bench_stats(void)
+{
+    const int iters = 1000000;
+    char names[64][16];
+    for (int i = 0; i < 64; i++) {
+        snprintf(names[i], sizeof(names[i]), "cmd%d", i);
+    }
+
+    stats_reset();
+    struct stage_time stage = { .status = 0 };
+    unsigned int seed = 1;
+    double start = now_ns();
+    for (int i = 0; i < iters; i++) {
+        stage.name = names[i & 63];
+        stage.elapsed = (rand_r(&seed) % 1000000) / 1e6;
+        stats_record(&stage, 1);
+    }
+    report("stats_record", iters, (now_ns() - start) / iters, "ns/cmd");
+
+    /* Uniform 0-1s for cmd0: the exact p99 is about 0.99s */
+    double p99 = stats_percentile("cmd0", 99);
+    report("stats_p99_error", iters / 64, fabs(p99 - 0.99) * 100 / 0.99, "%");
+    stats_reset();
+}
+
+/* What tracing adds to parsing a line (two spans) when it is off and on, and
+ * the cost of recording a single span */
+static void bench_trace(void)
+{
+    const int iters = 1000000;
+    static bool initialized;
+    if (!initialized) {
+        trace_init("/dev/null");
+        initialized = true;
+    }
+
+    struct arena arena;
+    arena_init(&arena, 0);
+    char buf[128];
+    for (int enabled = 0; enabled <= 1; enabled++) {
+        trace_enabled = enabled;
+        double start = now_ns();
+        for (int i = 0; i < iters; i++) {
+            struct parsed_line parsed;
+            arena_reset(&arena);
+            strcpy(buf, "grep -v foo < in.txt | sort | uniq -c > out.txt");
+            parse_line(buf, &arena, &parsed);
+            bench_sink = parsed.cmds;
+        }
+        report(enabled ? "trace_parse_on" : "trace_parse_off", iters,
+                (now_ns() - start) / iters, "ns/line");
+    }
+    arena_destroy(&arena);
+
+    double start = now_ns();
+    for (int i = 0; i < iters; i++) {
+        TRACE_START(span_start);
+        TRACE_SPAN("bench", span_start, "detail");
+    }
+    report("trace_span", iters, (now_ns() - start) / iters, "ns/span");
+    trace_enabled = false;
+}
+
+static const struct {
+    const char *name;
+    bench_fn fn;
+} benchmarks[] = {
+    { "history", bench_history },
+    { "history_file", bench_history_file },
+    { "history_prefix", bench_history_prefix },
+    { "history_search", bench_history_search },
+    { "path_hash", bench_path_hash },
+    { "spawn", bench_spawn },
+    { "parallel", bench_parallel },
+    { "script", bench_script },
+    { "parse", bench_parse },
+    { "utils", bench_utils },
+    { "shell", bench_shell },
+    { "copy", bench_copy },
+    { "pipeline", bench_pipeline },
+    { "lexer", bench_lexer },
+    { "prompt", bench_prompt },
+    { "trace", bench_trace },
+    { "stats", bench_stats },
+    { "startup", bench_startup },
+    { "wildcard", bench_wildcard },
+    { "complete", bench_complete },
+    { "vars", bench_vars },
+    { "vlist", bench_vlist },
+};
+
+/* Runs every benchmark, or only those named on the command line */
+int main(int argc, char *argv[])
+{
+    /* Describe the machine so results from different runs can be compared */
+    struct utsname uts;
+    time_t now = time(NULL);
+    char date[32];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+    uname(&uts);
+    printf("# date %s\n# host %s %s %s\n# cpus %ld\n", date, uts.nodename,
+            uts.release, uts.machine, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("# name\tparam\tvalue\tunit\n");
+
+    for (int b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        bool selected = (argc == 1);
+        for (int i = 1; i < argc; i++) {
+            if (strcmp(argv[i], benchmarks[b].name) == 0) {
+                selected = true;
+            }
+        }
+        if (selected) {
+            benchmarks[b].fn();
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,625 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "copy.h"
+#include "logger.h"
+
+static int echo_builtin(char **argv);
+static int printf_builtin(char **argv);
+static int pwd_builtin(char **argv);
+static int test_builtin(char **argv);
+static int true_builtin(char **argv);
+static int false_builtin(char **argv);
+
+static const struct {
+    const char *name;
+    builtin_fn fn;
+} builtins[] = {
+    { "echo", echo_builtin },
+    { "printf", printf_builtin },
+    { "pwd", pwd_builtin },
+    { "test", test_builtin },
+    { "[", test_builtin },
+    { "true", true_builtin },
+    { "false", false_builtin },
+};
+
+/* Returns the builtin called 'name', or NULL if it has to be run from PATH */
+builtin_fn builtin_find(const char *name)
+{
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(name, builtins[i].name) == 0) {
+            return builtins[i].fn;
+        }
+    }
+    return NULL;
+}
+
+/* The name of builtin number 'idx', or NULL past the last one */
+const char *builtin_name(size_t idx)
+{
+    return (idx < sizeof(builtins) / sizeof(builtins[0])) ? builtins[idx].name : NULL;
+}
+
+/* Output goes through stdio; a failed write (e.g. a full disk) is reported
+ * like the standalone utilities do */
+static int check_output(const char *name)
+{
+    if (fflush(stdout) == EOF || ferror(stdout)) {
+        fprintf(stderr, "%s: write error: %s\n", name, strerror(errno));
+        clearerr(stdout);
+        return 1;
+    }
+    return 0;
+}
+
+/* Writes the character for the escape sequence after the backslash at 'str'
+ * (\n, \t, \0NNN, \xHH, ...) and returns a pointer past it. Sets 'stop' for
+ * \c, which ends all output. 'octal_zero' selects echo's \0NNN over printf's
+ * \NNN form. */
+static const char *put_escape(const char *str, bool octal_zero, bool *stop)
+{
+    const char *p = str + 1;
+    int c;
+    switch (*p) {
+    case 'a': c = '\a'; break;
+    case 'b': c = '\b'; break;
+    case 'e': c = '\033'; break;
+    case 'f': c = '\f'; break;
+    case 'n': c = '\n'; break;
+    case 'r': c = '\r'; break;
+    case 't': c = '\t'; break;
+    case 'v': c = '\v'; break;
+    case '\\': c = '\\'; break;
+    case 'c':
+        *stop = true;
+        return p + 1;
+    case 'x':
+        if (!isxdigit((unsigned char) p[1])) {
+            putchar('\\');
+            return p;
+        }
+        c = 0;
+        for (int i = 0; i < 2 && isxdigit((unsigned char) p[1]); i++) {
+            p++;
+            c = c * 16 + (isdigit((unsigned char) *p) ? *p - '0' : (tolower(*p) - 'a' + 10));
+        }
+        break;
+    default:
+        if (*p >= '0' && *p <= '7' && (!octal_zero || *p == '0')) {
+            if (octal_zero) {
+                p++;
+            }
+            c = 0;
+            for (int i = 0; i < 3 && *p >= '0' && *p <= '7'; i++, p++) {
+                c = c * 8 + (*p - '0');
+            }
+            putchar(c);
+            return p;
+        }
+        /* Not an escape: print it as it is */
+        putchar('\\');
+        if (*p == '\0') {
+            return p;
+        }
+        c = *p;
+        break;
+    }
+    putchar(c);
+    return p + 1;
+}
+
+/* echo [-neE] [string ...], as in coreutils: -n drops the newline, -e turns
+ * on backslash escapes and -E (the default) turns them off */
+int echo_builtin(char **argv)
+{
+    bool newline = true;
+    bool escapes = false;
+
+    argv++;
+    while (*argv != NULL && (*argv)[0] == '-' && (*argv)[1] != '\0'
+            && strspn(*argv + 1, "neE") == strlen(*argv + 1)) {
+        for (const char *opt = *argv + 1; *opt != '\0'; opt++) {
+            if (*opt == 'n') {
+                newline = false;
+            } else {
+                escapes = (*opt == 'e');
+            }
+        }
+        argv++;
+    }
+
+    bool stop = false;
+    for (bool first = true; *argv != NULL && !stop; argv++, first = false) {
+        if (!first) {
+            putchar(' ');
+        }
+        if (!escapes) {
+            fputs(*argv, stdout);
+            continue;
+        }
+        for (const char *p = *argv; *p != '\0' && !stop; ) {
+            if (*p == '\\') {
+                p = put_escape(p, true, &stop);
+            } else {
+                putchar(*p++);
+            }
+        }
+    }
+    if (newline && !stop) {
+        putchar('\n');
+    }
+    return check_output("echo");
+}
+
+int pwd_builtin(char **argv)
+{
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    puts(cwd);
+    return check_output("pwd");
+}
+
+/* cat [file ...] without options, for copies whose output was redirected to
+ * a file: the data is moved by copy_fd() and never passes through the shell */
+int cat_builtin(char **argv)
+{
+    struct stat out_st;
+    bool out_reg = (fstat(STDOUT_FILENO, &out_st) == 0 && S_ISREG(out_st.st_mode));
+    char *stdin_only[] = { "-", NULL };
+    char **files = (argv[1] != NULL) ? argv + 1 : stdin_only;
+    int status = 0;
+
+    for (; *files != NULL && status != 128 + SIGINT; files++) {
+        bool is_stdin = (strcmp(*files, "-") == 0);
+        int fd = is_stdin ? STDIN_FILENO : open(*files, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "cat: %s: %s\n", *files, strerror(errno));
+            status = 1;
+            continue;
+        }
+
+        /* 'cat a >> a' would never reach the end of its input */
+        struct stat in_st;
+        if (out_reg && fstat(fd, &in_st) == 0 && in_st.st_dev == out_st.st_dev
+                && in_st.st_ino == out_st.st_ino
+                && lseek(fd, 0, SEEK_CUR) < in_st.st_size) {
+            fprintf(stderr, "cat: %s: input file is output file\n", *files);
+            status = 1;
+        } else if (copy_fd(fd, STDOUT_FILENO, NULL) == -1) {
+            if (errno == EINTR) {
+                status = 128 + SIGINT;
+            } else {
+                fprintf(stderr, "cat: %s: %s\n", *files, strerror(errno));
+                status = 1;
+            }
+        }
+
+        if (!is_stdin) {
+            close(fd);
+        }
+    }
+    return status;
+}
+
+int true_builtin(char **argv)
+{
+    return 0;
+}
+
+int false_builtin(char **argv)
+{
+    return 1;
+}
+
+/* Set when a printf argument is not a valid number */
+static bool printf_bad_arg;
+
+/* Converts a printf argument to a number. Like the standalone printf, a
+ * leading quote gives the value of the character after it. */
+static intmax_t printf_number(const char *arg)
+{
+    if (arg == NULL) {
+        return 0;
+    } else if (arg[0] == '\'' || arg[0] == '"') {
+        return (unsigned char) arg[1];
+    }
+
+    char *end;
+    errno = 0;
+    intmax_t val = strtoimax(arg, &end, 0);
+    if (end == arg || *end != '\0' || errno != 0) {
+        fprintf(stderr, "printf: %s: %s\n", arg,
+                (end == arg) ? "expected a numeric value"
+                : (errno != 0) ? strerror(errno) : "value not completely converted");
+        printf_bad_arg = true;
+    }
+    return val;
+}
+
+static long double printf_float(const char *arg)
+{
+    if (arg == NULL) {
+        return 0;
+    } else if (arg[0] == '\'' || arg[0] == '"') {
+        return (unsigned char) arg[1];
+    }
+
+    char *end;
+    long double val = strtold(arg, &end);
+    if (end == arg || *end != '\0') {
+        fprintf(stderr, "printf: %s: %s\n", arg,
+                (end == arg) ? "expected a numeric value" : "value not completely converted");
+        printf_bad_arg = true;
+    }
+    return val;
+}
+
+/* printf format [argument ...]. The format is reused until every argument
+ * has been consumed; missing arguments are empty strings or zero. */
+int printf_builtin(char **argv)
+{
+    if (argv[1] == NULL) {
+        fprintf(stderr, "printf: missing operand\n");
+        return 1;
+    }
+
+    const char *format = argv[1];
+    char **args = argv + 2;
+    bool stop = false;
+    printf_bad_arg = false;
+
+    do {
+        char **first_arg = args;
+        for (const char *p = format; *p != '\0' && !stop; ) {
+            if (*p == '\\') {
+                p = put_escape(p, false, &stop);
+                continue;
+            } else if (*p != '%') {
+                putchar(*p++);
+                continue;
+            } else if (p[1] == '%') {
+                putchar('%');
+                p += 2;
+                continue;
+            }
+
+            /* Copy the conversion spec, resolving '*' widths from arguments,
+             * so it can be handed to printf() with a wider length modifier */
+            char spec[64];
+            size_t len = 0;
+            spec[len++] = *p++;
+            while (*p != '\0' && strchr("-+ #0", *p) != NULL && len < 16) {
+                spec[len++] = *p++;
+            }
+            for (int part = 0; part < 2; part++) {
+                if (part == 1) {
+                    if (*p != '.') {
+                        break;
+                    }
+                    spec[len++] = *p++;
+                }
+                if (*p == '*') {
+                    len += snprintf(spec + len, sizeof(spec) - len, "%d",
+                            (int) printf_number(*args));
+                    if (*args != NULL) {
+                        args++;
+                    }
+                    p++;
+                } else {
+                    while (isdigit((unsigned char) *p) && len < 40) {
+                        spec[len++] = *p++;
+                    }
+                }
+            }
+
+            char conv = *p;
+            if (conv == '\0' || strchr("diouxXfFeEgGaAcsb", conv) == NULL) {
+                fprintf(stderr, "printf: %.*s: invalid conversion specification\n",
+                        (int) (p - format) + (conv != '\0'), format);
+                return 1;
+            }
+            p++;
+
+            const char *arg = *args;
+            if (arg != NULL) {
+                args++;
+            }
+            if (strchr("di", conv) != NULL) {
+                strcpy(spec + len, "jd");
+                printf(spec, printf_number(arg));
+            } else if (strchr("ouxX", conv) != NULL) {
+                spec[len] = 'j';
+                spec[len + 1] = conv;
+                spec[len + 2] = '\0';
+                printf(spec, (uintmax_t) printf_number(arg));
+            } else if (strchr("fFeEgGaA", conv) != NULL) {
+                spec[len] = 'L';
+                spec[len + 1] = conv;
+                spec[len + 2] = '\0';
+                printf(spec, printf_float(arg));
+            } else if (conv == 'c') {
+                strcpy(spec + len, "c");
+                printf(spec, (arg != NULL) ? arg[0] : '\0');
+            } else if (conv == 's') {
+                strcpy(spec + len, "s");
+                printf(spec, (arg != NULL) ? arg : "");
+            } else {
+                /* %b: the argument with its backslash escapes expanded */
+                for (const char *b = (arg != NULL) ? arg : ""; *b != '\0' && !stop; ) {
+                    if (*b == '\\') {
+                        b = put_escape(b, true, &stop);
+                    } else {
+                        putchar(*b++);
+                    }
+                }
+            }
+        }
+
+        /* A format that used no arguments is not repeated */
+        if (args == first_arg) {
+            break;
+        }
+    } while (*args != NULL && !stop);
+
+    int status = check_output("printf");
+    return (printf_bad_arg || status != 0) ? 1 : 0;
+}
+
+/* 'test' and '[' parse their arguments with a small recursive descent
+ * parser; 'test_argv' is the next argument and 'test_end' is past the last */
+static char **test_argv;
+static char **test_end;
+static bool test_failed;
+
+static bool test_or(void);
+
+static void test_error(const char *msg, const char *arg)
+{
+    if (!test_failed) {
+        if (arg != NULL) {
+            fprintf(stderr, "test: %s: %s\n", arg, msg);
+        } else {
+            fprintf(stderr, "test: %s\n", msg);
+        }
+    }
+    test_failed = true;
+}
+
+static bool is_unary_op(const char *op)
+{
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0'
+        && strchr("bcdefghkLnprsStuwxzOG", op[1]) != NULL;
+}
+
+static bool is_binary_op(const char *op)
+{
+    static const char *ops[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+        "-nt", "-ot", "-ef",
+    };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (strcmp(op, ops[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static intmax_t test_integer(const char *arg)
+{
+    char *end;
+    errno = 0;
+    intmax_t val = strtoimax(arg, &end, 10);
+    while (isspace((unsigned char) *end)) {
+        end++;
+    }
+    if (end == arg || *end != '\0' || errno != 0) {
+        test_error("integer expression expected", arg);
+    }
+    return val;
+}
+
+static bool test_unary(const char *op, const char *arg)
+{
+    struct stat st;
+    switch (op[1]) {
+    case 'n':
+        return arg[0] != '\0';
+    case 'z':
+        return arg[0] == '\0';
+    case 't':
+        return isatty((int) test_integer(arg));
+    case 'h':
+    case 'L':
+        return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    case 'r':
+        return faccessat(AT_FDCWD, arg, R_OK, AT_EACCESS) == 0;
+    case 'w':
+        return faccessat(AT_FDCWD, arg, W_OK, AT_EACCESS) == 0;
+    case 'x':
+        return faccessat(AT_FDCWD, arg, X_OK, AT_EACCESS) == 0;
+    }
+
+    if (stat(arg, &st) != 0) {
+        return false;
+    }
+    switch (op[1]) {
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'f': return S_ISREG(st.st_mode);
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    case 'k': return (st.st_mode & S_ISVTX) != 0;
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    case 'O': return st.st_uid == geteuid();
+    case 'G': return st.st_gid == getegid();
+    default:  return true;  /* -e */
+    }
+}
+
+static bool test_binary(const char *lhs, const char *op, const char *rhs)
+{
+    if (op[0] != '-') {
+        int cmp = strcmp(lhs, rhs);
+        switch (op[0]) {
+        case '=': return cmp == 0;
+        case '!': return cmp != 0;
+        case '<': return cmp < 0;
+        default:  return cmp > 0;
+        }
+    }
+
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat l, r;
+        bool have_l = (stat(lhs, &l) == 0);
+        bool have_r = (stat(rhs, &r) == 0);
+        if (op[1] == 'e') {
+            return have_l && have_r && l.st_dev == r.st_dev && l.st_ino == r.st_ino;
+        }
+        if (!have_l || !have_r) {
+            return (op[1] == 'n') ? have_l : have_r;
+        }
+        long long ldiff = (long long) l.st_mtim.tv_sec - r.st_mtim.tv_sec;
+        long ndiff = l.st_mtim.tv_nsec - r.st_mtim.tv_nsec;
+        int cmp = (ldiff != 0) ? (ldiff > 0) - (ldiff < 0) : (ndiff > 0) - (ndiff < 0);
+        return (op[1] == 'n') ? cmp > 0 : cmp < 0;
+    }
+
+    intmax_t l = test_integer(lhs);
+    intmax_t r = test_integer(rhs);
+    if (strcmp(op, "-eq") == 0) return l == r;
+    if (strcmp(op, "-ne") == 0) return l != r;
+    if (strcmp(op, "-lt") == 0) return l < r;
+    if (strcmp(op, "-le") == 0) return l <= r;
+    if (strcmp(op, "-gt") == 0) return l > r;
+    return l >= r;
+}
+
+/* primary: '!' primary | '(' or ')' | unary-op arg | arg binary-op arg | arg */
+static bool test_primary(void)
+{
+    size_t left = test_end - test_argv;
+    if (left == 0) {
+        test_error("argument expected", NULL);
+        return false;
+    }
+
+    char *arg = *test_argv;
+    if (left >= 3 && is_binary_op(test_argv[1])) {
+        test_argv += 3;
+        return test_binary(arg, test_argv[-2], test_argv[-1]);
+    } else if (strcmp(arg, "!") == 0) {
+        test_argv++;
+        return !test_primary();
+    } else if (strcmp(arg, "(") == 0) {
+        test_argv++;
+        bool result = test_or();
+        if (test_argv == test_end || strcmp(*test_argv, ")") != 0) {
+            test_error("')' expected", NULL);
+            return false;
+        }
+        test_argv++;
+        return result;
+    } else if (left >= 2 && is_unary_op(arg)) {
+        test_argv += 2;
+        return test_unary(arg, test_argv[-1]);
+    }
+    test_argv++;
+    return arg[0] != '\0';
+}
+
+static bool test_and(void)
+{
+    bool result = test_primary();
+    while (test_argv != test_end && strcmp(*test_argv, "-a") == 0) {
+        test_argv++;
+        result = test_primary() && result;
+    }
+    return result;
+}
+
+bool test_or(void)
+{
+    bool result = test_and();
+    while (test_argv != test_end && strcmp(*test_argv, "-o") == 0) {
+        test_argv++;
+        result = test_and() || result;
+    }
+    return result;
+}
+
+/* test expression, or [ expression ]. Up to four arguments are decided by
+ * their count the way POSIX specifies, so 'test -n' or 'test = =' mean what
+ * they say; longer expressions are parsed with -a, -o, ! and parentheses.
+ * Returns 0 if the expression is true, 1 if false and 2 on errors. */
+int test_builtin(char **argv)
+{
+    size_t argc = 0;
+    while (argv[argc] != NULL) {
+        argc++;
+    }
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        argc--;
+    }
+
+    test_argv = argv + 1;
+    test_end = argv + argc;
+    test_failed = false;
+    size_t n = argc - 1;
+    bool negate = false;
+
+    /* "! expr" with up to three arguments after the '!' is a negation */
+    if (n >= 2 && n <= 4 && strcmp(test_argv[0], "!") == 0
+            && !(n == 3 && is_binary_op(test_argv[1]))) {
+        negate = true;
+        test_argv++;
+        n--;
+    }
+
+    bool result;
+    if (n == 0) {
+        result = false;
+    } else if (n == 1) {
+        result = test_argv[0][0] != '\0';
+    } else if (n == 2 && is_unary_op(test_argv[0])) {
+        result = test_unary(test_argv[0], test_argv[1]);
+    } else if (n == 3 && is_binary_op(test_argv[1])) {
+        result = test_binary(test_argv[0], test_argv[1], test_argv[2]);
+    } else if (n == 3 && strcmp(test_argv[0], "(") == 0
+            && strcmp(test_argv[2], ")") == 0) {
+        result = test_argv[1][0] != '\0';
+    } else {
+        result = test_or();
+        if (test_argv != test_end) {
+            test_error("extra argument", *test_argv);
+        }
+    }
+
+    if (test_failed) {
+        return 2;
+    }
+    return (result != negate) ? 0 : 1;
+}
@@ -0,0 +1,20 @@
+/**
+ * @file
+ *
+ * Simple utilities built into the shell (echo, printf, pwd, test/[, true and
+ * false) so that running one does not cost a fork and exec. They take an
+ * argument vector like main() and write to the shell's stdout.
+ */
+
+#ifndef _BUILTINS_H_
+#define _BUILTINS_H_
+
+#include <stddef.h>
+
+typedef int (*builtin_fn)(char **argv);
+
+builtin_fn builtin_find(const char *name);
+const char *builtin_name(size_t idx);
+int cat_builtin(char **argv);
+
+#endif
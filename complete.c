@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "complete.h"
+#include "logger.h"
+
+#define NAMES_BUF_SZ 4096
+
+/* The executables in one PATH directory. Like the listings in wildcard.c,
+ * they are reused while the directory's mtime stays the same, unless they
+ * were read in the same clock tick as that mtime ('racy'). */
+struct path_dir {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    bool racy;
+    char *names;        /*!< NUL-terminated names, back to back; NULL if
+                             the directory could not be read */
+    const char **sorted_names;
+    size_t num_names;
+};
+
+static struct path_dir *dirs;
+static size_t num_dirs;
+static char *indexed_path;   /* PATH the directories came from */
+
+/* Names the shell added itself (its builtins) */
+static char **extra_names;
+static size_t num_extra;
+
+/* Every name once, sorted; merged again from the directories' own sorted
+ * names after one of them changed */
+static const char **sorted;
+static size_t num_sorted;
+static bool sorted_stale = true;
+static unsigned long dir_reads;   /* Directories read, for benchmarks */
+
+static void check_path_env(void);
+static void refresh_dirs(void);
+static int dir_read(struct path_dir *dir);
+static bool is_executable(int dir_fd, struct dirent *ent);
+static void dirs_free(void);
+static void dir_clear(struct path_dir *dir);
+static int rebuild_sorted(void);
+static size_t merge_names(const char **out, const char **a, size_t num_a,
+        const char **b, size_t num_b);
+static int compare_names(const void *a, const void *b);
+
+/* Adds a name that is not on PATH, such as a builtin */
+int complete_add_name(const char *name)
+{
+    char *copy = strdup(name);
+    if (copy == NULL) {
+        perror("complete strdup");
+        return -1;
+    }
+    char **new_names = realloc(extra_names, (num_extra + 1) * sizeof(char *));
+    if (new_names == NULL) {
+        perror("complete realloc");
+        free(copy);
+        return -1;
+    }
+    extra_names = new_names;
+    extra_names[num_extra++] = copy;
+    sorted_stale = true;
+    return 0;
+}
+
+/* Points 'matches' at the sorted commands starting with 'prefix' and returns
+ * how many there are. The names stay valid until the next call. */
+size_t complete_command(const char *prefix, const char ***matches)
+{
+    *matches = NULL;
+    check_path_env();
+    refresh_dirs();
+    if (sorted_stale && rebuild_sorted() == -1) {
+        return 0;
+    }
+
+    /* The first name not below the prefix, then the first one past the
+     * names starting with it */
+    size_t prefix_len = strlen(prefix);
+    size_t low = 0;
+    size_t high = num_sorted;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strcmp(sorted[mid], prefix) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    size_t first = low;
+    high = num_sorted;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (strncmp(sorted[mid], prefix, prefix_len) == 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    *matches = sorted + first;
+    return low - first;
+}
+
+/* Forgets the PATH directories, so the next completion reads them all */
+void complete_reset(void)
+{
+    dirs_free();
+    free(indexed_path);
+    indexed_path = NULL;
+    free(sorted);
+    sorted = NULL;
+    num_sorted = 0;
+    sorted_stale = true;
+}
+
+unsigned long complete_dir_reads(void)
+{
+    return dir_reads;
+}
+
+/* A new PATH starts the directories over */
+void check_path_env(void)
+{
+    const char *path_env = getenv("PATH");
+    if (path_env == NULL) {
+        path_env = "/bin:/usr/bin";
+    }
+    if (indexed_path != NULL && strcmp(indexed_path, path_env) == 0) {
+        return;
+    }
+
+    LOG("Indexing commands on PATH: %s\n", path_env);
+    dirs_free();
+    free(indexed_path);
+    indexed_path = strdup(path_env);
+    sorted_stale = true;
+
+    size_t max_dirs = 1;
+    for (const char *c = path_env; *c != '\0'; c++) {
+        max_dirs += (*c == ':');
+    }
+    dirs = calloc(max_dirs, sizeof(struct path_dir));
+    if (indexed_path == NULL || dirs == NULL) {
+        perror("complete calloc");
+        return;
+    }
+
+    const char *start = path_env;
+    while (true) {
+        size_t len = strcspn(start, ":");
+        /* An empty PATH element means the current directory */
+        char *path = (len == 0) ? strdup(".") : strndup(start, len);
+        if (path == NULL) {
+            perror("complete strdup");
+            return;
+        }
+        dirs[num_dirs++].path = path;
+        if (start[len] == '\0') {
+            break;
+        }
+        start += len + 1;
+    }
+}
+
+/* One stat() per directory; only those that changed are read again */
+void refresh_dirs(void)
+{
+    for (size_t i = 0; i < num_dirs; i++) {
+        struct path_dir *dir = &dirs[i];
+        struct stat st;
+        if (stat(dir->path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+            if (dir->names != NULL) {
+                dir_clear(dir);
+                sorted_stale = true;
+            }
+            continue;
+        }
+        if (dir->names != NULL && !dir->racy && dir->dev == st.st_dev
+                && dir->ino == st.st_ino
+                && dir->mtime.tv_sec == st.st_mtim.tv_sec
+                && dir->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            continue;
+        }
+
+        dir_clear(dir);
+        sorted_stale = true;
+        dir_read(dir);
+    }
+}
+
+int dir_read(struct path_dir *dir)
+{
+    int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct timespec read_start;
+    struct stat st;
+    clock_gettime(CLOCK_REALTIME_COARSE, &read_start);
+    DIR *dir_stream = NULL;
+    if (fstat(fd, &st) == -1 || (dir_stream = fdopendir(fd)) == NULL) {
+        close(fd);
+        return -1;
+    }
+    dir->dev = st.st_dev;
+    dir->ino = st.st_ino;
+    dir->mtime = st.st_mtim;
+    dir->racy = (st.st_mtim.tv_sec > read_start.tv_sec
+            || (st.st_mtim.tv_sec == read_start.tv_sec
+                && st.st_mtim.tv_nsec >= read_start.tv_nsec));
+
+    size_t names_cap = NAMES_BUF_SZ;
+    size_t names_len = 0;
+    size_t num = 0;
+    char *names = malloc(names_cap);
+    if (names == NULL) {
+        perror("complete malloc");
+        closedir(dir_stream);
+        return -1;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir_stream)) != NULL) {
+        if (!is_executable(fd, ent)) {
+            continue;
+        }
+        size_t name_sz = strlen(ent->d_name) + 1;
+        if (names_len + name_sz > names_cap) {
+            names_cap = (names_cap * 2 > names_len + name_sz)
+                ? names_cap * 2 : names_len + name_sz;
+            char *new_names = realloc(names, names_cap);
+            if (new_names == NULL) {
+                perror("complete realloc");
+                free(names);
+                closedir(dir_stream);
+                return -1;
+            }
+            names = new_names;
+        }
+        memcpy(names + names_len, ent->d_name, name_sz);
+        names_len += name_sz;
+        num++;
+    }
+    closedir(dir_stream);
+
+    /* The names stay where they are now, so they can be pointed at */
+    const char **sorted_names = malloc((num + 1) * sizeof(char *));
+    if (sorted_names == NULL) {
+        perror("complete malloc");
+        free(names);
+        return -1;
+    }
+    const char *name = names;
+    for (size_t i = 0; i < num; i++) {
+        sorted_names[i] = name;
+        name += strlen(name) + 1;
+    }
+    qsort(sorted_names, num, sizeof(char *), compare_names);
+
+    dir->names = names;
+    dir->sorted_names = sorted_names;
+    dir->num_names = num;
+    dir_reads++;
+    LOG("Indexed %s: %zu commands%s\n", dir->path, num, dir->racy ? " (racy)" : "");
+    return 0;
+}
+
+/* Regular files we may run, as path_search() in pathhash.c would find them.
+ * d_type saves a stat() for everything but symlinks. */
+bool is_executable(int dir_fd, struct dirent *ent)
+{
+    const char *name = ent->d_name;
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        return false;
+    }
+    if (ent->d_type != DT_REG) {
+        struct stat st;
+        if (ent->d_type != DT_LNK && ent->d_type != DT_UNKNOWN) {
+            return false;
+        }
+        if (fstatat(dir_fd, name, &st, 0) == -1 || !S_ISREG(st.st_mode)) {
+            return false;
+        }
+    }
+    return faccessat(dir_fd, name, X_OK, 0) == 0;
+}
+
+void dir_clear(struct path_dir *dir)
+{
+    free(dir->names);
+    free(dir->sorted_names);
+    dir->names = NULL;
+    dir->sorted_names = NULL;
+    dir->num_names = 0;
+}
+
+void dirs_free(void)
+{
+    for (size_t i = 0; i < num_dirs; i++) {
+        free(dirs[i].path);
+        dir_clear(&dirs[i]);
+    }
+    free(dirs);
+    dirs = NULL;
+    num_dirs = 0;
+}
+
+/* Merges the directories' sorted names and the extra names, dropping
+ * duplicates (the same command in several directories). Only a directory
+ * that changed was sorted again; the rest is a merge per directory, not a
+ * sort of every name. */
+int rebuild_sorted(void)
+{
+    size_t total = num_extra;
+    for (size_t i = 0; i < num_dirs; i++) {
+        total += dirs[i].num_names;
+    }
+
+    const char **names = malloc((total + 1) * sizeof(char *));
+    const char **scratch = malloc((total + 1) * sizeof(char *));
+    if (names == NULL || scratch == NULL) {
+        perror("complete malloc");
+        free(names);
+        free(scratch);
+        return -1;
+    }
+
+    /* 'names' always holds the merged result so far */
+    memcpy(scratch, extra_names, num_extra * sizeof(char *));
+    qsort(scratch, num_extra, sizeof(char *), compare_names);
+    size_t num = merge_names(names, scratch, num_extra, NULL, 0);
+    for (size_t i = 0; i < num_dirs; i++) {
+        const char **merged = scratch;
+        num = merge_names(merged, names, num, dirs[i].sorted_names, dirs[i].num_names);
+        scratch = names;
+        names = merged;
+    }
+
+    free(scratch);
+    free(sorted);
+    sorted = names;
+    num_sorted = num;
+    sorted_stale = false;
+    LOG("Command index: %zu names\n", num);
+    return 0;
+}
+
+/* Merges two sorted arrays into 'out', keeping one of any equal names */
+size_t merge_names(const char **out, const char **a, size_t num_a,
+        const char **b, size_t num_b)
+{
+    size_t i = 0;
+    size_t j = 0;
+    size_t num = 0;
+    while (i < num_a && j < num_b) {
+        int cmp = strcmp(a[i], b[j]);
+        if (cmp <= 0) {
+            j += (cmp == 0);
+            out[num++] = a[i++];
+        } else {
+            out[num++] = b[j++];
+        }
+    }
+    for (; i < num_a; i++) {
+        if (num == 0 || strcmp(out[num - 1], a[i]) != 0) {
+            out[num++] = a[i];
+        }
+    }
+    for (; j < num_b; j++) {
+        out[num++] = b[j];
+    }
+    return num;
+}
+
+int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(const char **) a, *(const char **) b);
+}
@@ -0,0 +1,21 @@
+/**
+ * @file
+ *
+ * Index of command names for tab completion: every executable in the PATH
+ * directories plus the builtins, kept sorted so the names starting with a
+ * prefix are one binary search away. A PATH directory is only read again
+ * once its mtime changes, so the index is built once and then updated one
+ * directory at a time.
+ */
+
+#ifndef _COMPLETE_H_
+#define _COMPLETE_H_
+
+#include <stddef.h>
+
+int complete_add_name(const char *name);
+size_t complete_command(const char *prefix, const char ***matches);
+void complete_reset(void);
+unsigned long complete_dir_reads(void);
+
+#endif
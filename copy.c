@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "copy.h"
+#include "logger.h"
+
+/* Bytes asked for per system call; small enough that Ctrl-C is noticed
+ * quickly during a large copy */
+#define CHUNK_SZ (64 * 1024 * 1024)
+#define BUF_SZ (128 * 1024)
+
+/* The shell ignores SIGINT, so a copy running inside it installs a handler
+ * that only records the interrupt */
+static volatile sig_atomic_t interrupted;
+
+static void sigint_handler(int signo);
+static ssize_t copy_with(enum copy_method method, int in_fd, int out_fd,
+        size_t *total);
+
+/* Copies everything from 'in_fd' to 'out_fd', starting at their current
+ * offsets, with the cheapest method the two files allow. A method the kernel
+ * or filesystem turns down is dropped for the next one, carrying on from
+ * wherever it stopped. Returns the number of bytes copied, or -1 with errno
+ * set (EINTR if the copy was interrupted with Ctrl-C). */
+ssize_t copy_fd(int in_fd, int out_fd, enum copy_method *method)
+{
+    struct stat in_st;
+    struct stat out_st;
+    if (fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1) {
+        return -1;
+    }
+
+    /* copy_file_range(), splice() and sendfile() refuse O_APPEND files.
+     * Writing at an offset instead could overwrite what another process
+     * appends meanwhile, so appending keeps to write() */
+    int flags = fcntl(out_fd, F_GETFL);
+    bool append = (flags != -1 && (flags & O_APPEND));
+
+    struct sigaction sa;
+    struct sigaction old_sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigint_handler;
+    sigemptyset(&sa.sa_mask);
+    interrupted = 0;
+    sigaction(SIGINT, &sa, &old_sa);
+
+    bool in_reg = S_ISREG(in_st.st_mode);
+    bool out_reg = S_ISREG(out_st.st_mode);
+    bool fifo = S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode);
+    enum copy_method methods[] = {
+        COPY_FILE_RANGE, COPY_SPLICE, COPY_SENDFILE, COPY_READ_WRITE
+    };
+    bool usable[] = {
+        in_reg && out_reg && !append, fifo && !append, in_reg && !append, true
+    };
+
+    size_t total = 0;
+    ssize_t result = -1;
+    for (int m = 0; m < sizeof(methods) / sizeof(methods[0]); m++) {
+        if (!usable[m]) {
+            continue;
+        }
+
+        result = copy_with(methods[m], in_fd, out_fd, &total);
+        if (method != NULL) {
+            *method = methods[m];
+        }
+
+        /* Files in /proc and the like claim to be empty, and only read()
+         * returns what they contain */
+        if (result == 0 && total == 0 && in_reg && in_st.st_size == 0
+                && methods[m] != COPY_READ_WRITE) {
+            continue;
+        } else if (result == 0 || interrupted) {
+            break;
+        } else if (errno != EINVAL && errno != ENOSYS && errno != EXDEV
+                && errno != EOPNOTSUPP && errno != EBADF && errno != ETXTBSY) {
+            break;
+        }
+        LOG("Copy method %d unavailable: %s\n", methods[m], strerror(errno));
+    }
+
+    int saved_errno = errno;
+    sigaction(SIGINT, &old_sa, NULL);
+    if (interrupted) {
+        errno = EINTR;
+        return -1;
+    }
+    errno = saved_errno;
+    return (result == 0) ? total : -1;
+}
+
+/* Copies with read() and write() through a buffer, which works for any pair
+ * of files. Returns the number of bytes copied or -1 on errors. */
+ssize_t copy_fd_read_write(int in_fd, int out_fd)
+{
+    size_t total = 0;
+    return (copy_with(COPY_READ_WRITE, in_fd, out_fd, &total) == 0) ? total : -1;
+}
+
+void sigint_handler(int signo)
+{
+    interrupted = 1;
+}
+
+/* Runs one copy method until the end of the input. Returns 0 at the end of
+ * the input or -1 with errno set; 'total' counts the bytes copied. */
+ssize_t copy_with(enum copy_method method, int in_fd, int out_fd, size_t *total)
+{
+    char buf[method == COPY_READ_WRITE ? BUF_SZ : 1];
+    while (!interrupted) {
+        ssize_t n;
+        switch (method) {
+        case COPY_FILE_RANGE:
+            n = copy_file_range(in_fd, NULL, out_fd, NULL, CHUNK_SZ, 0);
+            break;
+        case COPY_SPLICE:
+            n = splice(in_fd, NULL, out_fd, NULL, CHUNK_SZ, SPLICE_F_MOVE);
+            break;
+        case COPY_SENDFILE:
+            n = sendfile(out_fd, in_fd, NULL, CHUNK_SZ);
+            break;
+        default:
+            n = read(in_fd, buf, sizeof(buf));
+            for (ssize_t off = 0; n > 0 && off < n; ) {
+                ssize_t written = write(out_fd, buf + off, n - off);
+                if (written == -1 && errno != EINTR) {
+                    return -1;
+                }
+                off += (written > 0) ? written : 0;
+                if (interrupted) {
+                    return -1;
+                }
+            }
+            break;
+        }
+
+        if (n == 0) {
+            return 0;
+        } else if (n == -1 && errno != EINTR) {
+            return -1;
+        } else if (n > 0) {
+            *total += n;
+        }
+    }
+    return -1;
+}
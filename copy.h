@@ -0,0 +1,26 @@
+/**
+ * @file
+ *
+ * Copies data between file descriptors inside the kernel where it can:
+ * copy_file_range() between files (which may share extents on filesystems
+ * that support it), splice() to or from pipes and sendfile() from a file to
+ * anything else, falling back to read()/write() when none of them apply.
+ */
+
+#ifndef _COPY_H_
+#define _COPY_H_
+
+#include <sys/types.h>
+
+/* How copy_fd() moved the data, for benchmarks and logging */
+enum copy_method {
+    COPY_FILE_RANGE,
+    COPY_SPLICE,
+    COPY_SENDFILE,
+    COPY_READ_WRITE,
+};
+
+ssize_t copy_fd(int in_fd, int out_fd, enum copy_method *method);
+ssize_t copy_fd_read_write(int in_fd, int out_fd);
+
+#endif
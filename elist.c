@@ -188,3 +188,137 @@ bool idx_is_valid(struct elist *list, size_t idx)
 {
     return !(idx >= list->size);
 }
+
+/* vlist: elements stored by value */
+
+void vlist_init(struct vlist *list, size_t elem_sz)
+{
+    list->size = 0;
+    list->capacity = VLIST_INLINE_SZ / elem_sz;
+    list->elem_sz = elem_sz;
+}
+
+void vlist_destroy(struct vlist *list)
+{
+    if (!vlist_is_inline(list)) {
+        free(list->storage.heap);
+    }
+    vlist_init(list, list->elem_sz);
+}
+
+/* Makes room for at least 'capacity' elements, so that many adds in a row
+ * allocate at most once */
+int vlist_reserve(struct vlist *list, size_t capacity)
+{
+    if (capacity <= list->capacity) {
+        return 0;
+    }
+    if (capacity > UINT32_MAX) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    void *new_elements;
+    if (vlist_is_inline(list)) {
+        new_elements = malloc(list->elem_sz * capacity);
+        if (new_elements != NULL) {
+            memcpy(new_elements, list->storage.inline_elems, list->elem_sz * list->size);
+        }
+    } else {
+        new_elements = realloc(list->storage.heap, list->elem_sz * capacity);
+    }
+    if (new_elements == NULL) {
+        return -1;
+    }
+
+    LOG("Setting new vlist capacity: %zu (old capacity = %u)\n", capacity, list->capacity);
+    list->storage.heap = new_elements;
+    list->capacity = capacity;
+    return 0;
+}
+
+/* Adds an element at the end and points at it, for the caller to fill in */
+void *vlist_push(struct vlist *list)
+{
+    if (list->size == list->capacity) {
+        size_t capacity = (list->capacity == 0)
+            ? DEFAULT_INIT_SZ : (size_t) list->capacity * RESIZE_MULTIPLIER;
+        if (vlist_reserve(list, capacity) == -1) {
+            return NULL;
+        }
+    }
+
+    size_t idx = list->size++;
+    return (char *) vlist_elements(list) + idx * list->elem_sz;
+}
+
+/* Copies 'item' (elem_sz bytes) to the end of the list */
+ssize_t vlist_add(struct vlist *list, const void *item)
+{
+    void *elem = vlist_push(list);
+    if (elem == NULL) {
+        return -1;
+    }
+    memcpy(elem, item, list->elem_sz);
+    return list->size - 1;
+}
+
+/* Empties the list, keeping its storage */
+void vlist_clear(struct vlist *list)
+{
+    list->size = 0;
+}
+
+/* The elements are next to each other, so this is one pass over memory with
+ * no pointers to follow */
+ssize_t vlist_index_of(struct vlist *list, const void *item)
+{
+    const char *elem = vlist_elements(list);
+    for (size_t i = 0; i < list->size; i++, elem += list->elem_sz) {
+        if (memcmp(elem, item, list->elem_sz) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Removes element 'idx', keeping the order of the rest */
+int vlist_remove(struct vlist *list, size_t idx)
+{
+    return vlist_remove_range(list, idx, 1);
+}
+
+int vlist_remove_range(struct vlist *list, size_t idx, size_t count)
+{
+    if (idx > list->size || count > list->size - idx) {
+        return -1;
+    }
+
+    char *elements = vlist_elements(list);
+    memmove(elements + idx * list->elem_sz, elements + (idx + count) * list->elem_sz,
+            list->elem_sz * (list->size - idx - count));
+    list->size -= count;
+    return 0;
+}
+
+/* Removes element 'idx' in constant time by moving the last element into its
+ * place, for lists whose order does not matter */
+int vlist_swap_remove(struct vlist *list, size_t idx)
+{
+    if (idx >= list->size) {
+        return -1;
+    }
+
+    char *elements = vlist_elements(list);
+    list->size--;
+    if (idx != list->size) {
+        memcpy(elements + idx * list->elem_sz, elements + list->size * list->elem_sz,
+                list->elem_sz);
+    }
+    return 0;
+}
+
+void vlist_sort(struct vlist *list, int (*comparator)(const void *, const void *))
+{
+    qsort(vlist_elements(list), list->size, list->elem_sz, comparator);
+}
@@ -1,10 +1,29 @@
 #ifndef _ELIST_H_
 #define _ELIST_H_
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 struct elist; // lets us know there is a struct called elist, defined in elist.c
 
+/* Bytes of elements a vlist holds without allocating */
+#define VLIST_INLINE_SZ 24
+
+/* List of elements stored by value, back to back, rather than pointers to
+ * them. Short lists fit in the struct itself; longer ones move to the heap.
+ * Either way the struct can be copied like any value (into a bigger hash
+ * table, say), since it holds no pointer into itself. */
+struct vlist {
+    uint32_t size;
+    uint32_t capacity;       /*!< Elements that fit before growing */
+    uint32_t elem_sz;
+    union {
+        unsigned char inline_elems[VLIST_INLINE_SZ];
+        void *heap;          /*!< Once capacity * elem_sz is past the inline size */
+    } storage;
+};
+
 ssize_t elist_add(struct elist *list, void *item);
 size_t elist_capacity(struct elist *list);
 void elist_clear(struct elist *list);
@@ -20,4 +39,41 @@ size_t elist_size(struct elist *list);
 void elist_sort(struct elist *list, int (*comparator)(const void *, const void *));
 void **elist_elements(struct elist *list);
 
+void vlist_init(struct vlist *list, size_t elem_sz);
+void vlist_destroy(struct vlist *list);
+ssize_t vlist_add(struct vlist *list, const void *item);
+void vlist_clear(struct vlist *list);
+ssize_t vlist_index_of(struct vlist *list, const void *item);
+void *vlist_push(struct vlist *list);
+int vlist_remove(struct vlist *list, size_t idx);
+int vlist_remove_range(struct vlist *list, size_t idx, size_t count);
+int vlist_reserve(struct vlist *list, size_t capacity);
+void vlist_sort(struct vlist *list, int (*comparator)(const void *, const void *));
+int vlist_swap_remove(struct vlist *list, size_t idx);
+
+/* Element access is inline: it sits in the loops of the lists' users */
+static inline bool vlist_is_inline(const struct vlist *list)
+{
+    return (size_t) list->capacity * list->elem_sz <= VLIST_INLINE_SZ;
+}
+
+static inline void *vlist_elements(struct vlist *list)
+{
+    return vlist_is_inline(list) ? list->storage.inline_elems : list->storage.heap;
+}
+
+static inline size_t vlist_size(const struct vlist *list)
+{
+    return list->size;
+}
+
+/* Points at element 'idx', which stays put until the list is changed */
+static inline void *vlist_get(struct vlist *list, size_t idx)
+{
+    if (idx >= list->size) {
+        return NULL;
+    }
+    return (char *) vlist_elements(list) + idx * list->elem_sz;
+}
+
 #endif
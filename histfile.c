@@ -0,0 +1,443 @@
+/**
+ * @file
+ *
+ * Persistent, append-only history log. The file is a header line holding the
+ * number of entries followed by one command per line. At startup the whole
+ * file is mapped read-only and nothing else is done; lines are located lazily
+ * (scanning backwards from the end) only when a lookup reaches them. Prefix
+ * lookups go through a radix tree that entries join as a backwards scan
+ * passes them, so each entry is scanned at most once per session.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "histfile.h"
+#include "logger.h"
+#include "radix.h"
+
+#define HDR_FMT "#ash-history %020u\n"
+#define HDR_MAGIC "#ash-history "
+#define HDR_SZ 34
+
+static char *path;
+static int fd = -1;
+static unsigned int file_limit;
+
+/* Snapshot of the file taken at startup */
+static char *map;
+static size_t map_sz;
+static unsigned int count;
+
+/* Lazily built line index: line_off[i] is the start of entry i. Entries
+ * [count - indexed, count) are known, scan_end is where scanning resumes. */
+static size_t *line_off;
+static unsigned int indexed;
+static size_t scan_end;
+
+/* Commands appended by this session, oldest first. They are not in the
+ * snapshot, but prefix lookups still find them. */
+static char **appended;
+static unsigned int num_appended;
+static unsigned int appended_cap;
+
+/* Newest entry per prefix, created on the first prefix lookup. Entry i of
+ * the snapshot is stored as i + 1, and the session's commands follow it.
+ * Snapshot entries [prefix_from, count) are in it so far. */
+static struct radix *prefix_index;
+static unsigned int prefix_from;
+
+/* Lookups return a NUL-terminated copy of the matching line here */
+static char *scratch;
+static size_t scratch_sz;
+
+static int histfile_index_to(unsigned int idx);
+static const char *histfile_line(unsigned int idx, size_t *len);
+static int histfile_compact(void);
+static int histfile_follow(void);
+static int histfile_index_init(void);
+static void histfile_remember(const char *cmd);
+static unsigned int histfile_read_count(const char *hdr, size_t sz);
+
+int histfile_open(const char *file_path, unsigned int limit)
+{
+    fd = open(file_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        perror("history file");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("history file stat");
+        histfile_close();
+        return -1;
+    }
+
+    /* New file: write an empty header */
+    if (st.st_size == 0) {
+        char hdr[HDR_SZ + 1];
+        snprintf(hdr, sizeof(hdr), HDR_FMT, 0);
+        if (pwrite(fd, hdr, HDR_SZ, 0) != HDR_SZ) {
+            perror("history file header");
+            histfile_close();
+            return -1;
+        }
+        st.st_size = HDR_SZ;
+    }
+
+    map_sz = st.st_size;
+    map = mmap(NULL, map_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("history file mmap");
+        map = NULL;
+        histfile_close();
+        return -1;
+    }
+
+    if (map_sz < HDR_SZ || strncmp(map, HDR_MAGIC, strlen(HDR_MAGIC)) != 0) {
+        LOG("%s is not an ash history file\n", file_path);
+        histfile_close();
+        return -1;
+    }
+
+    path = strdup(file_path);
+    file_limit = limit;
+    count = histfile_read_count(map, map_sz);
+
+    /* A torn final write leaves a line without '\n'; it is not an entry */
+    scan_end = map_sz;
+    while (scan_end > HDR_SZ && map[scan_end - 1] != '\n') {
+        scan_end--;
+    }
+    indexed = 0;
+    LOG("Mapped %s: %u entries, %zu bytes\n", file_path, count, map_sz);
+    return 0;
+}
+
+void histfile_close(void)
+{
+    if (map != NULL) {
+        munmap(map, map_sz);
+        map = NULL;
+    }
+    if (fd != -1) {
+        close(fd);
+        fd = -1;
+    }
+    if (prefix_index != NULL) {
+        radix_destroy(prefix_index);
+        prefix_index = NULL;
+    }
+    for (unsigned int i = 0; i < num_appended; i++) {
+        free(appended[i]);
+    }
+    free(appended);
+    appended = NULL;
+    num_appended = 0;
+    appended_cap = 0;
+    free(line_off);
+    free(scratch);
+    free(path);
+    line_off = NULL;
+    scratch = NULL;
+    path = NULL;
+    scratch_sz = 0;
+    count = 0;
+    indexed = 0;
+}
+
+unsigned int histfile_count(void)
+{
+    return count;
+}
+
+/* Returns entry 'idx' (0 is the oldest) or NULL if it cannot be found */
+const char *histfile_get(unsigned int idx)
+{
+    size_t len;
+    const char *line = histfile_line(idx, &len);
+    if (line == NULL) {
+        return NULL;
+    }
+
+    if (len + 1 > scratch_sz) {
+        char *new_scratch = realloc(scratch, len + 1);
+        if (new_scratch == NULL) {
+            perror("history scratch realloc");
+            return NULL;
+        }
+        scratch = new_scratch;
+        scratch_sz = len + 1;
+    }
+    memcpy(scratch, line, len);
+    scratch[len] = '\0';
+    return scratch;
+}
+
+/* Retrieves the most recent entry starting with 'prefix', or NULL. Entries
+ * not indexed yet are older than all the indexed ones, so they are only
+ * scanned (and indexed on the way) when the index has no match. */
+const char *histfile_search_prefix(const char *prefix)
+{
+    if (prefix_index == NULL && histfile_index_init() == -1) {
+        return NULL;
+    }
+
+    unsigned int entry = radix_lookup(prefix_index, prefix);
+    size_t prefix_len = strlen(prefix);
+    while (entry == 0 && prefix_from > 0) {
+        const char *line = histfile_get(prefix_from - 1);
+        if (line == NULL) {
+            prefix_from = 0; // older entries cannot be located either
+            break;
+        }
+        prefix_from--;
+        radix_insert(prefix_index, line, prefix_from + 1);
+        if (strncmp(line, prefix, prefix_len) == 0) {
+            entry = prefix_from + 1;
+        }
+    }
+
+    if (entry == 0) {
+        return NULL;
+    } else if (entry > count) {
+        return appended[entry - count - 1];
+    }
+    return histfile_get(entry - 1);
+}
+
+/* Appends a command to the log, compacting the file when it has grown to
+ * twice its limit. The in-memory snapshot is not changed. */
+void histfile_append(const char *cmd)
+{
+    if (fd == -1) {
+        return;
+    }
+
+    histfile_remember(cmd);
+
+    size_t len = strlen(cmd);
+    char hdr[HDR_SZ + 1];
+    struct stat st;
+
+    flock(fd, LOCK_EX);
+    if (histfile_follow() == -1
+            || fstat(fd, &st) == -1 || pread(fd, hdr, HDR_SZ, 0) != HDR_SZ) {
+        perror("history file");
+        flock(fd, LOCK_UN);
+        return;
+    }
+    unsigned int total = histfile_read_count(hdr, HDR_SZ) + 1;
+
+    struct iovec iov[2] = {
+        { .iov_base = (void *) cmd, .iov_len = len },
+        { .iov_base = "\n", .iov_len = 1 },
+    };
+    if (pwritev(fd, iov, 2, st.st_size) != len + 1) {
+        perror("history file write");
+        flock(fd, LOCK_UN);
+        return;
+    }
+    snprintf(hdr, sizeof(hdr), HDR_FMT, total);
+    pwrite(fd, hdr, HDR_SZ, 0);
+
+    if (total / 2 >= file_limit) {
+        histfile_compact();
+    }
+    flock(fd, LOCK_UN);
+}
+
+/* Extends the lazy index backwards until entry 'idx' is located */
+int histfile_index_to(unsigned int idx)
+{
+    if (idx >= count) {
+        return -1;
+    }
+
+    if (line_off == NULL) {
+        line_off = malloc(sizeof(size_t) * count);
+        if (line_off == NULL) {
+            perror("history index malloc");
+            return -1;
+        }
+    }
+
+    while (count - indexed > idx) {
+        if (scan_end <= HDR_SZ) {
+            return -1; // header claims more entries than the file holds
+        }
+        const char *nl = memrchr(map + HDR_SZ, '\n', scan_end - 1 - HDR_SZ);
+        scan_end = (nl != NULL) ? nl - map + 1 : HDR_SZ;
+        line_off[count - 1 - indexed] = scan_end;
+        indexed++;
+    }
+    return 0;
+}
+
+/* Points at entry 'idx' inside the mapping; the line is not terminated */
+const char *histfile_line(unsigned int idx, size_t *len)
+{
+    if (histfile_index_to(idx) == -1) {
+        return NULL;
+    }
+
+    size_t start = line_off[idx];
+    const char *nl = memchr(map + start, '\n', map_sz - start);
+    *len = nl - (map + start);
+    return map + start;
+}
+
+/* Rewrites the log with only its newest 'file_limit' entries. Called with the
+ * file locked; the startup snapshot stays mapped from the old inode, and
+ * other sessions move to the new file the next time they take the lock. */
+int histfile_compact(void)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+
+    char *cur = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (cur == MAP_FAILED) {
+        perror("history compact mmap");
+        return -1;
+    }
+
+    /* Walk back file_limit lines from the end to find what to keep */
+    size_t start = st.st_size;
+    unsigned int kept = 0;
+    while (kept < file_limit && start > HDR_SZ) {
+        const char *nl = memrchr(cur + HDR_SZ, '\n', start - 1 - HDR_SZ);
+        start = (nl != NULL) ? nl - cur + 1 : HDR_SZ;
+        kept++;
+    }
+
+    /* A name of its own, so sessions compacting at once cannot clash */
+    char *tmp_path = malloc(strlen(path) + strlen(".XXXXXX") + 1);
+    if (tmp_path == NULL) {
+        munmap(cur, st.st_size);
+        return -1;
+    }
+    sprintf(tmp_path, "%s.XXXXXX", path);
+
+    int tmp_fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (tmp_fd == -1) {
+        perror("history compact");
+        munmap(cur, st.st_size);
+        free(tmp_path);
+        return -1;
+    }
+
+    char hdr[HDR_SZ + 1];
+    snprintf(hdr, sizeof(hdr), HDR_FMT, kept);
+    size_t body_sz = st.st_size - start;
+    if (write(tmp_fd, hdr, HDR_SZ) != HDR_SZ
+            || write(tmp_fd, cur + start, body_sz) != body_sz
+            || rename(tmp_path, path) == -1) {
+        perror("history compact");
+        close(tmp_fd);
+        unlink(tmp_path);
+        munmap(cur, st.st_size);
+        free(tmp_path);
+        return -1;
+    }
+    LOG("Compacted %s to %u entries\n", path, kept);
+
+    /* Future appends go to the new file */
+    munmap(cur, st.st_size);
+    free(tmp_path);
+    flock(tmp_fd, LOCK_EX);
+    flock(fd, LOCK_UN); // the startup mapping keeps the old file open
+    close(fd);
+    fd = tmp_fd;
+    return 0;
+}
+
+/* Creates the prefix index with the session's commands; the snapshot's
+ * entries are added by lookups */
+int histfile_index_init(void)
+{
+    prefix_index = radix_create();
+    if (prefix_index == NULL) {
+        return -1;
+    }
+    prefix_from = count;
+    for (unsigned int i = 0; i < num_appended; i++) {
+        radix_insert(prefix_index, appended[i], count + i + 1);
+    }
+    return 0;
+}
+
+/* Keeps a copy of an appended command for prefix lookups */
+void histfile_remember(const char *cmd)
+{
+    if (num_appended == appended_cap) {
+        unsigned int new_cap = (appended_cap > 0) ? appended_cap * 2 : 64;
+        char **new_appended = realloc(appended, new_cap * sizeof(char *));
+        if (new_appended == NULL) {
+            perror("history append realloc");
+            return;
+        }
+        appended = new_appended;
+        appended_cap = new_cap;
+    }
+
+    char *copy = strdup(cmd);
+    if (copy == NULL) {
+        perror("history append strdup");
+        return;
+    }
+    appended[num_appended++] = copy;
+    if (prefix_index != NULL) {
+        radix_insert(prefix_index, copy, count + num_appended);
+    }
+}
+
+/* Called with 'fd' locked. If another session compacted the log, 'path' is
+ * a new file by now and 'fd' the unlinked old one: switch to the new file
+ * (and its lock), so appends are not lost. */
+int histfile_follow(void)
+{
+    while (path != NULL) {
+        struct stat cur_st;
+        struct stat path_st;
+        if (fstat(fd, &cur_st) == -1) {
+            perror("history file stat");
+            return -1;
+        }
+        if (stat(path, &path_st) == -1 || (path_st.st_dev == cur_st.st_dev
+                    && path_st.st_ino == cur_st.st_ino)) {
+            return 0;
+        }
+
+        int new_fd = open(path, O_RDWR | O_CLOEXEC);
+        if (new_fd == -1) {
+            perror("history file");
+            return -1;
+        }
+        flock(new_fd, LOCK_EX);
+        LOG("%s was replaced, following it\n", path);
+        flock(fd, LOCK_UN);
+        close(fd);
+        fd = new_fd;
+    }
+    return 0;
+}
+
+unsigned int histfile_read_count(const char *hdr, size_t sz)
+{
+    if (sz < HDR_SZ) {
+        return 0;
+    }
+    return (unsigned int) strtoul(hdr + strlen(HDR_MAGIC), NULL, 10);
+}
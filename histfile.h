@@ -0,0 +1,19 @@
+/**
+ * @file
+ *
+ * Persistent, memory-mapped history log used by history.c.
+ */
+
+#ifndef _HISTFILE_H_
+#define _HISTFILE_H_
+
+#include <stddef.h>
+
+int histfile_open(const char *file_path, unsigned int limit);
+void histfile_close(void);
+unsigned int histfile_count(void);
+const char *histfile_get(unsigned int idx);
+const char *histfile_search_prefix(const char *prefix);
+void histfile_append(const char *cmd);
+
+#endif
@@ -1,65 +1,138 @@
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "logger.h"
+#include "histfile.h"
 #include "history.h"
-#include "elist.h"
+#include "radix.h"
+#include "trigram.h"
 
-static struct elist *history;
-static int count = 0;
+#define HIST_AVG_CMD_SZ 64
+#define HIST_RING_SZ(cap) ((sizeof(struct hist_entry) + sizeof(uint64_t)) * (cap))
+#define ASCII_LOWER(c) (((c) >= 'A' && (c) <= 'Z') ? (c) + ('a' - 'A') : (c))
+#define SEARCH_QUERY_MAX 256
+#define SEARCH_TERMS_MAX 16
+#define SEARCH_MATCH_LIMIT 256  /* Matches ranked per query */
+#define SEARCH_SCAN_LIMIT 200000 /* Candidates examined per query */
+
+/* History is a fixed-capacity ring of entries. Command text lives in a second
+ * ring of bytes allocated in the same block, so adding a command does not
+ * call malloc (unless the text ring has to grow to hold longer commands) and
+ * evicting the oldest one is just moving the 'first' index. The
+ * block also holds each entry's trigram signature, kept apart from the
+ * entries so fuzzy search can sweep them densely. */
 struct hist_entry {
-    const char *cmd;
-    int cmd_number;
+    size_t offset;           /*!< Start of the command text in the text ring */
+    unsigned int cmd_number; /*!< Command number shown by 'history' */
 };
 
+static struct hist_entry *entries; /* Entry ring, signatures, then text ring */
+static uint64_t *trigram_sigs;
+static unsigned int capacity = 0;
+static unsigned int first = 0;     /* Ring index of the oldest entry */
+static unsigned int size = 0;
+static char *text;
+static size_t text_cap = 0;
+static size_t text_head = 0;       /* Where the next command is written */
+static unsigned int count = 0;
+static struct radix *prefix_index; /* Newest command number per prefix */
+static struct trigram_index *search_index; /* Commands containing a trigram */
+
+static struct hist_entry *hist_entry_at(unsigned int idx);
+static void hist_evict(void);
+static int hist_reserve(size_t len);
+static int hist_grow_text(size_t len);
+static int search_score(const char *cmd, char **terms, int num_terms);
+static const char *term_find(const char *cmd, const char *term);
+static uint64_t cmd_hash(const char *cmd);
+
 void hist_init(unsigned int limit)
 {
-    /* Create history elist */
-    history = elist_create(limit);
+    if (limit == 0) {
+        limit = 1;
+    }
+
+    /* Create history ring and its text storage in a single allocation */
+    capacity = limit;
+    text_cap = (size_t) limit * HIST_AVG_CMD_SZ;
+    entries = malloc(HIST_RING_SZ(capacity) + text_cap);
+    if (entries == NULL) {
+        perror("history malloc");
+        capacity = 0;
+        text_cap = 0;
+        return;
+    }
+    trigram_sigs = (uint64_t *) (entries + capacity);
+    text = (char *) (trigram_sigs + capacity);
+    prefix_index = radix_create();
+    search_index = trigram_create();
+    first = 0;
+    size = 0;
+    text_head = 0;
+    count = 0;
+    LOG("History ring: %u entries, %zu text bytes\n", capacity, text_cap);
 }
 
 void hist_destroy(void)
-{   
-    /* Free each history element */
-    for (int i = 0; i < elist_size(history); i++) {
-        struct hist_entry *hist_elem = elist_get(history, i);
-        free((char *) hist_elem->cmd);
-        free(hist_elem);
-    }
+{
+    /* Text ring shares the entry allocation */
+    histfile_close();
+    radix_destroy(prefix_index);
+    trigram_destroy(search_index);
+    free(entries);
+    entries = NULL;
+    capacity = 0;
+    size = 0;
+}
 
-    /* Destory history elist */
-    elist_destroy(history);
+/* Backs the history with a persistent log. Entries already in the file keep
+ * their numbers, so this session continues counting after them. */
+int hist_load_file(const char *path, unsigned int file_limit)
+{
+    if (histfile_open(path, file_limit) == -1) {
+        return -1;
+    }
+    count = histfile_count();
+    return 0;
 }
 
 void hist_add(const char *cmd)
 {
     /* Ignore invalid command */
-    if (strcmp(cmd, "") == 0) {
+    if (strcmp(cmd, "") == 0 || capacity == 0) {
         return;
     }
 
-    if (count++ >= elist_capacity(history)) {
-        elist_remove(history, 0); // super inefficient
+    size_t len = strlen(cmd) + 1;
+    if (size == capacity) {
+        hist_evict();
     }
-
-    struct hist_entry *hist_elem = malloc(sizeof(struct hist_entry));
-    if (hist_elem == NULL) {
-        perror("hist_elem malloc");
+    if (hist_reserve(len) == -1) {
         return;
     }
 
-    hist_elem->cmd = strdup(cmd);
-    hist_elem->cmd_number = count;
-    elist_add(history, hist_elem);
+    struct hist_entry *hist_elem = &entries[(first + size) % capacity];
+    hist_elem->offset = text_head;
+    hist_elem->cmd_number = ++count;
+    trigram_sigs[hist_elem - entries] = trigram_signature(cmd);
+    memcpy(text + text_head, cmd, len);
+    text_head += len;
+    size++;
+    radix_insert(prefix_index, cmd, count);
+    trigram_add(search_index, cmd, count);
+
+    histfile_append(cmd);
 }
 
 void hist_print(void)
 {
-    for (int i = 0; i < elist_size(history); i++) {
-        struct hist_entry *hist_elem = elist_get(history, i);
-        printf("%d %s\n", hist_elem->cmd_number, hist_elem->cmd);
+    for (unsigned int i = 0; i < size; i++) {
+        struct hist_entry *hist_elem = hist_entry_at(i);
+        printf("%u %s\n", hist_elem->cmd_number, text + hist_elem->offset);
     }
     fflush(stdout); // clear the buffer
 }
@@ -68,42 +141,138 @@ void hist_print(void)
  * or NULL if no match found */
 const char *hist_search_prefix(char *prefix)
 {
-    int idx = -1;
-    for (int i = elist_size(history) - 1; i >= 0; i--) {
-        struct hist_entry *hist_elem = elist_get(history, i);
-        if (strncmp(hist_elem->cmd, prefix, strlen(prefix)) == 0) {
-            idx = i;
-            break;
-        }
+    /* The index covers the in-memory ring */
+    unsigned int cmd_num = radix_lookup(prefix_index, prefix);
+    if (cmd_num != 0) {
+        return hist_search_cnum(cmd_num);
     }
 
-    struct hist_entry *hist_elem = elist_get(history, idx);
-
-    if (hist_elem == NULL) {
-        return NULL;
-    }
-
-    return hist_elem->cmd;
+    /* Fall back to the log, which also has the entries evicted from it */
+    return histfile_search_prefix(prefix);
 }
 
 /* Retrieves a particular command number or NULL if no match found */
 const char *hist_search_cnum(int command_number)
 {
-    /* Find the first command number */
-    struct hist_entry *first_elem = elist_get(history, 0);
-    if (first_elem == NULL) {
+    /* Numbers up to the file's entry count belong to earlier sessions */
+    if (command_number > 0 && command_number <= histfile_count()) {
+        return histfile_get(command_number - 1);
+    }
+
+    if (size == 0) {
         return NULL;
     }
 
-    /* Get proper index */
-    int first_cmd = first_elem->cmd_number;
-    int idx_num = command_number - first_cmd;
-    struct hist_entry *hist_elem = elist_get(history, idx_num);
-    if (hist_elem == NULL) {
+    /* Command numbers in the ring are consecutive, so the index is direct */
+    long idx = (long) command_number - hist_entry_at(0)->cmd_number;
+    if (idx < 0 || idx >= size) {
         return NULL;
     }
-    
-    return hist_elem->cmd;
+
+    return text + hist_entry_at(idx)->offset;
+}
+
+/* Fuzzy reverse search over the in-memory history. Every whitespace-separated
+ * term of 'query' must appear in a match, in any order and ignoring case.
+ * Candidates come from the posting list of the rarest trigram in the query and
+ * are filtered by their trigram signature before any string is compared. They
+ * are ranked by recency, with bonuses for matching at the start of the
+ * command or of a word. Stores up to 'max' distinct matches, best first, and
+ * returns how many were found. */
+int hist_fuzzy_search(const char *query, const char **matches, int max)
+{
+    char buf[SEARCH_QUERY_MAX];
+    char *terms[SEARCH_TERMS_MAX];
+    int num_terms = 0;
+
+    snprintf(buf, sizeof(buf), "%s", query);
+    for (char *c = buf; *c != '\0'; c++) {
+        *c = ASCII_LOWER(*c);
+    }
+    char *next = buf;
+    char *term;
+    while (num_terms < SEARCH_TERMS_MAX
+            && (term = strsep(&next, " \t")) != NULL) {
+        if (*term != '\0') {
+            terms[num_terms++] = term;
+        }
+    }
+    if (num_terms == 0 || size == 0) {
+        return 0;
+    }
+
+    /* Pick the shortest posting list among all the query's trigrams */
+    const unsigned int *driver = NULL;
+    size_t driver_len = 0;
+    uint64_t query_sig = 0;
+    for (int t = 0; t < num_terms; t++) {
+        query_sig |= trigram_signature(terms[t]);
+        for (size_t i = 0; i + 3 <= strlen(terms[t]); i++) {
+            size_t post_len;
+            const unsigned int *post
+                = trigram_postings(search_index, terms[t] + i, &post_len);
+            if (post_len == 0) {
+                return 0; // no command contains this term
+            }
+            if (driver == NULL || post_len < driver_len) {
+                driver = post;
+                driver_len = post_len;
+            }
+        }
+    }
+
+    /* Without a trigram (short terms only), scan the newest entries */
+    unsigned int first_num = hist_entry_at(0)->cmd_number;
+    size_t candidates = driver ? driver_len : size;
+    if (candidates > SEARCH_SCAN_LIMIT) {
+        candidates = SEARCH_SCAN_LIMIT;
+    }
+
+    int scores[max];
+    uint64_t hashes[max];
+    int found = 0;
+    int ranked = 0;
+    for (size_t k = 0; k < candidates && ranked < SEARCH_MATCH_LIMIT; k++) {
+        unsigned int num = driver ? driver[driver_len - 1 - k] : count - k;
+        struct hist_entry *entry = hist_entry_at(num - first_num);
+        if ((trigram_sigs[entry - entries] & query_sig) != query_sig) {
+            continue;
+        }
+
+        const char *cmd = text + entry->offset;
+        int score = search_score(cmd, terms, num_terms);
+        if (score < 0) {
+            continue;
+        }
+        score -= ranked++; // older matches rank lower
+
+        if (found == max && score <= scores[found - 1]) {
+            continue;
+        }
+
+        /* Newer copies of the same command were seen first */
+        uint64_t hash = cmd_hash(cmd);
+        bool duplicate = false;
+        for (int j = 0; j < found && !duplicate; j++) {
+            duplicate = (hashes[j] == hash && strcmp(matches[j], cmd) == 0);
+        }
+        if (duplicate) {
+            continue;
+        }
+
+        /* Insertion into the sorted result list */
+        int pos = (found < max) ? found++ : found - 1;
+        while (pos > 0 && scores[pos - 1] < score) {
+            scores[pos] = scores[pos - 1];
+            hashes[pos] = hashes[pos - 1];
+            matches[pos] = matches[pos - 1];
+            pos--;
+        }
+        scores[pos] = score;
+        hashes[pos] = hash;
+        matches[pos] = cmd;
+    }
+    return found;
 }
 
 /* Retrieve the most recent command number */
@@ -111,3 +280,140 @@ unsigned int hist_last_cnum(void)
 {
     return count;
 }
+
+/* Returns the entry 'idx' places after the oldest one */
+struct hist_entry *hist_entry_at(unsigned int idx)
+{
+    return &entries[(first + idx) % capacity];
+}
+
+/* Drops the oldest entry; its text becomes free space in the text ring */
+void hist_evict(void)
+{
+    struct hist_entry *oldest = hist_entry_at(0);
+    radix_remove(prefix_index, text + oldest->offset);
+    trigram_remove(search_index, text + oldest->offset, oldest->cmd_number);
+    first = (first + 1) % capacity;
+    size--;
+}
+
+/* Makes room for 'len' bytes at text_head, wrapping to the start of the text
+ * ring when the end is full. Entries are only evicted for the count limit,
+ * so when the ring has no gap big enough it grows instead. Returns -1 if
+ * memory ran out. */
+int hist_reserve(size_t len)
+{
+    if (size == 0) {
+        /* Ring is empty, so the text buffer can start over */
+        text_head = 0;
+        if (len <= text_cap) {
+            return 0;
+        }
+    } else {
+        size_t tail = hist_entry_at(0)->offset;
+        if (text_head > tail) {
+            /* Live text is [tail, head): use the end, or wrap around */
+            if (text_cap - text_head >= len) {
+                return 0;
+            }
+            if (tail >= len) {
+                text_head = 0;
+                return 0;
+            }
+        } else if (tail - text_head >= len) {
+            /* Wrapped: the gap between head and the oldest entry fits */
+            return 0;
+        }
+    }
+    return hist_grow_text(len);
+}
+
+/* Moves the text ring into a bigger block with room for 'len' more bytes,
+ * laying the live commands out oldest first from the start */
+int hist_grow_text(size_t len)
+{
+    size_t live = 0;
+    for (unsigned int i = 0; i < size; i++) {
+        live += strlen(text + hist_entry_at(i)->offset) + 1;
+    }
+    size_t new_cap = (text_cap * 2 > live + len) ? text_cap * 2 : live + len;
+
+    struct hist_entry *new_entries = malloc(HIST_RING_SZ(capacity) + new_cap);
+    if (new_entries == NULL) {
+        perror("history malloc");
+        return -1;
+    }
+    memcpy(new_entries, entries, HIST_RING_SZ(capacity));
+    char *new_text = (char *) new_entries + HIST_RING_SZ(capacity);
+    size_t head = 0;
+    for (unsigned int i = 0; i < size; i++) {
+        struct hist_entry *entry = &new_entries[(first + i) % capacity];
+        size_t cmd_sz = strlen(text + entry->offset) + 1;
+        memcpy(new_text + head, text + entry->offset, cmd_sz);
+        entry->offset = head;
+        head += cmd_sz;
+    }
+
+    free(entries);
+    entries = new_entries;
+    trigram_sigs = (uint64_t *) (entries + capacity);
+    text = new_text;
+    text_cap = new_cap;
+    text_head = head;
+    LOG("History text ring grown to %zu bytes\n", text_cap);
+    return 0;
+}
+
+/* Returns the match bonus of 'cmd' for the query terms, or -1 if some term
+ * does not appear in it */
+int search_score(const char *cmd, char **terms, int num_terms)
+{
+    /* Terms shorter than a trigram passed no signature check, so they are the
+     * likeliest to reject the command */
+    for (int t = 0; t < num_terms; t++) {
+        if ((terms[t][1] == '\0' || terms[t][2] == '\0')
+                && term_find(cmd, terms[t]) == NULL) {
+            return -1;
+        }
+    }
+
+    int score = 0;
+    for (int t = 0; t < num_terms; t++) {
+        const char *match = term_find(cmd, terms[t]);
+        if (match == NULL) {
+            return -1;
+        }
+        if (match == cmd) {
+            score += (t == 0) ? 2 * SEARCH_MATCH_LIMIT : SEARCH_MATCH_LIMIT / 2;
+        } else if (strchr(" /-|", match[-1]) != NULL) {
+            score += SEARCH_MATCH_LIMIT / 2;
+        }
+    }
+    return score;
+}
+
+/* Case-insensitive strstr for a term that is already lowercase. Only ASCII
+ * letters are folded, which keeps the inner loop free of library calls. */
+const char *term_find(const char *cmd, const char *term)
+{
+    for (; *cmd != '\0'; cmd++) {
+        size_t i = 0;
+        while (term[i] != '\0' && ASCII_LOWER(cmd[i]) == term[i]) {
+            i++;
+        }
+        if (term[i] == '\0') {
+            return cmd;
+        }
+    }
+    return NULL;
+}
+
+/* FNV-1a hash, used to spot repeated commands among search results */
+uint64_t cmd_hash(const char *cmd)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (; *cmd != '\0'; cmd++) {
+        hash = (hash ^ (unsigned char) *cmd) * 1099511628211ull;
+    }
+    return hash;
+}
@@ -9,10 +9,12 @@
 
 void hist_init(unsigned int);
 void hist_destroy(void);
+int hist_load_file(const char *, unsigned int);
 void hist_add(const char *);
 void hist_print(void);
 const char *hist_search_prefix(char *);
 const char *hist_search_cnum(int);
 unsigned int hist_last_cnum(void);
+int hist_fuzzy_search(const char *, const char **, int);
 
 #endif
@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/pidfd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "jobs.h"
+#include "elist.h"
+#include "stats.h"
+#include "logger.h"
+#include "trace.h"
+
+/* Jobs in the order they were added; the last one is the current job ('+').
+ * There are rarely more than a few, and those stay inside the list itself. */
+static struct vlist jobs;
+
+/* Set by the SIGCHLD handler, which also writes a byte to the pipe so a
+ * poll() on it wakes up even if the signal arrived just before the call */
+static volatile sig_atomic_t child_changed;
+static int sigchld_pipe[2] = { -1, -1 };
+
+static void sigchld_handler(int signo);
+static void drain_sigchld(void);
+static void job_update(struct job *job);
+static struct job *job_at(size_t idx);
+
+/* Creates the job table and installs the SIGCHLD handler */
+int jobs_init(void)
+{
+    vlist_init(&jobs, sizeof(struct job *));
+
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("sigchld pipe");
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+        perror("sigaction");
+        return -1;
+    }
+    return 0;
+}
+
+/* Allocates a job for 'num_stages' commands; the per-stage arrays live in the
+ * same block as the job itself */
+struct job *job_create(const char *line, size_t num_stages)
+{
+    size_t sz = sizeof(struct job)
+        + num_stages * (sizeof(struct stage_time) + 2 * sizeof(pid_t) + sizeof(bool));
+    struct job *job = calloc(1, sz);
+    if (job == NULL) {
+        perror("job calloc");
+        return NULL;
+    }
+
+    job->line = strdup(line);
+    job->start = time_now();
+    job->num_stages = num_stages;
+    job->stages = (struct stage_time *) (job + 1);
+    job->pids = (pid_t *) (job->stages + num_stages);
+    job->pidfds = (int *) (job->pids + num_stages);
+    job->is_stopped = (bool *) (job->pidfds + num_stages);
+    for (size_t i = 0; i < num_stages; i++) {
+        job->pids[i] = -1;
+        job->pidfds[i] = -1;
+    }
+    return job;
+}
+
+void job_destroy(struct job *job)
+{
+    for (size_t i = 0; i < job->num_stages; i++) {
+        if (job->pidfds[i] != -1) {
+            close(job->pidfds[i]);
+        }
+        free((char *) job->stages[i].name);
+    }
+    free(job->line);
+    free(job);
+}
+
+/* Records the command and pid of one stage (-1 if it could not be started) */
+void job_set_stage(struct job *job, size_t idx, const char *name, pid_t pid)
+{
+    job->stages[idx].name = (name != NULL) ? strdup(name) : NULL;
+    job->pids[idx] = pid;
+    if (pid == -1) {
+        return;
+    }
+
+    job->pidfds[idx] = pidfd_open(pid, 0);
+    job->running++;
+}
+
+/* Blocks until every stage of the job has exited or all of the ones still
+ * running are stopped. The pidfds report exits and the SIGCHLD pipe reports
+ * stops; either way the stages are then checked with WNOHANG, so children of
+ * other jobs are never reaped here. */
+void job_wait(struct job *job)
+{
+    size_t num_fds = job->num_stages + 1;
+    struct pollfd pfds[num_fds];
+    TRACE_START(start);
+
+    while (job->running > job->stopped) {
+        pfds[0].fd = sigchld_pipe[0];
+        pfds[0].events = POLLIN;
+        for (size_t i = 0; i < job->num_stages; i++) {
+            pfds[i + 1].fd = (job->pids[i] != -1) ? job->pidfds[i] : -1;
+            pfds[i + 1].events = POLLIN;
+        }
+
+        /* Without the pipe nothing reports a stop, so check periodically */
+        int timeout = (sigchld_pipe[0] == -1) ? 10 : -1;
+        if (poll(pfds, num_fds, timeout) == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        drain_sigchld();
+        job_update(job);
+    }
+    TRACE_SPAN("wait", start, job->line);
+}
+
+/* Resumes a stopped job with SIGCONT */
+void job_continue(struct job *job)
+{
+    if (job->pgid != 0) {
+        killpg(job->pgid, SIGCONT);
+    } else {
+        for (size_t i = 0; i < job->num_stages; i++) {
+            if (job->pids[i] != -1) {
+                kill(job->pids[i], SIGCONT);
+            }
+        }
+    }
+
+    /* The WCONTINUED reports may come later; the job is running from now */
+    memset(job->is_stopped, 0, job->num_stages * sizeof(bool));
+    job->stopped = 0;
+    job->reported = false;
+}
+
+/* Wait status of the last stage that failed, or 0 if they all succeeded */
+int job_status(struct job *job)
+{
+    int status = 0;
+    for (size_t i = 0; i < job->num_stages; i++) {
+        if (job->stages[i].status != 0) {
+            status = job->stages[i].status;
+        }
+    }
+    return status;
+}
+
+/* Puts a job in the table, giving it the next job number */
+int job_add(struct job *job)
+{
+    if (job->id != 0) {
+        return job->id;
+    }
+
+    size_t num_jobs = vlist_size(&jobs);
+    struct job *last = (num_jobs > 0) ? job_at(num_jobs - 1) : NULL;
+    job->id = (last != NULL) ? last->id + 1 : 1;
+    if (vlist_add(&jobs, &job) == -1) {
+        perror("job table realloc");
+        job->id = 0;
+        return -1;
+    }
+    LOG("Added job %u (pgid %d): %s\n", job->id, job->pgid, job->line);
+    return job->id;
+}
+
+void job_remove(struct job *job)
+{
+    ssize_t idx = vlist_index_of(&jobs, &job);
+    if (idx != -1) {
+        vlist_remove(&jobs, idx);
+    }
+    job->id = 0;
+}
+
+/* Looks up a job by specification: %n or n for job n, %- for the previous
+ * job and %+, %% or nothing for the current one */
+struct job *job_find(const char *spec)
+{
+    size_t num_jobs = vlist_size(&jobs);
+    if (spec == NULL || strcmp(spec, "") == 0 || strcmp(spec, "%%") == 0
+            || strcmp(spec, "%+") == 0) {
+        return (num_jobs > 0) ? job_at(num_jobs - 1) : NULL;
+    } else if (strcmp(spec, "%-") == 0) {
+        return (num_jobs > 1) ? job_at(num_jobs - 2) : NULL;
+    }
+
+    if (spec[0] == '%') {
+        spec++;
+    }
+    char *endPtr;
+    long id = strtol(spec, &endPtr, 10);
+    if (*endPtr != '\0' || id <= 0) {
+        return NULL;
+    }
+    for (size_t i = 0; i < num_jobs; i++) {
+        struct job *job = job_at(i);
+        if (job->id == id) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+/* Collects state changes of background jobs without blocking. Finished jobs
+ * are removed from the table; if 'report' is set, they and newly stopped
+ * jobs are announced the way the prompt shows them. Does nothing unless a
+ * SIGCHLD arrived since the last call. */
+void jobs_reap(bool report)
+{
+    if (!child_changed) {
+        return;
+    }
+    child_changed = 0;
+    drain_sigchld();
+
+    size_t i = 0;
+    while (i < vlist_size(&jobs)) {
+        struct job *job = job_at(i);
+        job_update(job);
+
+        if (job->running == 0) {
+            if (report) {
+                job_print(job);
+            }
+            vlist_remove(&jobs, i);
+            stats_record(job->stages, job->num_stages);
+            job_destroy(job);
+            continue;
+        }
+
+        if (job->running == job->stopped && !job->reported) {
+            if (report) {
+                job_print(job);
+            }
+            job->reported = true;
+        }
+        i++;
+    }
+}
+
+/* Prints a job the way 'jobs' lists it, e.g. "[1]+  Running    sleep 5 &".
+ * The current job is marked with '+' and the previous one with '-'. */
+void job_print(struct job *job)
+{
+    size_t num_jobs = vlist_size(&jobs);
+    char marker = ' ';
+    if (num_jobs > 0 && job_at(num_jobs - 1) == job) {
+        marker = '+';
+    } else if (num_jobs > 1 && job_at(num_jobs - 2) == job) {
+        marker = '-';
+    }
+
+    char state[32];
+    int status = job_status(job);
+    if (job->running > 0) {
+        strcpy(state, (job->running == job->stopped) ? "Stopped" : "Running");
+    } else if (WIFSIGNALED(status)) {
+        snprintf(state, sizeof(state), "%s", strsignal(WTERMSIG(status)));
+    } else if (status != 0) {
+        snprintf(state, sizeof(state), "Exit %d", WEXITSTATUS(status));
+    } else {
+        strcpy(state, "Done");
+    }
+
+    printf("[%u]%c  %-24s%s\n", job->id, marker, state, job->line);
+    fflush(stdout);
+}
+
+/* The 'jobs' builtin */
+void jobs_print(void)
+{
+    for (size_t i = 0; i < vlist_size(&jobs); i++) {
+        job_print(job_at(i));
+    }
+}
+
+size_t jobs_count(void)
+{
+    return vlist_size(&jobs);
+}
+
+struct job *jobs_get(size_t idx)
+{
+    return (idx < vlist_size(&jobs)) ? job_at(idx) : NULL;
+}
+
+void sigchld_handler(int signo)
+{
+    int saved_errno = errno;
+    child_changed = 1;
+    if (sigchld_pipe[1] != -1) {
+        write(sigchld_pipe[1], "", 1);
+    }
+    errno = saved_errno;
+}
+
+void drain_sigchld(void)
+{
+    char buf[64];
+    while (sigchld_pipe[0] != -1 && read(sigchld_pipe[0], buf, sizeof(buf)) > 0) {
+        continue;
+    }
+}
+
+/* Polls every stage that has not exited yet for a new state */
+void job_update(struct job *job)
+{
+    for (size_t i = 0; i < job->num_stages; i++) {
+        if (job->pids[i] == -1) {
+            continue;
+        }
+
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(job->pids[i], &status,
+                WNOHANG | WUNTRACED | WCONTINUED, &usage);
+        if (pid == 0 || (pid == -1 && errno == EINTR)) {
+            continue;
+        }
+
+        if (pid != -1 && WIFSTOPPED(status)) {
+            if (!job->is_stopped[i]) {
+                job->is_stopped[i] = true;
+                job->stopped++;
+                job->reported = false;
+            }
+            continue;
+        } else if (pid != -1 && WIFCONTINUED(status)) {
+            if (job->is_stopped[i]) {
+                job->is_stopped[i] = false;
+                job->stopped--;
+            }
+            continue;
+        }
+
+        /* Exited, or already gone (ECHILD) */
+        if (pid != -1) {
+            job->stages[i].status = status;
+            job->stages[i].usage = usage;
+        }
+        job->stages[i].elapsed = time_now() - job->start;
+        if (job->pidfds[i] != -1) {
+            close(job->pidfds[i]);
+            job->pidfds[i] = -1;
+        }
+        if (job->is_stopped[i]) {
+            job->is_stopped[i] = false;
+            job->stopped--;
+        }
+        job->pids[i] = -1;
+        job->running--;
+    }
+}
+
+struct job *job_at(size_t idx)
+{
+    return *(struct job **) vlist_get(&jobs, idx);
+}
@@ -0,0 +1,52 @@
+/**
+ * @file
+ *
+ * Job table for pipelines running in the background or stopped with Ctrl-Z.
+ * Children are reaped without blocking: a SIGCHLD handler only records that
+ * something changed, and every job is checked with WNOHANG before the next
+ * prompt.
+ */
+
+#ifndef _JOBS_H_
+#define _JOBS_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <termios.h>
+
+#include "timing.h"
+
+struct job {
+    unsigned int id;          /*!< Job number, 0 until added to the table */
+    pid_t pgid;               /*!< Process group, 0 without job control */
+    char *line;               /*!< Command line, as shown by 'jobs' */
+    double start;             /*!< time_now() when the job was launched */
+    size_t num_stages;
+    size_t running;           /*!< Stages that have not exited yet */
+    size_t stopped;           /*!< Running stages that are stopped */
+    bool reported;            /*!< Current state already shown to the user */
+    bool has_tmodes;          /*!< 'tmodes' was saved when the job stopped */
+    struct termios tmodes;    /*!< Terminal settings to resume the job with */
+    pid_t *pids;              /*!< One per stage, -1 once reaped */
+    int *pidfds;              /*!< One per stage, -1 if unavailable */
+    bool *is_stopped;
+    struct stage_time *stages;
+};
+
+int jobs_init(void);
+struct job *job_create(const char *line, size_t num_stages);
+void job_destroy(struct job *job);
+void job_set_stage(struct job *job, size_t idx, const char *name, pid_t pid);
+void job_wait(struct job *job);
+void job_continue(struct job *job);
+int job_status(struct job *job);
+int job_add(struct job *job);
+void job_remove(struct job *job);
+struct job *job_find(const char *spec);
+void jobs_reap(bool report);
+void job_print(struct job *job);
+void jobs_print(void);
+size_t jobs_count(void);
+struct job *jobs_get(size_t idx);
+
+#endif
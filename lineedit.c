@@ -0,0 +1,147 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <readline/readline.h>
+
+#include "lineedit.h"
+#include "logger.h"
+
+#define SEARCH_RESULTS 32
+
+static lineedit_search_fn search;
+static lineedit_complete_fn complete;
+
+static int readline_init(void);
+static int fuzzy_search(int count, int key);
+static char **complete_word(const char *text, int start, int end);
+static bool is_command_position(int start);
+
+/* Called once after the plugin is loaded */
+void lineedit_init(lineedit_search_fn search_fn, lineedit_complete_fn complete_fn)
+{
+    search = search_fn;
+    complete = complete_fn;
+    rl_startup_hook = readline_init;
+    rl_attempted_completion_function = complete_word;
+}
+
+/* Reads one line, which the caller frees; NULL at end of input */
+char *lineedit_read(const char *prompt)
+{
+    /* Allows us to arrow back and forth over the line we are typing */
+    return readline(prompt);
+}
+
+int readline_init(void)
+{
+    rl_variable_bind("show-all-if-ambiguous", "on");
+    rl_variable_bind("colored-completion-prefix", "on");
+    rl_bind_keyseq("\\C-r", fuzzy_search);
+    return 0;
+}
+
+/* Incremental fuzzy reverse search (Ctrl-R). Results are recomputed on every
+ * keystroke; Ctrl-R again moves to the next match, Enter runs the selected
+ * one, Ctrl-G restores the original line and any other key keeps the match
+ * on the line and is then handled by readline as usual. */
+int fuzzy_search(int count, int key)
+{
+    char query[256] = "";
+    size_t query_len = 0;
+    const char *matches[SEARCH_RESULTS];
+    int num_matches = 0;
+    int selected = 0;
+    char *saved_line = strdup(rl_line_buffer);
+
+    while (true) {
+        const char *match = (num_matches > 0) ? matches[selected] : "";
+        rl_message("(fuzzy-search)`%s': %s", query, match);
+
+        int c = rl_read_key();
+        if (c == '\r' || c == '\n') {
+            rl_replace_line(match, 0);
+            rl_done = 1;
+            break;
+        } else if (c == CTRL('g')) {
+            rl_replace_line(saved_line, 0);
+            break;
+        } else if (c == CTRL('r')) {
+            if (num_matches > 0) {
+                selected = (selected + 1) % num_matches;
+            }
+            continue;
+        } else if (c == RUBOUT || c == CTRL('h')) {
+            if (query_len > 0) {
+                query[--query_len] = '\0';
+            }
+        } else if (c >= ' ' && query_len < sizeof(query) - 1) {
+            query[query_len++] = c;
+            query[query_len] = '\0';
+        } else {
+            /* Let readline handle the key itself, e.g. arrow keys */
+            rl_replace_line(num_matches > 0 ? match : saved_line, 0);
+            rl_execute_next(c);
+            break;
+        }
+
+        num_matches = search(query, matches, SEARCH_RESULTS);
+        selected = 0;
+    }
+
+    rl_point = rl_end;
+    rl_clear_message();
+    free(saved_line);
+    return 0;
+}
+
+/* Completes the first word of a command from the shell's command index;
+ * anything else, or a word with a '/', is left to readline's filename
+ * completion. The matches are handed to readline as they are, already
+ * sorted, instead of going through a generator one name at a time. */
+char **complete_word(const char *text, int start, int end)
+{
+    if (!is_command_position(start) || strchr(text, '/') != NULL) {
+        return NULL;
+    }
+
+    const char **names;
+    size_t num_names = complete(text, &names);
+    if (num_names == 0) {
+        return NULL;
+    }
+
+    /* readline wants the text to insert first: the single match, or else
+     * the longest prefix all matches share, which for a sorted range is the
+     * one shared by the first and last */
+    size_t common = 0;
+    const char *first = names[0];
+    const char *last = names[num_names - 1];
+    while (first[common] != '\0' && first[common] == last[common]) {
+        common++;
+    }
+
+    size_t num_matches = (num_names == 1) ? 1 : num_names + 1;
+    char **matches = malloc((num_matches + 1) * sizeof(char *));
+    if (matches == NULL) {
+        return NULL;
+    }
+    matches[0] = strndup(first, (num_names == 1) ? strlen(first) : common);
+    for (size_t i = 1; i < num_matches; i++) {
+        matches[i] = strdup(names[i - 1]);
+    }
+    matches[num_matches] = NULL;
+    rl_attempted_completion_over = 1;
+    return matches;
+}
+
+/* Whether the word at 'start' begins a command: nothing but blanks between
+ * it and the start of the line or a '|', ';', '&' or '(' */
+bool is_command_position(int start)
+{
+    int pos = start - 1;
+    while (pos >= 0 && (rl_line_buffer[pos] == ' ' || rl_line_buffer[pos] == '\t')) {
+        pos--;
+    }
+    return pos < 0 || strchr("|;&(", rl_line_buffer[pos]) != NULL;
+}
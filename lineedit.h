@@ -0,0 +1,28 @@
+/**
+ * @file
+ *
+ * Line editing for interactive sessions. This part of the shell is built as
+ * a plugin, ash-readline.so, the only thing that links libreadline; ui.c
+ * loads it with dlopen() before the first prompt, so scripts never load
+ * readline at all. The shell passes in what the plugin needs from it.
+ */
+
+#ifndef _LINEEDIT_H_
+#define _LINEEDIT_H_
+
+#include <stddef.h>
+
+#define LINEEDIT_PLUGIN "ash-readline.so"
+
+/* Fills 'matches' with up to 'max' history entries matching 'query' and
+ * returns how many there are, like hist_fuzzy_search() */
+typedef int (*lineedit_search_fn)(const char *query, const char **matches, int max);
+
+/* Points 'matches' at the sorted command names starting with 'prefix' and
+ * returns how many there are, like complete_command() */
+typedef size_t (*lineedit_complete_fn)(const char *prefix, const char ***matches);
+
+void lineedit_init(lineedit_search_fn search, lineedit_complete_fn complete);
+char *lineedit_read(const char *prompt);
+
+#endif
@@ -0,0 +1,442 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/pidfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "parallel.h"
+#include "pathhash.h"
+#include "vars.h"
+#include "logger.h"
+
+#define MAX_JOBS 4096
+#define ORDER_WINDOW 4   /* With -k, finished commands may wait in this many
+                          * slots per worker for an earlier one to finish */
+#define READ_CHUNK 16384
+
+/* One command started for an input line */
+struct task {
+    bool in_use;
+    bool exited;
+    unsigned long seq;   /*!< Position of the argument in the input */
+    pid_t pid;
+    int pidfd;           /*!< -1 if unavailable */
+    int out_fd;          /*!< Read end of the command's stdout, -1 at EOF */
+    int status;
+    char *out;           /*!< Output not written yet */
+    size_t out_len;
+    size_t out_cap;
+};
+
+/* The worker pool: at most 'max_jobs' commands run at once. Input lines are
+ * only read when a worker is free, so the input itself is the work queue. */
+struct pool {
+    struct parallel_opts *opts;
+    int out_fd;
+    struct task *tasks;
+    size_t num_slots;
+    size_t in_use;
+    size_t running;            /*!< Tasks whose process or output is open */
+    unsigned long next_seq;
+    unsigned long flush_seq;   /*!< With -k, the next task to write out */
+    int status;                /*!< Wait status of the last failure */
+    bool halted;               /*!< Interrupted: start nothing new */
+};
+
+static int usage(void);
+static char **expand_template(char **template, const char *arg);
+static void task_start(struct pool *pool, const char *arg);
+static void task_read(struct pool *pool, struct task *task);
+static void task_check(struct pool *pool, struct task *task);
+static void task_finish(struct pool *pool, struct task *task);
+static void pool_wait(struct pool *pool);
+static void write_all(int fd, const char *buf, size_t len);
+
+/* Parses the options of 'parallel'; the words after them are the command
+ * template. Returns -1 (after printing usage) if they are invalid. */
+int parallel_parse(char **argv, struct parallel_opts *opts)
+{
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    opts->max_jobs = (nproc > 0) ? nproc : 1;
+    opts->keep_order = false;
+    opts->ungrouped = false;
+    opts->arg_file = NULL;
+    opts->template = NULL;
+
+    int i = 0;
+    for (; argv[i] != NULL && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            opts->keep_order = true;
+        } else if (strcmp(argv[i], "-u") == 0) {
+            opts->ungrouped = true;
+        } else if (strcmp(argv[i], "-a") == 0) {
+            opts->arg_file = argv[++i];
+            if (opts->arg_file == NULL) {
+                return usage();
+            }
+        } else if (strncmp(argv[i], "-j", 2) == 0) {
+            const char *num = (argv[i][2] != '\0') ? argv[i] + 2 : argv[++i];
+            if (num == NULL) {
+                return usage();
+            }
+            char *endPtr;
+            long jobs = strtol(num, &endPtr, 10);
+            if (*endPtr != '\0' || jobs <= 0 || jobs > MAX_JOBS) {
+                return usage();
+            }
+            opts->max_jobs = jobs;
+        } else {
+            return usage();
+        }
+    }
+
+    if (argv[i] == NULL) {
+        return usage();
+    }
+    opts->template = argv + i;
+    return 0;
+}
+
+/* Runs the template once for each non-empty line of 'input', writing the
+ * commands' output to 'out_fd'. By default each command's output is written
+ * in one piece when it finishes; with -k it also comes out in input order,
+ * and with -u commands write to 'out_fd' themselves. Returns the wait status
+ * of the last command that failed, or 0 if they all succeeded. */
+int parallel_run(struct parallel_opts *opts, FILE *input, int out_fd)
+{
+    struct pool pool = { 0 };
+    pool.opts = opts;
+    pool.out_fd = out_fd;
+    pool.num_slots = opts->max_jobs * (opts->keep_order ? ORDER_WINDOW : 1);
+    pool.tasks = calloc(pool.num_slots, sizeof(struct task));
+    if (pool.tasks == NULL) {
+        perror("parallel calloc");
+        return W_EXITCODE(1, 0);
+    }
+
+    char *line = NULL;
+    size_t line_sz = 0;
+    bool input_done = false;
+    while (true) {
+        /* Start commands while a worker and a slot for the output are free */
+        while (!input_done && !pool.halted && pool.running < opts->max_jobs
+                && pool.in_use < pool.num_slots) {
+            ssize_t len = getline(&line, &line_sz, input);
+            if (len == -1) {
+                input_done = true;
+                break;
+            }
+            if (len > 0 && line[len - 1] == '\n') {
+                line[--len] = '\0';
+            }
+            if (len > 0) {
+                task_start(&pool, line);
+            }
+        }
+
+        /* Finished tasks are written out right away, so once nothing is
+         * running every slot is free again */
+        if (pool.running == 0) {
+            break;
+        }
+        pool_wait(&pool);
+    }
+
+    for (size_t i = 0; i < pool.num_slots; i++) {
+        free(pool.tasks[i].out);
+    }
+    free(pool.tasks);
+    free(line);
+    return pool.status;
+}
+
+int usage(void)
+{
+    fprintf(stderr, "parallel: usage: parallel [-j jobs] [-k] [-u] [-a file] "
+            "command [args] ...\n");
+    return -1;
+}
+
+/* Builds the argument vector for one command: every "{}" in the template is
+ * replaced by 'arg', which is appended if the template has none. The vector
+ * and its strings share a single allocation. */
+char **expand_template(char **template, const char *arg)
+{
+    size_t arg_len = strlen(arg);
+    size_t num_words = 0;
+    size_t text_sz = 0;
+    bool placeholder = false;
+    for (; template[num_words] != NULL; num_words++) {
+        text_sz += strlen(template[num_words]) + 1;
+        for (const char *p = template[num_words]; (p = strstr(p, "{}")) != NULL; p += 2) {
+            text_sz += arg_len - 2;
+            placeholder = true;
+        }
+    }
+    if (!placeholder) {
+        text_sz += arg_len + 1;
+    }
+
+    size_t argc = num_words + (placeholder ? 0 : 1);
+    char **argv = malloc((argc + 1) * sizeof(char *) + text_sz);
+    if (argv == NULL) {
+        perror("parallel malloc");
+        return NULL;
+    }
+
+    char *text = (char *) (argv + argc + 1);
+    for (size_t i = 0; i < num_words; i++) {
+        argv[i] = text;
+        const char *word = template[i];
+        const char *p;
+        while ((p = strstr(word, "{}")) != NULL) {
+            memcpy(text, word, p - word);
+            text += p - word;
+            memcpy(text, arg, arg_len);
+            text += arg_len;
+            word = p + 2;
+        }
+        size_t rest = strlen(word) + 1;
+        memcpy(text, word, rest);
+        text += rest;
+    }
+    if (!placeholder) {
+        argv[num_words] = text;
+        memcpy(text, arg, arg_len + 1);
+    }
+    argv[argc] = NULL;
+    return argv;
+}
+
+/* Spawns the command for 'arg' in a free slot. Commands stay in the shell's
+ * process group, so Ctrl-C reaches all of them, and read from /dev/null so
+ * they cannot consume the argument list. */
+void task_start(struct pool *pool, const char *arg)
+{
+    struct task *task = pool->tasks;
+    while (task->in_use) {
+        task++;
+    }
+    task->in_use = true;
+    task->exited = false;
+    task->seq = pool->next_seq++;
+    task->pid = -1;
+    task->pidfd = -1;
+    task->out_fd = -1;
+    task->status = 0;
+    task->out_len = 0;
+    pool->in_use++;
+
+    char **argv = expand_template(pool->opts->template, arg);
+    int fds[2] = { -1, -1 };
+    if (!pool->opts->ungrouped && pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe");
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (fds[1] != -1) {
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    } else if (pool->out_fd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, pool->out_fd, STDOUT_FILENO);
+    }
+
+    posix_spawnattr_t attr;
+    sigset_t sig_default;
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sig_default);
+    sigaddset(&sig_default, SIGINT);
+    posix_spawnattr_setsigdefault(&attr, &sig_default);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    int err = ENOENT;
+    const char *path = (argv != NULL) ? path_lookup(argv[0]) : NULL;
+    if (path != NULL) {
+        err = posix_spawn(&task->pid, path, &actions, &attr, argv, vars_envp());
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    free(argv);
+    if (fds[1] != -1) {
+        close(fds[1]);
+    }
+
+    if (err != 0) {
+        fprintf(stderr, "Bad command: %s\n", strerror(err));
+        if (fds[0] != -1) {
+            close(fds[0]);
+        }
+        task->pid = -1;
+        task->status = W_EXITCODE(err == ENOENT ? 127 : 126, 0);
+        task->exited = true;
+        task_finish(pool, task);
+        return;
+    }
+
+    LOG("parallel: started %d for '%s'\n", task->pid, arg);
+    task->out_fd = fds[0];
+    task->pidfd = pidfd_open(task->pid, 0);
+    pool->running++;
+}
+
+/* Blocks until some running command produces output or exits */
+void pool_wait(struct pool *pool)
+{
+    size_t num_fds = pool->num_slots * 2;
+    struct pollfd pfds[num_fds];
+    int timeout = -1;
+    for (size_t i = 0; i < pool->num_slots; i++) {
+        struct task *task = &pool->tasks[i];
+        bool running = task->in_use && (!task->exited || task->out_fd != -1);
+        pfds[2 * i].fd = running ? task->out_fd : -1;
+        pfds[2 * i].events = POLLIN;
+        pfds[2 * i + 1].fd = (running && !task->exited) ? task->pidfd : -1;
+        pfds[2 * i + 1].events = POLLIN;
+
+        /* Without a pidfd the exit can only be noticed by polling for it */
+        if (running && !task->exited && task->pidfd == -1) {
+            timeout = 10;
+        }
+    }
+
+    if (poll(pfds, num_fds, timeout) == -1 && errno != EINTR) {
+        perror("poll");
+        return;
+    }
+
+    for (size_t i = 0; i < pool->num_slots; i++) {
+        struct task *task = &pool->tasks[i];
+        if (!task->in_use) {
+            continue;
+        }
+        if (pfds[2 * i].fd != -1 && pfds[2 * i].revents != 0) {
+            task_read(pool, task);
+        }
+        if (!task->exited && (task->pidfd == -1 || pfds[2 * i + 1].revents != 0)) {
+            task_check(pool, task);
+        }
+    }
+}
+
+/* Collects output from a command. With -k the oldest unfinished command's
+ * output is passed straight through; everything else is buffered. */
+void task_read(struct pool *pool, struct task *task)
+{
+    if (task->out_cap - task->out_len < READ_CHUNK) {
+        size_t new_cap = (task->out_cap == 0) ? READ_CHUNK * 2 : task->out_cap * 2;
+        char *new_out = realloc(task->out, new_cap);
+        if (new_out == NULL) {
+            perror("parallel realloc");
+            return;
+        }
+        task->out = new_out;
+        task->out_cap = new_cap;
+    }
+
+    ssize_t read_sz = read(task->out_fd, task->out + task->out_len, READ_CHUNK);
+    if (read_sz == -1 && (errno == EINTR || errno == EAGAIN)) {
+        return;
+    }
+    if (read_sz > 0) {
+        task->out_len += read_sz;
+        if (pool->opts->keep_order && task->seq == pool->flush_seq) {
+            write_all(pool->out_fd, task->out, task->out_len);
+            task->out_len = 0;
+        }
+        return;
+    }
+
+    close(task->out_fd);
+    task->out_fd = -1;
+    if (task->exited) {
+        task_finish(pool, task);
+    }
+}
+
+void task_check(struct pool *pool, struct task *task)
+{
+    pid_t pid = waitpid(task->pid, &task->status, WNOHANG);
+    if (pid == 0 || (pid == -1 && errno == EINTR)) {
+        return;
+    }
+
+    if (task->pidfd != -1) {
+        close(task->pidfd);
+        task->pidfd = -1;
+    }
+    task->exited = true;
+    if (task->out_fd == -1) {
+        task_finish(pool, task);
+    }
+}
+
+/* Called once a command has exited and closed its output. Its output is
+ * written now, or with -k once every earlier command's has been. */
+void task_finish(struct pool *pool, struct task *task)
+{
+    if (task->pid != -1) {
+        pool->running--;
+    }
+    if (task->status != 0) {
+        pool->status = task->status;
+        if (WIFSIGNALED(task->status) && WTERMSIG(task->status) == SIGINT) {
+            pool->halted = true;
+        }
+    }
+
+    if (!pool->opts->keep_order) {
+        write_all(pool->out_fd, task->out, task->out_len);
+        task->in_use = false;
+        pool->in_use--;
+        return;
+    }
+
+    /* Write out finished commands in order, then whatever the next one has
+     * produced so far; from then on its output is passed straight through */
+    bool flushed = true;
+    while (flushed) {
+        flushed = false;
+        for (size_t i = 0; i < pool->num_slots; i++) {
+            struct task *head = &pool->tasks[i];
+            if (!head->in_use || head->seq != pool->flush_seq) {
+                continue;
+            }
+
+            write_all(pool->out_fd, head->out, head->out_len);
+            head->out_len = 0;
+            if (head->exited && head->out_fd == -1) {
+                head->in_use = false;
+                pool->in_use--;
+                pool->flush_seq++;
+                flushed = true;
+            }
+            break;
+        }
+    }
+}
+
+void write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("parallel write");
+            return;
+        }
+        buf += written;
+        len -= written;
+    }
+}
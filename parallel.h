@@ -0,0 +1,26 @@
+/**
+ * @file
+ *
+ * The 'parallel' builtin: runs a command template once per input line with a
+ * bounded number of concurrent processes, keeping each command's output
+ * together (or in input order with -k).
+ */
+
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+
+struct parallel_opts {
+    unsigned int max_jobs;   /*!< Concurrent processes, -j (default: nproc) */
+    bool keep_order;         /*!< -k: output in input order */
+    bool ungrouped;          /*!< -u: let commands write directly */
+    const char *arg_file;    /*!< -a: read arguments from this file */
+    char **template;         /*!< Command words; "{}" is the argument */
+};
+
+int parallel_parse(char **argv, struct parallel_opts *opts);
+int parallel_run(struct parallel_opts *opts, FILE *input, int out_fd);
+
+#endif
@@ -0,0 +1,752 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "parse.h"
+#include "logger.h"
+#include "trace.h"
+#include "vars.h"
+#include "wildcard.h"
+
+/* Operator tokens point into this table instead of into the command line,
+ * so they are told apart from words by address: a quoted "|" is a word */
+static char operators[][3] = { "|", "<", ">", ">>", "&" };
+
+enum token_kind {
+    TOK_PIPE,
+    TOK_STDIN,
+    TOK_STDOUT,
+    TOK_APPEND,
+    TOK_AMP,
+    TOK_WORD,
+};
+
+/* How the lexer treats each byte; anything not listed is part of a word */
+enum char_class {
+    CH_WORD = 0,
+    CH_SPACE,
+    CH_OPERATOR,
+    CH_QUOTE,
+    CH_ESCAPE,
+    CH_END,
+};
+
+static const unsigned char char_class[256] = {
+    ['\0'] = CH_END,
+    [' '] = CH_SPACE, ['\t'] = CH_SPACE, ['\n'] = CH_SPACE, ['\r'] = CH_SPACE,
+    ['|'] = CH_OPERATOR, ['<'] = CH_OPERATOR, ['>'] = CH_OPERATOR,
+    ['&'] = CH_OPERATOR,
+    ['\''] = CH_QUOTE, ['"'] = CH_QUOTE,
+    ['\\'] = CH_ESCAPE,
+};
+
+static inline enum token_kind token_kind(const char *tok)
+{
+    const char *ops = operators[0];
+    if (tok >= ops && tok < ops + sizeof(operators)) {
+        return (tok - ops) / sizeof(operators[0]);
+    }
+    return TOK_WORD;
+}
+
+/* Returns the first character from 'p' on that is not an ordinary word
+ * character. 'end' is the terminating NUL; long runs are checked 16 bytes at
+ * a time. */
+static const char *skip_word(const char *p, const char *end)
+{
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i pipe = _mm_set1_epi8('|');
+    const __m128i lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>');
+    const __m128i amp = _mm_set1_epi8('&');
+    const __m128i squote = _mm_set1_epi8('\'');
+    const __m128i dquote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+
+    while (end - p >= 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *) p);
+        __m128i hit = _mm_or_si128(
+                _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(c, space), _mm_cmpeq_epi8(c, tab)),
+                    _mm_or_si128(_mm_cmpeq_epi8(c, nl), _mm_cmpeq_epi8(c, cr))),
+                _mm_or_si128(
+                    _mm_or_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(c, pipe), _mm_cmpeq_epi8(c, lt)),
+                        _mm_or_si128(_mm_cmpeq_epi8(c, gt), _mm_cmpeq_epi8(c, amp))),
+                    _mm_or_si128(
+                        _mm_or_si128(_mm_cmpeq_epi8(c, squote), _mm_cmpeq_epi8(c, dquote)),
+                        _mm_cmpeq_epi8(c, backslash))));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (char_class[(unsigned char) *p] == CH_WORD) {
+        p++;
+    }
+    return p;
+}
+
+/* Returns the length of 'command' and whether it has a '*', '?' or '['
+ * ('may_glob') or a '$' ('may_vars'), in one pass. Aligned 16-byte loads
+ * never cross into an unmapped page, so they may read past the terminator. */
+static size_t scan_line(const char *command, bool *may_glob, bool *may_vars)
+{
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i star = _mm_set1_epi8('*');
+    const __m128i question = _mm_set1_epi8('?');
+    const __m128i bracket = _mm_set1_epi8('[');
+    const __m128i dollar = _mm_set1_epi8('$');
+
+    uintptr_t misalign = (uintptr_t) command & 15;
+    const char *p = command - misalign;
+    int glob_mask = 0;
+    int var_mask = 0;
+    int skip = misalign;
+    while (true) {
+        __m128i c = _mm_load_si128((const __m128i *) p);
+        int end_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(c, zero)) >> skip << skip;
+        int wild_mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(c, star),
+                    _mm_or_si128(_mm_cmpeq_epi8(c, question),
+                        _mm_cmpeq_epi8(c, bracket)))) >> skip << skip;
+        int dollar_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(c, dollar)) >> skip << skip;
+        if (end_mask != 0) {
+            /* Only characters before the terminator count */
+            int end = __builtin_ctz(end_mask);
+            glob_mask |= wild_mask & ((1 << end) - 1);
+            var_mask |= dollar_mask & ((1 << end) - 1);
+            *may_glob = (glob_mask != 0);
+            *may_vars = (var_mask != 0);
+            return p + end - command;
+        }
+        glob_mask |= wild_mask;
+        var_mask |= dollar_mask;
+        p += 16;
+        skip = 0;
+    }
+#else
+    *may_glob = (strpbrk(command, "*?[") != NULL);
+    *may_vars = (strchr(command, '$') != NULL);
+    return strlen(command);
+#endif
+}
+
+/* Quoted and escaped characters are marked in bitmaps by their offset in
+ * the command line, so they are not taken as wildcards: one for characters
+ * in single quotes or escaped with '\', which are also not taken as '$',
+ * and one for characters in double quotes */
+static inline void mark_literal(unsigned char *literal, size_t offset)
+{
+    literal[offset / 8] |= 1 << (offset % 8);
+}
+
+static inline bool is_literal(const unsigned char *literal, size_t offset)
+{
+    return literal[offset / 8] & (1 << (offset % 8));
+}
+
+/* A variable in a word: where it is, its length with the '$', and its value */
+struct var_ref {
+    size_t offset;
+    size_t ref_len;
+    const char *value;
+    size_t value_len;
+    bool split;         /*!< Unquoted, with whitespace in the value */
+};
+
+/* Unquoted values are split into fields at the default IFS characters */
+static inline bool is_ifs_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+static char **expand_words(char **tokens, size_t count, const char *command,
+        const unsigned char *literal, const unsigned char *quoted,
+        struct arena *arena, size_t *num_tokens);
+static size_t substitute(char *out, const char *tok, size_t base,
+        const unsigned char *literal, const unsigned char *quoted,
+        const struct var_ref *refs, size_t num_refs, bool pattern);
+static bool read_var_ref(const char *str, size_t base, const unsigned char *literal,
+        struct var_ref *ref);
+static char **split_fields(char *word, size_t word_len, const char *tok, size_t base,
+        const unsigned char *literal, const unsigned char *quoted,
+        const struct var_ref *refs, size_t num_refs, bool magic,
+        struct arena *arena, size_t *num_fields);
+
+/* Reads the operator starting with 'c' at 'p' into 'tok'. 'c' is passed
+ * separately because the word before it may have been terminated over it. */
+static char *lex_operator(char c, char *p, char **tok)
+{
+    switch (c) {
+    case '|':
+        *tok = operators[TOK_PIPE];
+        break;
+    case '<':
+        *tok = operators[TOK_STDIN];
+        break;
+    case '>':
+        if (p[1] == '>') {
+            *tok = operators[TOK_APPEND];
+            return p + 2;
+        }
+        *tok = operators[TOK_STDOUT];
+        break;
+    default:
+        *tok = operators[TOK_AMP];
+        break;
+    }
+    return p + 1;
+}
+
+/* Splits 'command' in place into a NULL-terminated token array in a single
+ * pass. Words and operators need no whitespace between them ('ls|wc -l>out').
+ * Single quotes keep everything literally, double quotes allow \" \\ \$ and
+ * \` escapes, and a backslash outside quotes escapes the next character. A
+ * word starting with '#' begins a comment.
+ *
+ * Words are not copied: each token points into 'command'. Quotes and escapes
+ * are removed by moving the rest of the word down over them, so the write
+ * position 'w' trails the read position 'r' once one has been seen.
+ *
+ * Then $NAME, ${NAME} and $? are replaced by their values, except in single
+ * quotes or after a '\', and words with an unquoted '*', '?' or '[' are
+ * replaced by the paths they match, if any. */
+char **tokenize(char *command, struct arena *arena, size_t *num_tokens)
+{
+    bool may_glob;
+    bool may_vars;
+    size_t len = scan_line(command, &may_glob, &may_vars);
+
+    /* Every token takes at least one character. If the line may need
+     * expanding, the bitmaps of quoted characters follow the tokens. */
+    size_t literal_sz = (may_glob || may_vars) ? len / 8 + 1 : 0;
+    char **tokens = arena_alloc(arena, (len + 1) * sizeof(char *) + 2 * literal_sz);
+    if (tokens == NULL) {
+        *num_tokens = 0;
+        return NULL;
+    }
+    unsigned char *literal = NULL;
+    unsigned char *quoted = NULL;
+    if (literal_sz > 0) {
+        literal = (unsigned char *) (tokens + len + 1);
+        quoted = literal + literal_sz;
+        memset(literal, 0, 2 * literal_sz);
+    }
+
+    const char *end = command + len;
+    char *r = command;
+    size_t count = 0;
+    while (true) {
+        while (char_class[(unsigned char) *r] == CH_SPACE) {
+            r++;
+        }
+        if (*r == '\0' || *r == '#') {
+            break;
+        }
+        if (char_class[(unsigned char) *r] == CH_OPERATOR) {
+            r = lex_operator(*r, r, &tokens[count++]);
+            continue;
+        }
+
+        char *w = r;
+        tokens[count++] = w;
+        while (true) {
+            char *run_end = (char *) skip_word(r, end);
+            if (w != r) {
+                memmove(w, r, run_end - r);
+            }
+            w += run_end - r;
+            r = run_end;
+
+            if (*r == '\'' || *r == '"') {
+                char quote = *r++;
+                while (*r != quote && *r != '\0') {
+                    bool escaped = false;
+                    if (quote == '"' && *r == '\\' && (r[1] == '"' || r[1] == '\\'
+                                || r[1] == '$' || r[1] == '`')) {
+                        r++;
+                        escaped = true;
+                    }
+                    if (literal != NULL) {
+                        mark_literal((quote == '"' && !escaped) ? quoted : literal,
+                                w - command);
+                    }
+                    *w++ = *r++;
+                }
+                /* An unterminated quote runs to the end of the line */
+                if (*r == quote) {
+                    r++;
+                }
+            } else if (*r == '\\') {
+                r++;
+                if (*r != '\0') {
+                    if (literal != NULL) {
+                        mark_literal(literal, w - command);
+                    }
+                    *w++ = *r++;
+                }
+            } else {
+                break;
+            }
+        }
+
+        /* Terminating the word may overwrite the character that ended it */
+        char next = *r;
+        *w = '\0';
+        LOG("Token %zu: '%s'\n", count - 1, tokens[count - 1]);
+        if (next == '\0') {
+            break;
+        } else if (char_class[(unsigned char) next] == CH_OPERATOR) {
+            r = lex_operator(next, r, &tokens[count++]);
+        } else {
+            r++;
+        }
+    }
+
+    tokens[count] = (char *) 0;
+    *num_tokens = count;
+    if (literal != NULL) {
+        /* Expanded words follow the tokens in the arena, so the token array
+         * keeps its size */
+        char **expanded = expand_words(tokens, count, command, literal, quoted,
+                arena, num_tokens);
+        if (expanded == NULL) {
+            *num_tokens = 0;
+        }
+        return expanded;
+    }
+    arena_shrink(arena, tokens, (count + 1) * sizeof(char *));
+    return tokens;
+}
+
+/* Expands variables in place in the token array, and builds a new array if
+ * a word has to be replaced by several (its fields or wildcard matches) or
+ * none. A word that only consisted of variables that are empty is dropped,
+ * unless part of it was quoted. Values of unquoted variables are split into
+ * fields at spaces, tabs and newlines; values are never taken as wildcards.
+ * In a wildcard pattern quoted characters are
+ * escaped with '\'; a word that matches nothing stays as it is, like in
+ * other shells, and so does the file name after a redirection. Returns
+ * 'tokens' if no word had to be replaced by several or none, and NULL if
+ * the arena ran out. */
+char **expand_words(char **tokens, size_t count, const char *command,
+        const unsigned char *literal, const unsigned char *quoted,
+        struct arena *arena, size_t *num_tokens)
+{
+    char ***matches = NULL;
+    size_t *num_matches = NULL;
+    size_t total = count;
+    struct var_ref *refs = NULL;
+    size_t refs_cap = 0;
+    for (size_t i = 0; i < count; i++) {
+        char *tok = tokens[i];
+        if (token_kind(tok) != TOK_WORD) {
+            continue;
+        }
+        bool redirect = (i > 0 && (token_kind(tokens[i - 1]) == TOK_STDIN
+                    || token_kind(tokens[i - 1]) == TOK_STDOUT
+                    || token_kind(tokens[i - 1]) == TOK_APPEND));
+
+        /* Only the characters that may start an expansion are looked at.
+         * Each variable is looked up once, here, and its value kept for
+         * building the word. */
+        size_t base = tok - command;
+        size_t tok_len = strlen(tok);
+        size_t num_refs = 0;
+        size_t word_len = tok_len;
+        bool magic = false;
+        bool split = false;
+        for (const char *c = tok; (c = strpbrk(c, "$*?[\\")) != NULL; c++) {
+            size_t j = c - tok;
+            bool lit = is_literal(literal, base + j);
+            if (*c == '$' && !lit) {
+                if (refs_cap <= tok_len / 2) {
+                    refs_cap = tok_len / 2 + 1;
+                    refs = arena_alloc(arena, refs_cap * sizeof(struct var_ref));
+                    if (refs == NULL) {
+                        return NULL;
+                    }
+                }
+                struct var_ref *ref = &refs[num_refs];
+                if (read_var_ref(c, base + j, literal, ref)) {
+                    /* The '?' of '$?' is not a wildcard */
+                    ref->offset = j;
+                    ref->split = !redirect && !is_literal(quoted, base + j)
+                        && strpbrk(ref->value, " \t\n") != NULL;
+                    split |= ref->split;
+                    word_len += ref->value_len - ref->ref_len;
+                    c += ref->ref_len - 1;
+                    num_refs++;
+                }
+            } else if (*c != '$' && !lit && !is_literal(quoted, base + j)) {
+                magic = true;
+            }
+        }
+        magic &= !redirect;
+        if (num_refs == 0 && !magic) {
+            continue;
+        }
+
+        char *word = tok;
+        if (num_refs > 0) {
+            word = arena_alloc(arena, word_len + 1);
+            if (word == NULL) {
+                return NULL;
+            }
+            substitute(word, tok, base, literal, quoted, refs, num_refs, false);
+            tokens[i] = word;
+        }
+
+        if (split) {
+            if (matches == NULL) {
+                matches = arena_alloc(arena, count * sizeof(char **));
+                num_matches = arena_alloc(arena, count * sizeof(size_t));
+                if (matches == NULL || num_matches == NULL) {
+                    return NULL;
+                }
+                memset(matches, 0, count * sizeof(char **));
+            }
+            matches[i] = split_fields(word, word_len, tok, base, literal, quoted,
+                    refs, num_refs, magic, arena, &num_matches[i]);
+            if (matches[i] == NULL) {
+                return NULL;
+            }
+            total += num_matches[i] - 1;
+            continue;
+        }
+
+        bool drop = (word[0] == '\0' && !redirect);
+        for (size_t j = 0; drop && j < tok_len; j++) {
+            drop = !is_literal(literal, base + j) && !is_literal(quoted, base + j);
+        }
+        if (!magic && !drop) {
+            continue;
+        }
+        if (matches == NULL) {
+            matches = arena_alloc(arena, count * sizeof(char **));
+            num_matches = arena_alloc(arena, count * sizeof(size_t));
+            if (matches == NULL || num_matches == NULL) {
+                return NULL;
+            }
+            memset(matches, 0, count * sizeof(char **));
+        }
+        if (drop) {
+            /* Any non-NULL pointer: the word is replaced by no words */
+            matches[i] = tokens;
+            num_matches[i] = 0;
+            total--;
+            continue;
+        }
+
+        /* Every character may need escaping */
+        char *pattern = arena_alloc(arena, 2 * word_len + 1);
+        if (pattern == NULL) {
+            return NULL;
+        }
+        size_t pattern_len = substitute(pattern, tok, base, literal, quoted,
+                refs, num_refs, true);
+        arena_shrink(arena, pattern, pattern_len + 1);
+        matches[i] = wildcard_expand(pattern, arena, &num_matches[i]);
+        if (matches[i] != NULL) {
+            total += num_matches[i] - 1;
+            LOG("Expanded '%s' to %zu paths\n", pattern, num_matches[i]);
+        }
+    }
+    if (matches == NULL) {
+        return tokens;
+    }
+
+    char **out = arena_alloc(arena, (total + 1) * sizeof(char *));
+    if (out == NULL) {
+        return NULL;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (matches[i] != NULL) {
+            memcpy(out + n, matches[i], num_matches[i] * sizeof(char *));
+            n += num_matches[i];
+        } else {
+            out[n++] = tokens[i];
+        }
+    }
+    out[n] = (char *) 0;
+    *num_tokens = n;
+    return out;
+}
+
+/* Writes the word at offset 'base' of the line to 'out' with its variables
+ * replaced by the values in 'refs', and returns its length. As a wildcard
+ * 'pattern', quoted characters and those from values are escaped. */
+size_t substitute(char *out, const char *tok, size_t base,
+        const unsigned char *literal, const unsigned char *quoted,
+        const struct var_ref *refs, size_t num_refs, bool pattern)
+{
+    char *w = out;
+    size_t next_ref = 0;
+    for (size_t j = 0; tok[j] != '\0'; ) {
+        if (next_ref < num_refs && refs[next_ref].offset == j) {
+            const struct var_ref *ref = &refs[next_ref++];
+            if (ref->split) {
+                /* Fields are separated by NULs, for split_fields() */
+                for (size_t k = 0; k < ref->value_len; k++) {
+                    char c = ref->value[k];
+                    if (is_ifs_space(c)) {
+                        c = '\0';
+                    } else if (pattern && strchr("*?[]\\", c) != NULL) {
+                        *w++ = '\\';
+                    }
+                    *w++ = c;
+                }
+            } else if (!pattern) {
+                memcpy(w, ref->value, ref->value_len);
+                w += ref->value_len;
+            } else {
+                for (size_t k = 0; k < ref->value_len; k++) {
+                    if (strchr("*?[]\\", ref->value[k]) != NULL) {
+                        *w++ = '\\';
+                    }
+                    *w++ = ref->value[k];
+                }
+            }
+            j += ref->ref_len;
+            continue;
+        }
+        if (pattern && (is_literal(literal, base + j) || is_literal(quoted, base + j))
+                && strchr("*?[]\\", tok[j]) != NULL) {
+            *w++ = '\\';
+        }
+        *w++ = tok[j++];
+    }
+    *w = '\0';
+    return w - out;
+}
+
+/* Reads the variable reference at 'str' ('$?', '$NAME' or '${NAME}', at
+ * offset 'base' of the line) and looks up its value. Returns false if the
+ * '$' is just a character. A quoted or escaped character ends the name. */
+bool read_var_ref(const char *str, size_t base, const unsigned char *literal,
+        struct var_ref *ref)
+{
+    size_t len = 1;
+    bool braces = (str[1] == '{');
+    if (braces) {
+        len++;
+    }
+    const char *name = str + len;
+
+    if (str[len] == '?' && !is_literal(literal, base + len)) {
+        len++;
+    } else if ((isalpha((unsigned char) str[len]) || str[len] == '_')
+            && !is_literal(literal, base + len)) {
+        do {
+            len++;
+        } while ((isalnum((unsigned char) str[len]) || str[len] == '_')
+                && !is_literal(literal, base + len));
+    }
+    size_t name_len = str + len - name;
+    if (name_len == 0) {
+        return false;
+    }
+    if (braces) {
+        if (str[len] != '}') {
+            return false;
+        }
+        len++;
+    }
+
+    const char *value = var_get(name, name_len);
+    ref->ref_len = len;
+    ref->value = (value != NULL) ? value : "";
+    ref->value_len = (value != NULL) ? strlen(value) : 0;
+    return true;
+}
+
+/* Splits a word whose unquoted variables have whitespace in their values:
+ * 'word' ('word_len' bytes) holds its fields separated by NULs. Empty fields
+ * are left out, but a word with quotes keeps one. With 'magic', a field with
+ * wildcards outside the values is replaced by its matches. Returns the
+ * fields, or NULL if the arena ran out. */
+char **split_fields(char *word, size_t word_len, const char *tok, size_t base,
+        const unsigned char *literal, const unsigned char *quoted,
+        const struct var_ref *refs, size_t num_refs, bool magic,
+        struct arena *arena, size_t *num_fields)
+{
+    /* The pattern has its separators in the same places */
+    char *pattern = NULL;
+    if (magic) {
+        pattern = arena_alloc(arena, 2 * word_len + 1);
+        if (pattern == NULL) {
+            return NULL;
+        }
+        substitute(pattern, tok, base, literal, quoted, refs, num_refs, true);
+    }
+
+    size_t max_fields = 1;
+    for (size_t k = 0; k < word_len; k++) {
+        max_fields += (word[k] == '\0');
+    }
+    char ***field_matches = arena_alloc(arena, max_fields * sizeof(char **));
+    size_t *field_counts = arena_alloc(arena, max_fields * sizeof(size_t));
+    if (field_matches == NULL || field_counts == NULL) {
+        return NULL;
+    }
+
+    size_t num = 0;
+    size_t total = 0;
+    char *pat = pattern;
+    for (size_t k = 0; k <= word_len; ) {
+        char *field = word + k;
+        size_t field_len = strlen(field);
+        char *field_pat = pat;
+        if (pat != NULL) {
+            pat += strlen(pat) + 1;
+        }
+        k += field_len + 1;
+        if (field_len == 0) {
+            continue;
+        }
+
+        field_matches[num] = NULL;
+        if (field_pat != NULL && wildcard_has_magic(field_pat)) {
+            field_matches[num] = wildcard_expand(field_pat, arena, &field_counts[num]);
+        }
+        if (field_matches[num] == NULL) {
+            field_matches[num] = arena_alloc(arena, sizeof(char *));
+            if (field_matches[num] == NULL) {
+                return NULL;
+            }
+            field_matches[num][0] = field;
+            field_counts[num] = 1;
+        }
+        total += field_counts[num++];
+    }
+
+    bool any_quoted = false;
+    for (size_t j = 0; tok[j] != '\0' && !any_quoted; j++) {
+        any_quoted = is_literal(literal, base + j) || is_literal(quoted, base + j);
+    }
+
+    char **fields = arena_alloc(arena, (total + 1) * sizeof(char *));
+    if (fields == NULL) {
+        return NULL;
+    }
+    size_t n = 0;
+    for (size_t f = 0; f < num; f++) {
+        memcpy(fields + n, field_matches[f], field_counts[f] * sizeof(char *));
+        n += field_counts[f];
+    }
+    if (n == 0 && any_quoted) {
+        fields[n++] = word + word_len;   // the terminating NUL: ""
+    }
+    *num_fields = n;
+    return fields;
+}
+
+/* Groups the tokens into one command_line per pipeline stage. Redirection
+ * and pipe tokens are replaced by NULL so each stage's tokens can be used as
+ * its argument vector. A '&' before the end of the line, or a redirection
+ * not followed by a file name, is a syntax error: NULL is returned with
+ * '*error' set to the offending token. */
+struct command_line *setup_commands(char **tokens, size_t num_tokens,
+        struct arena *arena, size_t *num_cmds, const char **error)
+{
+    /* Each stage but the last ends with a '|' token */
+    struct command_line *cmds
+        = arena_alloc(arena, (num_tokens + 1) * sizeof(struct command_line));
+    *num_cmds = 0;
+    *error = NULL;
+    if (cmds == NULL) {
+        return NULL;
+    }
+
+    struct command_line *cmd = &cmds[0];
+    memset(cmd, 0, sizeof(struct command_line));
+    cmd->tokens = tokens;
+    LOG("tokens: %zu\n", num_tokens);
+
+    for (size_t i = 0; i < num_tokens; i++) {
+        enum token_kind kind = token_kind(tokens[i]);
+        if (kind == TOK_WORD) {
+            continue;
+        }
+
+        /* Only a trailing '&' is supported, and parse_line took that off */
+        char *next = tokens[i + 1];
+        if (kind == TOK_AMP) {
+            *error = tokens[i];
+            arena_shrink(arena, cmds, 0);
+            return NULL;
+        }
+        if (kind != TOK_PIPE && (next == NULL || token_kind(next) != TOK_WORD)) {
+            *error = (next != NULL) ? next : "newline";
+            arena_shrink(arena, cmds, 0);
+            return NULL;
+        }
+        tokens[i] = (char *) 0;
+        if (kind == TOK_STDIN) {
+            cmd->stdin_file = next;
+        } else if (kind == TOK_STDOUT || kind == TOK_APPEND) {
+            cmd->stdout_file = next;
+            cmd->append = (kind == TOK_APPEND);
+        } else {
+            /* Pipe: the next stage starts after it */
+            cmd->stdout_pipe = true;
+            LOG("cmd tokens: %s\n", *(cmd->tokens));
+            cmd++;
+            memset(cmd, 0, sizeof(struct command_line));
+            cmd->tokens = tokens + i + 1;
+        }
+    }
+
+    LOG("cmd tokens: %s\n", *(cmd->tokens));
+    *num_cmds = (num_tokens > 0) ? cmd - cmds + 1 : 0;
+    arena_shrink(arena, cmds, *num_cmds * sizeof(struct command_line));
+    return cmds;
+}
+
+/* Splits 'command' (modified in place) into tokens and pipeline stages,
+ * taking off a leading 'time' and a trailing '&' */
+void parse_line(char *command, struct arena *arena, struct parsed_line *parsed)
+{
+    size_t num_tokens;
+    TRACE_START(start);
+    char **tokens = tokenize(command, arena, &num_tokens);
+    TRACE_SPAN("tokenize", start, command);
+    if (tokens == NULL) {
+        memset(parsed, 0, sizeof(struct parsed_line));
+        return;
+    }
+
+    /* A leading 'time' reports the resources the pipeline used */
+    parsed->timed = false;
+    if (num_tokens > 0 && strcmp(tokens[0], "time") == 0) {
+        tokens++;
+        num_tokens--;
+        parsed->timed = true;
+    }
+
+    /* A trailing '&' runs the pipeline in the background */
+    parsed->background = false;
+    if (num_tokens > 0 && token_kind(tokens[num_tokens - 1]) == TOK_AMP) {
+        tokens[--num_tokens] = (char *) 0;
+        parsed->background = true;
+    }
+
+    parsed->tokens = tokens;
+    parsed->num_tokens = num_tokens;
+    TRACE_START(setup_start);
+    parsed->cmds = setup_commands(tokens, num_tokens, arena, &parsed->num_cmds,
+            &parsed->syntax_error);
+    TRACE_SPAN("setup_commands", setup_start, NULL);
+}
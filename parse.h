@@ -0,0 +1,42 @@
+/**
+ * @file
+ *
+ * Splits command lines into tokens and pipeline stages. Everything is
+ * allocated from an arena owned by the caller, so parsing a line needs no
+ * malloc/free once the arena has grown to fit.
+ */
+
+#ifndef _PARSE_H_
+#define _PARSE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+
+struct command_line {
+    char **tokens; // pointer to an array of character pointers
+    const char *path; // hashed location of tokens[0], looked up at launch
+    bool stdout_pipe;
+    bool append;
+    char *stdin_file;
+    char *stdout_file;
+};
+
+/* A command line split into pipeline stages, ready to run */
+struct parsed_line {
+    char **tokens;      // NULL-terminated
+    size_t num_tokens;
+    struct command_line *cmds;
+    size_t num_cmds;
+    bool timed;         // leading 'time'
+    bool background;    // trailing '&'
+    const char *syntax_error;   // token found instead of a file name, or NULL
+};
+
+char **tokenize(char *command, struct arena *arena, size_t *num_tokens);
+struct command_line *setup_commands(char **tokens, size_t num_tokens,
+        struct arena *arena, size_t *num_cmds, const char **error);
+void parse_line(char *command, struct arena *arena, struct parsed_line *parsed);
+
+#endif
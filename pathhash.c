@@ -0,0 +1,257 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pathhash.h"
+#include "logger.h"
+
+#define DEFAULT_TABLE_SZ 64
+#define MAX_LOAD_PERCENT 70
+
+/* Remembers where each command was found on PATH, like the 'hash' builtin in
+ * other shells. The table uses open addressing with linear probing; entries
+ * are only dropped all at once (when PATH changes or on 'hash -r'), while a
+ * single stale path is just cleared and looked up again next time. */
+struct path_entry {
+    char *name;          /*!< Command name, NULL marks a free slot */
+    char *path;          /*!< Resolved absolute path, NULL if stale */
+    unsigned int hits;   /*!< Times the cached path was used */
+};
+
+static struct path_entry *table;
+static size_t table_sz;
+static size_t used;
+static char *cached_path_env; /* PATH the table was filled from */
+static bool relative_dirs;    /* It has '.', an empty or a relative element */
+static unsigned long probes;  /* Directories searched, for benchmarks */
+
+static struct path_entry *entry_find(const char *name);
+static int table_grow(void);
+static char *path_search(const char *name);
+static void check_path_env(void);
+
+/* Returns the absolute path 'name' runs from, or NULL if it is not on PATH.
+ * Names containing a slash are returned as they are. */
+const char *path_lookup(const char *name)
+{
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+
+    check_path_env();
+    if (table == NULL || (used + 1) * 100 > table_sz * MAX_LOAD_PERCENT) {
+        if (table_grow() == -1) {
+            return NULL;
+        }
+    }
+
+    struct path_entry *entry = entry_find(name);
+    if (entry->path != NULL) {
+        entry->hits++;
+        return entry->path;
+    }
+
+    char *path = path_search(name);
+    if (path == NULL) {
+        return NULL;
+    }
+
+    if (entry->name == NULL) {
+        entry->name = strdup(name);
+        used++;
+    }
+    entry->path = path;
+    entry->hits = 1;
+    LOG("Hashed %s -> %s\n", name, path);
+    return path;
+}
+
+/* Adds or replaces a mapping, as in 'hash -p path name' */
+int path_hash_set(const char *name, const char *path)
+{
+    check_path_env();
+    if (table == NULL || (used + 1) * 100 > table_sz * MAX_LOAD_PERCENT) {
+        if (table_grow() == -1) {
+            return -1;
+        }
+    }
+
+    struct path_entry *entry = entry_find(name);
+    if (entry->name == NULL) {
+        entry->name = strdup(name);
+        used++;
+    }
+    free(entry->path);
+    entry->path = strdup(path);
+    entry->hits = 0;
+    return 0;
+}
+
+/* Clears a cached path that no longer works; the next lookup searches PATH */
+void path_forget(const char *name)
+{
+    if (table == NULL) {
+        return;
+    }
+
+    struct path_entry *entry = entry_find(name);
+    free(entry->path);
+    entry->path = NULL;
+}
+
+/* After 'cd', commands found through a relative PATH element (or shadowed
+ * by one) may resolve to another file, so the table starts over */
+void path_hash_cwd_changed(void)
+{
+    if (relative_dirs) {
+        LOGP("Directory changed with a relative PATH, resetting hash table\n");
+        path_hash_reset();
+    }
+}
+
+/* Empties the table ('hash -r') */
+void path_hash_reset(void)
+{
+    for (size_t i = 0; i < table_sz; i++) {
+        free(table[i].name);
+        free(table[i].path);
+    }
+    free(table);
+    table = NULL;
+    table_sz = 0;
+    used = 0;
+}
+
+void path_hash_print(void)
+{
+    bool empty = true;
+    for (size_t i = 0; i < table_sz; i++) {
+        if (table[i].path != NULL) {
+            if (empty) {
+                printf("hits\tcommand\n");
+                empty = false;
+            }
+            printf("%4u\t%s\n", table[i].hits, table[i].path);
+        }
+    }
+    if (empty) {
+        printf("hash: hash table empty\n");
+    }
+    fflush(stdout);
+}
+
+unsigned long path_hash_probes(void)
+{
+    return probes;
+}
+
+struct path_entry *entry_find(const char *name)
+{
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037ull;
+    for (const char *c = name; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char) *c) * 1099511628211ull;
+    }
+
+    size_t mask = table_sz - 1;
+    size_t slot = hash & mask;
+    while (table[slot].name != NULL && strcmp(table[slot].name, name) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return &table[slot];
+}
+
+int table_grow(void)
+{
+    struct path_entry *old_table = table;
+    size_t old_sz = table_sz;
+
+    size_t new_sz = (old_sz == 0) ? DEFAULT_TABLE_SZ : old_sz * 2;
+    struct path_entry *new_table = calloc(new_sz, sizeof(struct path_entry));
+    if (new_table == NULL) {
+        perror("path hash calloc");
+        return -1;
+    }
+    table = new_table;
+    table_sz = new_sz;
+
+    for (size_t i = 0; i < old_sz; i++) {
+        if (old_table[i].name != NULL) {
+            *entry_find(old_table[i].name) = old_table[i];
+        }
+    }
+    free(old_table);
+    return 0;
+}
+
+/* Walks PATH the way execvp would, returning a malloc'd path to the first
+ * executable regular file named 'name' */
+char *path_search(const char *name)
+{
+    const char *dirs = getenv("PATH");
+    if (dirs == NULL) {
+        dirs = "/bin:/usr/bin";
+    }
+
+    size_t name_len = strlen(name);
+    while (true) {
+        size_t dir_len = strcspn(dirs, ":");
+        char *path = malloc(dir_len + name_len + 3);
+        if (path == NULL) {
+            perror("path malloc");
+            return NULL;
+        }
+
+        /* An empty PATH element means the current directory */
+        if (dir_len == 0) {
+            sprintf(path, "./%s", name);
+        } else {
+            sprintf(path, "%.*s/%s", (int) dir_len, dirs, name);
+        }
+
+        struct stat st;
+        probes++;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)
+                && access(path, X_OK) == 0) {
+            return path;
+        }
+        free(path);
+
+        if (dirs[dir_len] == '\0') {
+            return NULL;
+        }
+        dirs += dir_len + 1;
+    }
+}
+
+/* Every cached path is void once PATH itself changes */
+void check_path_env(void)
+{
+    const char *path_env = getenv("PATH");
+    if (path_env == NULL) {
+        path_env = "";
+    }
+    if (cached_path_env != NULL && strcmp(cached_path_env, path_env) == 0) {
+        return;
+    }
+
+    LOG("PATH changed, resetting hash table: %s\n", path_env);
+    path_hash_reset();
+    free(cached_path_env);
+    cached_path_env = strdup(path_env);
+
+    /* An unset PATH means /bin:/usr/bin; an empty element is '.' */
+    relative_dirs = false;
+    const char *dirs = getenv("PATH");
+    while (dirs != NULL && !relative_dirs) {
+        relative_dirs = (dirs[0] != '/');
+        dirs = strchr(dirs, ':');
+        if (dirs != NULL) {
+            dirs++;
+        }
+    }
+}
@@ -0,0 +1,19 @@
+/**
+ * @file
+ *
+ * Table of command names and the absolute paths they resolve to on PATH, so
+ * commands can be run with execve directly instead of searching PATH again.
+ */
+
+#ifndef _PATHHASH_H_
+#define _PATHHASH_H_
+
+const char *path_lookup(const char *name);
+int path_hash_set(const char *name, const char *path);
+void path_forget(const char *name);
+void path_hash_cwd_changed(void);
+void path_hash_reset(void);
+void path_hash_print(void);
+unsigned long path_hash_probes(void);
+
+#endif
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pipes.h"
+#include "logger.h"
+
+#define MAX_SETTINGS 16
+#define MAX_PIPE_SIZE (1ULL << 30)   /* Sizes above 1 GiB are rejected */
+
+/* Settings parsed from the environment, and the strings they came from so
+ * they are only parsed again when the variables change */
+static char size_env[128];
+static size_t pipe_sizes[MAX_SETTINGS];
+static size_t num_sizes;
+
+static char cpus_env[128];
+static int stage_cpus[MAX_SETTINGS];
+static size_t num_cpus;
+
+static bool size_warned;
+
+static bool env_changed(const char *name, char *cache, size_t cache_sz);
+
+/* Reads ASH_PIPE_SIZE and ASH_PIPE_CPUS, if they changed since the last
+ * pipeline. Invalid entries are skipped with a warning. */
+void pipes_configure(void)
+{
+    if (env_changed("ASH_PIPE_SIZE", size_env, sizeof(size_env))) {
+        num_sizes = 0;
+        size_warned = false;
+        char buf[sizeof(size_env)];
+        strcpy(buf, size_env);
+        char *saveptr;
+        for (char *tok = strtok_r(buf, ",", &saveptr);
+                tok != NULL && num_sizes < MAX_SETTINGS;
+                tok = strtok_r(NULL, ",", &saveptr)) {
+            size_t size = parse_size(tok);
+            if (size == 0) {
+                fprintf(stderr, "ASH_PIPE_SIZE: invalid size: %s\n", tok);
+                continue;
+            }
+            pipe_sizes[num_sizes++] = size;
+        }
+    }
+
+    if (env_changed("ASH_PIPE_CPUS", cpus_env, sizeof(cpus_env))) {
+        num_cpus = 0;
+        if (strcmp(cpus_env, "auto") == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            sched_getaffinity(0, sizeof(set), &set);
+            for (int cpu = 0; cpu < CPU_SETSIZE && num_cpus < MAX_SETTINGS; cpu++) {
+                if (CPU_ISSET(cpu, &set)) {
+                    stage_cpus[num_cpus++] = cpu;
+                }
+            }
+            return;
+        }
+
+        char buf[sizeof(cpus_env)];
+        strcpy(buf, cpus_env);
+        char *saveptr;
+        for (char *tok = strtok_r(buf, ",", &saveptr);
+                tok != NULL && num_cpus < MAX_SETTINGS;
+                tok = strtok_r(NULL, ",", &saveptr)) {
+            char *end;
+            long cpu = strtol(tok, &end, 10);
+            if (end == tok || *end != '\0' || cpu < 0 || cpu >= CPU_SETSIZE) {
+                fprintf(stderr, "ASH_PIPE_CPUS: invalid CPU: %s\n", tok);
+                continue;
+            }
+            stage_cpus[num_cpus++] = cpu;
+        }
+    }
+}
+
+/* Creates the pipe after stage 'idx' and gives it the configured size */
+int pipe_open(int fds[2], size_t idx)
+{
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    if (num_sizes == 0) {
+        return 0;
+    }
+
+    size_t size = pipe_sizes[(idx < num_sizes) ? idx : num_sizes - 1];
+    if (fcntl(fds[1], F_SETPIPE_SZ, (int) size) == -1 && !size_warned) {
+        /* Usually EPERM above /proc/sys/fs/pipe-max-size; say so once */
+        perror("ASH_PIPE_SIZE");
+        size_warned = true;
+    }
+    return 0;
+}
+
+/* Pins a pipeline stage to its CPU. This happens right after it was started,
+ * so it may run its first instructions elsewhere. */
+void pipe_pin_stage(pid_t pid, size_t idx)
+{
+    if (num_cpus == 0) {
+        return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(stage_cpus[idx % num_cpus], &set);
+    if (sched_setaffinity(pid, sizeof(set), &set) == -1) {
+        LOG("Could not pin %d to CPU %d\n", pid, stage_cpus[idx % num_cpus]);
+    }
+}
+
+/* Parses a size such as "65536", "64K" or "1M"; returns 0 if invalid */
+size_t parse_size(const char *str)
+{
+    char *end;
+    unsigned long long size = strtoull(str, &end, 10);
+    if (end == str) {
+        return 0;
+    }
+    int shift = 0;
+    switch (*end) {
+    case 'k': case 'K':
+        shift = 10;
+        end++;
+        break;
+    case 'm': case 'M':
+        shift = 20;
+        end++;
+        break;
+    case 'g': case 'G':
+        shift = 30;
+        end++;
+        break;
+    }
+    /* Checked before shifting, which could wrap a huge value under the cap */
+    if (*end != '\0' || size > (MAX_PIPE_SIZE >> shift)) {
+        return 0;
+    }
+    size <<= shift;
+    return size;
+}
+
+/* Copies variable 'name' (empty if unset) into 'cache' and returns whether it
+ * differs from what was there */
+bool env_changed(const char *name, char *cache, size_t cache_sz)
+{
+    const char *val = getenv(name);
+    if (val == NULL) {
+        val = "";
+    }
+    if (strncmp(val, cache, cache_sz - 1) == 0) {
+        return false;
+    }
+    snprintf(cache, cache_sz, "%s", val);
+    return true;
+}
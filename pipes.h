@@ -0,0 +1,22 @@
+/**
+ * @file
+ *
+ * Pipeline tuning. ASH_PIPE_SIZE sets the buffer size of the pipes between
+ * stages with F_SETPIPE_SZ, either one size for all of them ("1M") or one
+ * per pipe ("4M,1M,256K"; the last one repeats). ASH_PIPE_CPUS pins stage i
+ * to a CPU: "auto" spreads the stages over the CPUs the shell may use, and a
+ * list ("0,2,4") is used in turn. Both are read when a pipeline starts.
+ */
+
+#ifndef _PIPES_H_
+#define _PIPES_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+void pipes_configure(void);
+int pipe_open(int fds[2], size_t idx);
+void pipe_pin_stage(pid_t pid, size_t idx);
+size_t parse_size(const char *str);
+
+#endif
@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "radix.h"
+#include "logger.h"
+
+/* Each node is reached by an edge labelled with one or more characters. Every
+ * key ends on a node, and each node remembers how many keys pass through it
+ * and the largest value among them. */
+struct radix_node {
+    size_t len;                   /*!< Label length */
+    unsigned int refs;            /*!< Keys stored at or below this node */
+    unsigned int latest;          /*!< Largest value at or below this node */
+    struct radix_node *child;     /*!< First child */
+    struct radix_node *sibling;   /*!< Next child of the same parent */
+    char label[];                 /*!< Edge label leading into this node */
+};
+
+struct radix {
+    struct radix_node root;
+};
+
+static struct radix_node *node_create(const char *label, size_t len);
+static void node_destroy(struct radix_node *node);
+static struct radix_node **child_slot(struct radix_node *node, char c);
+
+struct radix *radix_create(void)
+{
+    struct radix *tree = calloc(1, sizeof(struct radix));
+    if (tree == NULL) {
+        perror("radix calloc");
+        return NULL;
+    }
+    return tree;
+}
+
+void radix_destroy(struct radix *tree)
+{
+    node_destroy(tree->root.child);
+    free(tree);
+}
+
+/* Adds 'key' with 'value'. Every node on its path keeps the larger of its
+ * value and 'value', so keys may be added in any order. */
+int radix_insert(struct radix *tree, const char *key, unsigned int value)
+{
+    struct radix_node *node = &tree->root;
+    size_t key_len = strlen(key);
+    node->refs++;
+    if (value > node->latest) {
+        node->latest = value;
+    }
+
+    while (key_len > 0) {
+        struct radix_node **slot = child_slot(node, *key);
+        struct radix_node *child = *slot;
+        if (child == NULL) {
+            child = node_create(key, key_len);
+            if (child == NULL) {
+                return -1;
+            }
+            child->refs = 1;
+            child->latest = value;
+            *slot = child;
+            return 0;
+        }
+
+        size_t common = 1;
+        while (common < child->len && common < key_len
+                && child->label[common] == key[common]) {
+            common++;
+        }
+
+        /* Key diverges (or ends) inside the edge: split it */
+        if (common < child->len) {
+            struct radix_node *mid = node_create(child->label, common);
+            if (mid == NULL) {
+                return -1;
+            }
+            memmove(child->label, child->label + common, child->len - common);
+            child->len -= common;
+            mid->refs = child->refs;
+            mid->latest = child->latest;
+            mid->child = child;
+            mid->sibling = child->sibling;
+            child->sibling = NULL;
+            *slot = mid;
+            child = mid;
+        }
+
+        child->refs++;
+        if (value > child->latest) {
+            child->latest = value;
+        }
+        node = child;
+        key += common;
+        key_len -= common;
+    }
+    return 0;
+}
+
+/* Removes one occurrence of 'key', pruning branches no key passes through */
+void radix_remove(struct radix *tree, const char *key)
+{
+    struct radix_node *node = &tree->root;
+    size_t key_len = strlen(key);
+    node->refs--;
+
+    while (key_len > 0) {
+        struct radix_node **slot = child_slot(node, *key);
+        struct radix_node *child = *slot;
+        if (child == NULL || child->len > key_len
+                || memcmp(child->label, key, child->len) != 0) {
+            LOG("Key not in radix tree: %s\n", key);
+            return;
+        }
+
+        if (--child->refs == 0) {
+            *slot = child->sibling;
+            child->sibling = NULL;
+            node_destroy(child);
+            return;
+        }
+        node = child;
+        key += child->len;
+        key_len -= child->len;
+    }
+}
+
+/* Returns the largest value stored under 'prefix', or 0 if there is none.
+ * Runs in time proportional to the prefix length. */
+unsigned int radix_lookup(struct radix *tree, const char *prefix)
+{
+    struct radix_node *node = &tree->root;
+    size_t prefix_len = strlen(prefix);
+
+    while (prefix_len > 0) {
+        node = *child_slot(node, *prefix);
+        if (node == NULL) {
+            return 0;
+        }
+
+        size_t cmp_len = (node->len < prefix_len) ? node->len : prefix_len;
+        if (memcmp(node->label, prefix, cmp_len) != 0) {
+            return 0;
+        }
+        prefix += cmp_len;
+        prefix_len -= cmp_len;
+    }
+    return (node->refs > 0) ? node->latest : 0;
+}
+
+struct radix_node *node_create(const char *label, size_t len)
+{
+    /* The label is stored inline, after the node */
+    struct radix_node *node = calloc(1, sizeof(struct radix_node) + len);
+    if (node == NULL) {
+        perror("radix node calloc");
+        return NULL;
+    }
+    memcpy(node->label, label, len);
+    node->len = len;
+    return node;
+}
+
+void node_destroy(struct radix_node *node)
+{
+    while (node != NULL) {
+        struct radix_node *next = node->sibling;
+        node_destroy(node->child);
+        free(node);
+        node = next;
+    }
+}
+
+/* Finds the link to the child whose label starts with 'c'. If there is no such
+ * child, the returned slot is the (NULL) end of the sibling list. */
+struct radix_node **child_slot(struct radix_node *node, char c)
+{
+    struct radix_node **slot = &node->child;
+    while (*slot != NULL && (*slot)->label[0] != c) {
+        slot = &(*slot)->sibling;
+    }
+    return slot;
+}
@@ -0,0 +1,19 @@
+/**
+ * @file
+ *
+ * Compressed prefix tree (radix tree) mapping strings to the newest value
+ * stored under any prefix.
+ */
+
+#ifndef _RADIX_H_
+#define _RADIX_H_
+
+struct radix;
+
+struct radix *radix_create(void);
+void radix_destroy(struct radix *tree);
+int radix_insert(struct radix *tree, const char *key, unsigned int value);
+void radix_remove(struct radix *tree, const char *key);
+unsigned int radix_lookup(struct radix *tree, const char *prefix);
+
+#endif
@@ -0,0 +1,198 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "script.h"
+#include "logger.h"
+
+#define READ_BLOCK (1 << 16)
+
+/* The script's text with every newline replaced by a terminator. 'scratch'
+ * is a copy with the same layout that the tokenizer is free to modify, while
+ * 'text' keeps each line as written for history and job listings. */
+static char *text;
+static char *scratch;
+static size_t text_sz;
+static size_t map_sz;   /* Non-zero when 'text' is a private file mapping */
+static size_t *lines;   /* Offset of each line */
+static size_t num_lines;
+
+static int map_file(int fd, size_t file_sz);
+static int read_all(int fd);
+static ssize_t split_lines(void);
+
+/* Reads everything from 'fd' and splits it into lines. A regular file is
+ * mapped privately; anything else is read in large blocks. Afterwards the
+ * descriptor is positioned at the end, as if it had been read line by line
+ * to EOF. Returns the number of lines, or -1 on error. */
+ssize_t script_load(int fd)
+{
+    struct stat st;
+    int result;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        result = map_file(fd, st.st_size);
+    } else {
+        result = read_all(fd);
+    }
+    if (result == -1) {
+        return -1;
+    }
+    return split_lines();
+}
+
+/* Terminates every line of 'text' and records where each one starts, then
+ * makes the scratch copy */
+ssize_t split_lines(void)
+{
+    size_t lines_cap = text_sz / 32 + 16;
+    lines = malloc(lines_cap * sizeof(size_t));
+    if (lines == NULL) {
+        perror("script lines malloc");
+        return -1;
+    }
+
+    size_t offset = 0;
+    while (offset < text_sz) {
+        if (num_lines == lines_cap) {
+            lines_cap *= 2;
+            size_t *new_lines = realloc(lines, lines_cap * sizeof(size_t));
+            if (new_lines == NULL) {
+                perror("script lines realloc");
+                return -1;
+            }
+            lines = new_lines;
+        }
+        lines[num_lines++] = offset;
+
+        char *end = memchr(text + offset, '\n', text_sz - offset);
+        if (end == NULL) {
+            break;
+        }
+        *end = '\0';
+        offset = end - text + 1;
+    }
+
+    scratch = malloc(text_sz + 1);
+    if (scratch == NULL) {
+        perror("script malloc");
+        return -1;
+    }
+    memcpy(scratch, text, text_sz);
+    scratch[text_sz] = '\0';
+    LOG("Loaded script: %zu bytes, %zu lines\n", text_sz, num_lines);
+    return num_lines;
+}
+
+/* Loads a script given as a string, for 'ash -c'. Returns the number of
+ * lines, or -1 on error. */
+ssize_t script_load_string(const char *str)
+{
+    text_sz = strlen(str);
+    text = malloc(text_sz + 1);
+    if (text == NULL) {
+        perror("script malloc");
+        return -1;
+    }
+    memcpy(text, str, text_sz + 1);
+    return split_lines();
+}
+
+/* Line 'idx' as it appears in the script */
+char *script_line(size_t idx)
+{
+    return text + lines[idx];
+}
+
+/* A modifiable copy of line 'idx' */
+char *script_scratch(size_t idx)
+{
+    return scratch + lines[idx];
+}
+
+void script_unload(void)
+{
+    if (map_sz > 0) {
+        munmap(text, map_sz);
+    } else {
+        free(text);
+    }
+    free(scratch);
+    free(lines);
+    text = NULL;
+    scratch = NULL;
+    lines = NULL;
+    text_sz = 0;
+    map_sz = 0;
+    num_lines = 0;
+}
+
+/* Maps the rest of a regular file. The mapping is private and writable so
+ * lines can be terminated in place; the text needs a terminator after its
+ * last byte, which the zero fill of the final page provides unless the file
+ * ends exactly on a page boundary without a newline. */
+int map_file(int fd, size_t file_sz)
+{
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    long page_sz = sysconf(_SC_PAGESIZE);
+    if (start == -1 || start % page_sz != 0 || (size_t) start >= file_sz) {
+        return read_all(fd);
+    }
+
+    size_t sz = file_sz - start;
+    char *map = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, start);
+    if (map == MAP_FAILED) {
+        return read_all(fd);
+    }
+    if (file_sz % page_sz == 0 && map[sz - 1] != '\n') {
+        munmap(map, sz);
+        return read_all(fd);
+    }
+
+    text = map;
+    text_sz = sz;
+    map_sz = sz;
+    lseek(fd, 0, SEEK_END);
+    return 0;
+}
+
+int read_all(int fd)
+{
+    size_t cap = READ_BLOCK;
+    text = malloc(cap + 1);
+    if (text == NULL) {
+        perror("script malloc");
+        return -1;
+    }
+
+    while (true) {
+        if (cap - text_sz < READ_BLOCK) {
+            cap *= 2;
+            char *new_text = realloc(text, cap + 1);
+            if (new_text == NULL) {
+                perror("script realloc");
+                return -1;
+            }
+            text = new_text;
+        }
+
+        ssize_t read_sz = read(fd, text + text_sz, cap - text_sz);
+        if (read_sz == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("script read");
+            return -1;
+        }
+        if (read_sz == 0) {
+            break;
+        }
+        text_sz += read_sz;
+    }
+    text[text_sz] = '\0';
+    return 0;
+}
@@ -0,0 +1,20 @@
+/**
+ * @file
+ *
+ * Script mode input: the whole script is read up front (mapped into memory
+ * when it is a regular file) and split into lines, so the shell can parse
+ * every command before running the first one.
+ */
+
+#ifndef _SCRIPT_H_
+#define _SCRIPT_H_
+
+#include <sys/types.h>
+
+ssize_t script_load(int fd);
+ssize_t script_load_string(const char *str);
+char *script_line(size_t idx);
+char *script_scratch(size_t idx);
+void script_unload(void);
+
+#endif
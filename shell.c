@@ -1,37 +1,279 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pwd.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <sys/param.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <termios.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "builtins.h"
+#include "complete.h"
 #include "history.h"
+#include "jobs.h"
 #include "logger.h"
+#include "parallel.h"
+#include "parse.h"
+#include "pathhash.h"
+#include "pipes.h"
+#include "script.h"
+#include "stats.h"
+#include "timing.h"
+#include "trace.h"
 #include "ui.h"
-#include "elist.h"
-
-struct command_line {
-    char **tokens; // pointer to an array of character pointers
-    bool stdout_pipe;
-    bool append;
-    char *stdin_file;
-    char *stdout_file;
+#include "vars.h"
+
+#define DEFAULT_HIST_SZ 100
+#define DEFAULT_HISTFILE_SZ 100000
+#define PIPESTATUS_MAX 1024
+
+/* Builtins handled by handle_builtins() itself */
+static const char *shell_builtins[] = {
+    "exit", "history", "hash", "jobs", "fg", "bg", "wait", "cd", "stats",
+    "export", "unset"
 };
+#define NUM_SHELL_BUILTINS (sizeof(shell_builtins) / sizeof(shell_builtins[0]))
+
+static bool interactive;
+static int terminal_fd = STDIN_FILENO;
+static struct termios shell_tmodes;
+
+/* Records a builtin's exit code for the prompt and $? */
+void set_builtin_status(int code)
+{
+    set_prompt_status(code);
+    vars_set_status(code);
+}
+
+/* The 'hash' builtin: no arguments lists the table, -r empties it, -p path
+ * name adds a mapping and any other names are looked up and remembered */
+int hash_builtin(char **argv)
+{
+    if (argv[1] == NULL) {
+        path_hash_print();
+        return 0;
+    }
+
+    int code = 0;
+    for (char **arg = argv + 1; *arg != NULL; arg++) {
+        if (strcmp(*arg, "-r") == 0) {
+            path_hash_reset();
+        } else if (strcmp(*arg, "-p") == 0) {
+            if (arg[1] == NULL || arg[2] == NULL) {
+                fprintf(stderr, "hash: usage: hash [-r] [-p path name] [name ...]\n");
+                return 2;
+            }
+            path_hash_set(arg[2], arg[1]);
+            arg += 2;
+        } else if (path_lookup(*arg) == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", *arg);
+            code = 1;
+        }
+    }
+    return code;
+}
+
+/* 'export' lists the exported variables, 'export NAME=value' sets and
+ * exports a variable and 'export NAME' exports one */
+int export_builtin(char **argv)
+{
+    if (argv[1] == NULL) {
+        vars_print_exported(stdout);
+        return 0;
+    }
+
+    int code = 0;
+    for (char **arg = argv + 1; *arg != NULL; arg++) {
+        char *eq = strchr(*arg, '=');
+        size_t name_len = (eq != NULL) ? eq - *arg : strlen(*arg);
+        if (!var_name_valid(*arg, name_len)) {
+            fprintf(stderr, "export: %s: not a valid identifier\n", *arg);
+            code = 1;
+        } else if (eq != NULL) {
+            var_set(*arg, name_len, eq + 1, true);
+        } else {
+            var_export(*arg, name_len);
+        }
+    }
+    return code;
+}
+
+/* 'unset' removes variables, from the environment too */
+int unset_builtin(char **argv)
+{
+    int code = 0;
+    for (char **name = argv + 1; *name != NULL; name++) {
+        if (!var_name_valid(*name, strlen(*name))) {
+            fprintf(stderr, "unset: %s: not a valid identifier\n", *name);
+            code = 1;
+            continue;
+        }
+        var_unset(*name, strlen(*name));
+    }
+    return code;
+}
+
+/* A line of nothing but NAME=value words sets shell variables, which are
+ * not exported unless they already were. Returns false for anything else,
+ * such as an assignment before a command, which is not supported. */
+bool assign_builtin(const char *line, struct arena *arena)
+{
+    size_t num_words;
+    char **words = tokenize(arena_strdup(arena, line), arena, &num_words);
+    if (words == NULL || num_words == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < num_words; i++) {
+        char *eq = strchr(words[i], '=');
+        if (eq == NULL || !var_name_valid(words[i], eq - words[i])) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < num_words; i++) {
+        char *eq = strchr(words[i], '=');
+        var_set(words[i], eq - words[i], eq + 1, false);
+    }
+    return true;
+}
+
+/* 'cd' changes to the given directory, or to $HOME without one */
+int cd_builtin(char **argv)
+{
+    const char *dir = argv[1];
+    if (dir == NULL) {
+        dir = var_get("HOME", strlen("HOME"));
+        if (dir == NULL || dir[0] == '\0') {
+            dir = get_home();
+        }
+    }
+    if (chdir(dir) == -1) {
+        fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    prompt_cwd_changed();
+    path_hash_cwd_changed();
+    return 0;
+}
+
+int foreground_job(struct job *job);
+
+/* 'fg' moves a job to the foreground and waits for it; 'bg' resumes a stopped
+ * job in the background. Both default to the current job. */
+int fg_builtin(char **argv)
+{
+    const char *name = argv[0];
+    const char *spec = argv[1];
+    if (!interactive) {
+        fprintf(stderr, "%s: no job control\n", name);
+        return 1;
+    }
+
+    struct job *job = job_find(spec);
+    if (job == NULL) {
+        fprintf(stderr, "%s: %s: no such job\n", name, spec ? spec : "current");
+        return 1;
+    }
+
+    if (strcmp(name, "bg") == 0) {
+        job_continue(job);
+        printf("[%u] %s\n", job->id, job->line);
+        fflush(stdout);
+        return 0;
+    }
+
+    printf("%s\n", job->line);
+    fflush(stdout);
+    tcsetpgrp(terminal_fd, job->pgid);
+    if (job->has_tmodes) {
+        tcsetattr(terminal_fd, TCSADRAIN, &job->tmodes);
+    }
+    job_continue(job);
+    int code = status_exit_code(foreground_job(job));
+    if (job->running == 0) {
+        job_destroy(job);
+    }
+    return code;
+}
+
+/* 'wait' blocks until the given job, or every background job, has finished
+ * (or stopped) */
+int wait_builtin(char **argv)
+{
+    const char *spec = argv[1];
+    if (spec != NULL) {
+        struct job *job = job_find(spec);
+        if (job == NULL) {
+            fprintf(stderr, "wait: %s: no such job\n", spec);
+            return 1;
+        }
+        job_wait(job);
+        return status_exit_code(job_status(job));
+    }
+
+    for (size_t i = 0; i < jobs_count(); i++) {
+        job_wait(jobs_get(i));
+    }
+    return 0;
+}
+
+/* 'stats' prints how often each command ran and how long it took, slowest
+ * in total first; 'stats -j' prints the same as JSON and 'stats -r' starts
+ * over */
+int stats_builtin(char **argv)
+{
+    const char *opt = argv[1];
+    if (opt == NULL) {
+        stats_print(stdout);
+    } else if (strcmp(opt, "-j") == 0) {
+        stats_write_json(stdout);
+    } else if (strcmp(opt, "-r") == 0) {
+        stats_reset();
+    } else {
+        fprintf(stderr, "stats: %s: invalid option\n", opt);
+        return 1;
+    }
+    return 0;
+}
 
-/* Handle builtins -- exit and empty will not be in history */
-int handle_builtins(char **command)
+/* Whether the first word of 'command' names a builtin run by handle_builtins */
+bool is_builtin(const char *command)
+{
+    size_t len = strcspn(command, " \t");
+    for (size_t i = 0; i < NUM_SHELL_BUILTINS; i++) {
+        if (strlen(shell_builtins[i]) == len
+                && strncmp(command, shell_builtins[i], len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Handle builtins -- exit and empty will not be in history. A command
+ * replaced by history expansion is copied into 'arena'. Builtins get their
+ * arguments tokenized and expanded like a command's. */
+int handle_builtins(char **command, struct arena *arena)
 {
     if (strcmp(*command, "exit") == 0) {
         return -1; // exit shell
     } else if (strcmp(command[0], "") == 0) {
         return 0;
     } else if (strcmp(*command, "!!") == 0) {
-        free(*command);
-        *command = strdup(hist_search_cnum(hist_last_cnum()));
+        const char *last = hist_search_cnum(hist_last_cnum());
+        if (last == NULL) {
+            return 0;
+        }
+        *command = arena_strdup(arena, last);
     } else if (strncmp(*command, "!", 1) == 0) {
         char *endPtr;
         int cmd_num = (int) strtol(*(command)+1, &endPtr, 10);
@@ -46,267 +288,774 @@ int handle_builtins(char **command)
 
         /* Check if no history could be found */
         if (tmp != NULL) {
-            free(*command);
-            *command = strdup(tmp);
+            *command = arena_strdup(arena, tmp);
         } else {
             return 0;
         }
     }
 
     /* Check built ins after bangs */
+    size_t name_len = strspn(*command, "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+            "abcdefghijklmnopqrstuvwxyz0123456789_");
     if (strncmp(*command, "#", 1) == 0) {
         return 0; // ignore entire comment lines
-    } else if (strcmp(*command, "history") == 0) {
-        hist_add(*command);
-        hist_print();
-        return 0;
-    } else if (strcmp(*command, "cd") == 0) {
+    } else if ((*command)[name_len] == '=' && var_name_valid(*command, name_len)
+            && assign_builtin(*command, arena)) {
         hist_add(*command);
-        char *home = get_home();
-        chdir(home);
-        free(home);
+        set_builtin_status(0);
         return 0;
-    } else if (strncmp(*command, "cd", 2) == 0) {
-        hist_add(*command);
-        char *dir = (*command + 3);
-        chdir(dir);
+    } else if (!is_builtin(*command)) {
+        return 1;
+    }
+
+    hist_add(*command);
+    size_t argc;
+    char **argv = tokenize(arena_strdup(arena, *command), arena, &argc);
+    if (argv == NULL || argc == 0) {
         return 0;
     }
-    return 1;
+
+    int code = 0;
+    if (strcmp(argv[0], "exit") == 0) {
+        if (argv[1] != NULL) {
+            set_builtin_status(atoi(argv[1]) & 0xff);
+        }
+        return -1;
+    } else if (strcmp(argv[0], "history") == 0) {
+        hist_print();
+    } else if (strcmp(argv[0], "jobs") == 0) {
+        jobs_reap(true);
+        jobs_print();
+    } else if (strcmp(argv[0], "export") == 0) {
+        code = export_builtin(argv);
+    } else if (strcmp(argv[0], "unset") == 0) {
+        code = unset_builtin(argv);
+    } else if (strcmp(argv[0], "hash") == 0) {
+        code = hash_builtin(argv);
+    } else if (strcmp(argv[0], "fg") == 0 || strcmp(argv[0], "bg") == 0) {
+        code = fg_builtin(argv);
+    } else if (strcmp(argv[0], "wait") == 0) {
+        code = wait_builtin(argv);
+    } else if (strcmp(argv[0], "stats") == 0) {
+        code = stats_builtin(argv);
+    } else if (strcmp(argv[0], "cd") == 0) {
+        code = cd_builtin(argv);
+    }
+    set_builtin_status(code);
+    return 0;
 }
 
-/* Retrieves the next token from a string */
-char *next_token(char **str_ptr, const char *delim)
+/* Starts one stage with posix_spawn, which uses a vfork-style clone so the
+ * cost does not grow with the shell's memory. 'in_fd' and 'out_fd' are pipe
+ * ends to use as stdin/stdout (-1 for none); file redirections from the
+ * command line are applied after them. With job control (interactive mode)
+ * the stage joins process group 'pgid', or starts a new one when it is 0 and
+ * takes the terminal if it runs in the 'foreground'.
+ * Returns the child's pid, or -1 with 'err' set: 0 if a redirection could not
+ * be opened, which is already reported. */
+pid_t spawn_stage(struct command_line *cmd, int in_fd, int out_fd, pid_t pgid,
+        bool foreground, int *err)
 {
-    if (*str_ptr == NULL) {
-        return NULL;
+    if (cmd->tokens[0] == NULL) {
+        *err = ENOENT;
+        return -1;
+    }
+
+    /* Redirections are opened here rather than in the child, so a file that
+     * cannot be opened is reported as such, not as a missing command */
+    int in_file_fd = -1;
+    int out_file_fd = -1;
+    if (cmd->stdin_file != NULL) {
+        in_file_fd = open(cmd->stdin_file, O_RDONLY | O_CLOEXEC);
+        if (in_file_fd == -1) {
+            perror(cmd->stdin_file);
+            *err = 0;
+            return -1;
+        }
+    }
+    if (cmd->stdout_file != NULL) {
+        int flags = O_CREAT | O_WRONLY | O_CLOEXEC | (cmd->append ? O_APPEND : O_TRUNC);
+        out_file_fd = open(cmd->stdout_file, flags, 0666);
+        if (out_file_fd == -1) {
+            perror(cmd->stdout_file);
+            if (in_file_fd != -1) {
+                close(in_file_fd);
+            }
+            *err = 0;
+            return -1;
+        }
+    }
+    cmd->path = path_lookup(cmd->tokens[0]);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    if (in_file_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, in_file_fd, STDIN_FILENO);
+    }
+    if (out_file_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, out_file_fd, STDOUT_FILENO);
+    }
+
+    /* The child claims the terminal itself, so it can never read from it
+     * before its group is in the foreground */
+    if (pgid == 0 && interactive && foreground) {
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, terminal_fd);
+    }
+
+    /* Signals the shell ignores should behave normally in its children, except
+     * that background commands without job control keep ignoring Ctrl-C */
+    posix_spawnattr_t attr;
+    sigset_t sig_default;
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sig_default);
+    if (interactive || foreground) {
+        sigaddset(&sig_default, SIGINT);
+    }
+    sigaddset(&sig_default, SIGTSTP);
+    sigaddset(&sig_default, SIGTTIN);
+    sigaddset(&sig_default, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &sig_default);
+    short flags = POSIX_SPAWN_SETSIGDEF;
+    if (interactive) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
     }
+    posix_spawnattr_setflags(&attr, flags);
 
-    size_t tok_start = strspn(*str_ptr, delim);
-    size_t tok_end = strcspn(*str_ptr + tok_start, delim);
+    pid_t pid = -1;
+    *err = ENOENT;
+    if (cmd->path != NULL) {
+        *err = posix_spawn(&pid, cmd->path, &actions, &attr, cmd->tokens, vars_envp());
 
-    /* Zero length token, we must be done */
-    if (tok_end  == 0) {
-        *str_ptr = NULL;
+        /* A hashed path may have gone away: forget it and search PATH again */
+        if (*err == ENOENT && cmd->path != cmd->tokens[0]) {
+            path_forget(cmd->tokens[0]);
+            cmd->path = path_lookup(cmd->tokens[0]);
+            if (cmd->path != NULL) {
+                *err = posix_spawn(&pid, cmd->path, &actions, &attr,
+                        cmd->tokens, vars_envp());
+            }
+        }
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (in_file_fd != -1) {
+        close(in_file_fd);
+    }
+    if (out_file_fd != -1) {
+        close(out_file_fd);
+    }
+    if (*err != 0) {
+        return -1;
+    }
+    LOG("Spawned %s as %d\n", cmd->path, pid);
+    return pid;
+}
+
+/* Records the exit code of every stage in PIPESTATUS, e.g. "0 1 0", and
+ * the last one's as $? */
+void set_pipestatus(struct stage_time *stages, size_t num_cmds)
+{
+    char buf[PIPESTATUS_MAX];
+    size_t len = 0;
+    buf[0] = '\0';
+    for (size_t i = 0; i < num_cmds && len < sizeof(buf); i++) {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%d",
+                (i == 0) ? "" : " ", status_exit_code(stages[i].status));
+    }
+    var_set("PIPESTATUS", strlen("PIPESTATUS"), buf, false);
+    if (num_cmds > 0) {
+        vars_set_status(status_exit_code(stages[num_cmds - 1].status));
+    }
+}
+
+/* Launches every stage of the pipeline directly from the shell as siblings,
+ * connecting neighbours with pipes. With job control they share one process
+ * group, which gets the terminal if the job runs in the 'foreground'. 'line'
+ * is the command as typed. If 'out_fd' is given and the last stage writes to
+ * a pipe, the read end is stored there for the shell itself to read.
+ * Returns the job without waiting for it. */
+struct job *launch_pipeline(struct command_line *cmds, size_t num_cmds,
+        const char *line, bool foreground, int *out_fd)
+{
+    struct job *job = job_create(line, num_cmds);
+    if (job == NULL) {
         return NULL;
     }
 
-    /* Start of the current token */
-    char *current_ptr = *str_ptr + tok_start;
-    /* Shift ptr forward (to the end of the current token) */
-    *str_ptr += tok_start + tok_end;
+    /* Pipe sizes and CPU pinning only matter between stages */
+    if (num_cmds > 1) {
+        pipes_configure();
+    }
+
+    int in_fd = -1;
+    for (size_t i = 0; i < num_cmds; i++) {
+        struct command_line *cmd = &cmds[i];
+        int fds[2] = { -1, -1 };
+        if (cmd->stdout_pipe) {
+            pipe_open(fds, i);
+        }
 
-    if (**str_ptr == '\0') {
-        /* At the last token */
-        *str_ptr = NULL;
-    } else {
-        /* Need to terminate the token string */
-        **str_ptr = '\0';
-        /* Point at the first character of the next token */
-        (*str_ptr)++;
+        int err;
+        TRACE_START(start);
+        pid_t pid = spawn_stage(cmd, in_fd, fds[1], job->pgid, foreground, &err);
+        TRACE_SPAN("spawn", start, cmd->tokens[0]);
+        job_set_stage(job, i, cmd->tokens[0], pid);
+        if (pid == -1 && err == 0) {
+            job->stages[i].status = W_EXITCODE(1, 0);
+        } else if (pid == -1) {
+            fprintf(stderr, "Bad command: %s\n", strerror(err));
+            job->stages[i].status = W_EXITCODE(err == ENOENT ? 127 : 126, 0);
+        } else {
+            if (num_cmds > 1) {
+                pipe_pin_stage(pid, i);
+            }
+            if (interactive && job->pgid == 0) {
+                job->pgid = pid;
+            }
+        }
+
+        /* The shell keeps only the read end for the next stage */
+        if (in_fd != -1) {
+            close(in_fd);
+        }
+        if (fds[1] != -1) {
+            close(fds[1]);
+        }
+        in_fd = fds[0];
+    }
+    if (out_fd != NULL) {
+        *out_fd = in_fd;
+    } else if (in_fd != -1) {
+        close(in_fd);
+    }
+    return job;
+}
+
+/* Waits for a job running in the foreground, then takes the terminal back.
+ * A finished job's exit codes go to PIPESTATUS and the wait status of its
+ * last failing stage is returned. A job stopped with Ctrl-Z is put in the job
+ * table instead, and reported like other shells do (status 128 + SIGTSTP). */
+int foreground_job(struct job *job)
+{
+    job_wait(job);
+
+    if (interactive && job->pgid != 0) {
+        tcsetpgrp(terminal_fd, getpgrp());
+        if (job->running > 0) {
+            job->has_tmodes = (tcgetattr(terminal_fd, &job->tmodes) == 0);
+        }
+        tcsetattr(terminal_fd, TCSADRAIN, &shell_tmodes);
+    }
+
+    if (job->running > 0) {
+        job_add(job);
+        job->reported = true;
+        printf("\n");
+        job_print(job);
+        return W_EXITCODE(128 + SIGTSTP, 0);
+    }
+
+    job_remove(job);
+    set_pipestatus(job->stages, job->num_stages);
+    stats_record(job->stages, job->num_stages);
+    return job_status(job);
+}
+
+/* 'parallel' is the last stage of 'cmds'. Its arguments come from -a file, a
+ * '<' redirection, the commands piped into it or else the shell's own stdin,
+ * and its output can be redirected with '>' or '>>'. The producers and
+ * 'parallel' itself are recorded as the pipeline's stages. Returns the wait
+ * status of the last command that failed. */
+int parallel_builtin(struct command_line *cmds, size_t num_cmds, bool timed,
+        const char *line)
+{
+    struct command_line *cmd = &cmds[num_cmds - 1];
+    struct stage_time stage = { .name = cmd->tokens[0] };
+    struct rusage start_usage;
+    double start = time_now();
+    if (timed) {
+        getrusage(RUSAGE_SELF, &start_usage);
+    }
+
+    int out_fd = STDOUT_FILENO;
+    FILE *input = NULL;
+    struct job *producer = NULL;
+    struct parallel_opts opts;
+    stage.status = W_EXITCODE(2, 0);
+    if (parallel_parse(cmd->tokens + 1, &opts) == -1) {
+        goto done;
+    }
+
+    stage.status = W_EXITCODE(1, 0);
+    if (cmd->stdout_file != NULL) {
+        int flags = O_CREAT | O_WRONLY | O_CLOEXEC | (cmd->append ? O_APPEND : O_TRUNC);
+        out_fd = open(cmd->stdout_file, flags, 0666);
+        if (out_fd == -1) {
+            perror(cmd->stdout_file);
+            out_fd = STDOUT_FILENO;
+            goto done;
+        }
+    }
+
+    input = stdin;
+    const char *in_file = (opts.arg_file != NULL) ? opts.arg_file : cmd->stdin_file;
+    if (in_file != NULL) {
+        input = fopen(in_file, "re");
+        if (input == NULL) {
+            perror(in_file);
+        }
+    } else if (num_cmds > 1) {
+        /* Run the commands before it in the background, reading their output */
+        int read_fd = -1;
+        producer = launch_pipeline(cmds, num_cmds - 1, line, false, &read_fd);
+        input = (read_fd != -1) ? fdopen(read_fd, "r") : NULL;
+    }
+
+    if (input != NULL) {
+        fflush(stdout);
+        stage.status = parallel_run(&opts, input, out_fd);
+        if (input != stdin) {
+            fclose(input);
+        }
+    }
+    if (out_fd != STDOUT_FILENO) {
+        close(out_fd);
+    }
+
+done:
+    /* Closing the pipe ends the producers if parallel stopped early */
+    if (producer != NULL) {
+        job_wait(producer);
+        if (producer->running > 0) {
+            job_continue(producer);
+            job_wait(producer);
+        }
+    }
+    stage.elapsed = time_now() - start;
+    if (timed) {
+        time_usage_since(&start_usage, &stage.usage);
     }
 
-    return current_ptr;
+    /* The producers' stages come first, like in any other pipeline */
+    struct stage_time *stages = &stage;
+    size_t num_stages = 1;
+    if (producer != NULL) {
+        stages = malloc((producer->num_stages + 1) * sizeof(struct stage_time));
+        if (stages != NULL) {
+            memcpy(stages, producer->stages,
+                    producer->num_stages * sizeof(struct stage_time));
+            stages[producer->num_stages] = stage;
+            num_stages = producer->num_stages + 1;
+        } else {
+            perror("parallel stages malloc");
+            stages = &stage;
+        }
+    }
+    if (timed) {
+        time_print(stderr, stages, num_stages, stage.elapsed);
+    }
+    time_log_write(hist_last_cnum(), line, stages, num_stages, stage.elapsed);
+    set_pipestatus(stages, num_stages);
+    stats_record(stages, num_stages);
+    if (stages != &stage) {
+        free(stages);
+    }
+    if (producer != NULL) {
+        job_destroy(producer);
+    }
+    return stage.status;
 }
 
-struct elist *tokenize(char *command)
+/* Reads a positive size from the environment, like HISTSIZE */
+unsigned int size_env(const char *name, unsigned int default_sz)
 {
-    struct elist *tokens = elist_create(26);
-    char *next_tok = command;
-    char *curr_tok;
+    char *size = getenv(name);
+    if (size == NULL) {
+        return default_sz;
+    }
 
-    /* Tokenize -- note that ' \t\n\r' will all be removed */
-    while ((curr_tok = next_token(&next_tok, " \t\n\r")) != NULL) {
-        elist_add(tokens, curr_tok);
-        LOG("Token %zu: '%s'\n", elist_size(tokens) - 1, curr_tok);
+    char *endPtr;
+    long limit = strtol(size, &endPtr, 10);
+    if (*endPtr != '\0' || limit <= 0 || limit > UINT_MAX) {
+        return default_sz;
     }
+    return limit;
+}
 
-    elist_add(tokens, (char *) 0);
-    LOG("Token %zu: '%s'\n", elist_size(tokens) - 1, curr_tok);
-    return tokens;
+/* Attaches the persistent history log: HISTFILE, or ~/.ash_history */
+void load_history_file(void)
+{
+    char *hist_file = getenv("HISTFILE");
+    if (hist_file != NULL) {
+        hist_load_file(hist_file, size_env("HISTFILESIZE", DEFAULT_HISTFILE_SZ));
+        return;
+    }
+
+    char *home = getenv("HOME");
+    if (home == NULL) {
+        return;
+    }
+
+    char *path = malloc(strlen(home) + strlen("/.ash_history") + 1);
+    if (path == NULL) {
+        perror("history path malloc");
+        return;
+    }
+    sprintf(path, "%s/.ash_history", home);
+    hist_load_file(path, size_env("HISTFILESIZE", DEFAULT_HISTFILE_SZ));
+    free(path);
 }
 
-struct elist *setup_commands(struct elist *tokens)
+/* Points 'fd' at 'path' opened with 'flags' and returns a copy of what it
+ * referred to before, for restore_fd(); -1 if the file cannot be opened */
+int redirect_fd(int fd, const char *path, int flags)
 {
-    /* Grab tokens as an array first to help brain understand */
-    char **tokens_arr = (char **) elist_elements(tokens);
-
-    struct elist *cmds = elist_create(30);
-    int token_start = 0;
-    LOG("elist size: %zu\n", elist_size(tokens));
-
-    bool redirect_stdin = false;
-    bool redirect_stdout = false;
-    bool append_flag = false;
-    char *stdin_file;
-    char *stdout_file;
-
-    /* Iterating up to the last token before our null pointer */
-    for (int i = 0; i < elist_size(tokens) - 1; i++) {
-        /* Checking for redirection */
-        if (strcmp(tokens_arr[i], "<") == 0) { 
-            tokens_arr[i] = (char *) 0;
-            redirect_stdin = true;
-            stdin_file = tokens_arr[i+1];
-            continue; // can't string compare null so go next
-        } else if (strcmp(tokens_arr[i], ">") == 0) {
-            tokens_arr[i] = (char *) 0;
-            redirect_stdout = true;
-            stdout_file = tokens_arr[i+1];
-            continue;
-        } else if (strcmp(tokens_arr[i], ">>") == 0) {
-            tokens_arr[i] = (char *) 0;
-            redirect_stdout = true;
-            append_flag = true;
-            stdout_file = tokens_arr[i+1];
-            continue;
-        } else if (strncmp(tokens_arr[i], "#", 1) == 0) {
-            tokens_arr[i] = (char *) 0;
-            i = elist_size(tokens) - 2; // jump to end of array to create command struct
-        }
-
-        /* Check if we are at last token before our null pointer or a pipe */
-        if ((i == elist_size(tokens) - 2) || (strcmp(tokens_arr[i], "|") == 0)) {
-            /* Set up command_line struct */
-            struct command_line *cmd = malloc(sizeof(struct command_line));
-            if (cmd == NULL) {
-                perror("command_line malloc");
-                return NULL;
-            }
+    int file_fd = open(path, flags | O_CLOEXEC, 0666);
+    if (file_fd == -1) {
+        perror(path);
+        return -1;
+    }
+
+    int saved_fd = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    dup2(file_fd, fd);
+    close(file_fd);
+    return saved_fd;
+}
 
-            /* Set up command_line struct */
-            cmd->stdout_pipe = false;
-            cmd->append = append_flag;
-            cmd->stdin_file = redirect_stdin ? stdin_file : NULL;
-            cmd->stdout_file = redirect_stdout ? stdout_file : NULL;
-            cmd->tokens = tokens_arr + token_start;
-            
-            /* If we are at pipe, set pipe boolean to true */
-            if (strcmp(tokens_arr[i], "|") == 0) {
-                tokens_arr[i] = (char *) 0;
-                cmd->stdout_pipe = true;
-                token_start = i + 1;
-            }            
-            
-            elist_add(cmds, cmd);
-            LOG("cmd tokens: %s\n", *(cmd->tokens));
-
-            /* Reset all flags */
-            redirect_stdin = false;
-            redirect_stdout = false;
-            append_flag = false;
-        }
-    }
-    return cmds;
+void restore_fd(int fd, int saved_fd)
+{
+    if (saved_fd != -1) {
+        dup2(saved_fd, fd);
+        close(saved_fd);
+    }
 }
 
-int execute_pipeline(struct elist *cmds, int pos)
+/* Runs a single command that is built into the shell without forking. Its
+ * redirections are applied by swapping the shell's own stdin/stdout for the
+ * duration of the command. Returns the wait status it would have had. */
+int run_builtin(builtin_fn builtin, struct command_line *cmd, bool timed,
+        const char *line)
 {
-    /* Sets up a pipeline piece by piece */
-    struct command_line *cmd = elist_get(cmds, pos);
+    struct stage_time stage = { .name = cmd->tokens[0] };
+    struct rusage start_usage;
+    TRACE_START(trace_start);
+    double start = time_now();
+    if (timed) {
+        getrusage(RUSAGE_SELF, &start_usage);
+    }
 
-    /* Take care of any redirection -- will cary into child as well */
+    /* Anything the shell printed so far belongs to the old stdout */
+    fflush(stdout);
+    int saved_in = -1;
+    int saved_out = -1;
+    int code = 1;
     if (cmd->stdin_file != NULL) {
-        int input = open(cmd->stdin_file, O_RDONLY, 0666);
-        dup2(input, STDIN_FILENO);
+        saved_in = redirect_fd(STDIN_FILENO, cmd->stdin_file, O_RDONLY);
+        if (saved_in == -1) {
+            goto done;
+        }
     }
     if (cmd->stdout_file != NULL) {
-        int output;
-        if (cmd->append) {
-            output = open(cmd->stdout_file, O_CREAT | O_WRONLY | O_APPEND, 0666);
-        } else {
-            output = open(cmd->stdout_file, O_CREAT | O_WRONLY | O_TRUNC, 0666);
-        }
-        dup2(output, STDOUT_FILENO);
-    }
-
-    if (cmd->stdout_pipe) {
-        int fds[2];
-        pipe(fds);
-        pid_t pid = fork();
-        if (pid == 0) {
-            /* Child - sending stdout of command to the pipe */
-            LOG("child command: %s\n", *(cmd->tokens));
-            close(fds[0]); // closing read
-            dup2(fds[1], STDOUT_FILENO);
-            close(fds[1]); // cleaning up fds
-            execvp(cmd->tokens[0], cmd->tokens);
-            close(STDIN_FILENO); // child proc will reset fd for parent if exec fails
-            perror("Bad command");
-            exit(1);
+        int flags = O_CREAT | O_WRONLY | (cmd->append ? O_APPEND : O_TRUNC);
+        saved_out = redirect_fd(STDOUT_FILENO, cmd->stdout_file, flags);
+        if (saved_out == -1) {
+            goto done;
+        }
+    }
+    code = builtin(cmd->tokens);
+    fflush(stdout);
+
+done:
+    restore_fd(STDOUT_FILENO, saved_out);
+    restore_fd(STDIN_FILENO, saved_in);
+
+    stage.status = W_EXITCODE(code, 0);
+    stage.elapsed = time_now() - start;
+    if (timed) {
+        time_usage_since(&start_usage, &stage.usage);
+        time_print(stderr, &stage, 1, stage.elapsed);
+    }
+    time_log_write(hist_last_cnum(), line, &stage, 1, stage.elapsed);
+    set_pipestatus(&stage, 1);
+    stats_record(&stage, 1);
+    TRACE_SPAN("run_builtin", trace_start, stage.name);
+    return stage.status;
+}
+
+/* Returns the builtin that can run 'cmd' inside the shell, if any. Besides
+ * the simple utilities, 'cat file ... > out' and 'cat < in >> out' are copies
+ * the shell does itself without the data passing through user space;
+ * anything with options is left to the real cat. */
+builtin_fn in_shell_builtin(struct command_line *cmd)
+{
+    builtin_fn builtin = builtin_find(cmd->tokens[0]);
+    if (builtin != NULL || cmd->stdout_file == NULL
+            || strcmp(cmd->tokens[0], "cat") != 0) {
+        return builtin;
+    }
+    for (char **arg = cmd->tokens + 1; *arg != NULL; arg++) {
+        if ((*arg)[0] == '-' && (*arg)[1] != '\0') {
+            return NULL;
+        }
+    }
+    return cat_builtin;
+}
+
+/* Runs a parsed command line; 'line' is its text as entered */
+void run_parsed(struct parsed_line *parsed, const char *line)
+{
+    if (parsed->syntax_error != NULL) {
+        fprintf(stderr, "syntax error near '%s'\n", parsed->syntax_error);
+        set_builtin_status(2);
+        return;
+    }
+
+    /* Execute commands - every stage is spawned by the shell itself, except
+     * for builtin utilities that run alone */
+    struct command_line *cmds = parsed->cmds;
+    size_t num_cmds = parsed->num_cmds;
+    struct command_line *last = (num_cmds > 0) ? &cmds[num_cmds - 1] : NULL;
+
+    struct job *job = NULL;
+    builtin_fn builtin = NULL;
+    if (last != NULL && last->tokens[0] != NULL
+            && strcmp(last->tokens[0], "parallel") == 0) {
+        if (parsed->background) {
+            /* It runs inside the shell, so it cannot be left running */
+            fprintf(stderr, "parallel: cannot run in the background\n");
+            set_builtin_status(2);
         } else {
-            /* Parent - setting up the stdin of the next process to come from the pipe */
-            LOG("parent command: %s\n", *(cmd->tokens));
-            close(fds[1]); // closing write
-            dup2(fds[0], STDIN_FILENO);
-            close(fds[0]); // cleaning up fds
-            execute_pipeline(cmds, pos+1);
+            set_prompt_status(parallel_builtin(cmds, num_cmds, parsed->timed, line));
         }
+    } else if (num_cmds == 1 && !parsed->background && cmds[0].tokens[0] != NULL
+            && (builtin = in_shell_builtin(&cmds[0])) != NULL) {
+        /* Simple utilities and file copies on their own run inside the shell */
+        set_prompt_status(run_builtin(builtin, &cmds[0], parsed->timed, line));
     } else {
-        LOG("last command: %s\n", *(cmd->tokens));
-        execvp(cmd->tokens[0], cmd->tokens);
-        close(STDIN_FILENO); // child proc will reset fd for parent if exec fails
-        perror("Bad command");
-        exit(1);
+        job = launch_pipeline(cmds, num_cmds, line, !parsed->background, NULL);
+    }
+
+    if (job != NULL && parsed->background) {
+        job_add(job);
+        if (interactive) {
+            printf("[%u] %d\n", job->id, job->pgid);
+            fflush(stdout);
+        }
+    } else if (job != NULL) {
+        set_prompt_status(foreground_job(job));
+    }
+
+    /* Account for a finished pipeline; a stopped one now lives in the job
+     * table and is cleaned up when it finishes */
+    if (job != NULL && !parsed->background && job->running == 0) {
+        double wall = time_now() - job->start;
+        if (parsed->timed) {
+            time_print(stderr, job->stages, job->num_stages, wall);
+        }
+        time_log_write(hist_last_cnum(), line, job->stages, job->num_stages, wall);
+        job_destroy(job);
+    }
+}
+
+/* Script mode: the whole script is read at once and every command line is
+ * parsed before the first one runs, into an arena that lives as long as the
+ * script. Builtins and history expansion still happen line by line, since
+ * they depend on what ran before. So do wildcards, whose matches depend on
+ * the files earlier commands left behind, and variables: a line with
+ * wildcards or a '$', or one changed by '!' expansion, is parsed when it
+ * runs, in an arena reset for every line. The script is 'command' for
+ * 'ash -c', or else stdin. */
+void run_script(const char *command)
+{
+    TRACE_START(start);
+    ssize_t loaded = (command != NULL) ? script_load_string(command)
+        : script_load(STDIN_FILENO);
+    TRACE_SPAN("read", start, "script");
+    if (loaded <= 0) {
+        return;
+    }
+    size_t num_lines = loaded;
+
+    struct arena script_arena;
+    struct arena line_arena;
+    arena_init(&script_arena, num_lines * sizeof(struct parsed_line) * 2);
+    arena_init(&line_arena, 0);
+
+    struct parsed_line *parsed = arena_alloc(&script_arena,
+            num_lines * sizeof(struct parsed_line));
+    if (parsed == NULL) {
+        script_unload();
+        return;
+    }
+    for (size_t i = 0; i < num_lines; i++) {
+        char *text = script_line(i);
+        parsed[i].tokens = NULL;
+        if (text[0] != '\0' && text[0] != '#' && text[0] != '!' && !is_builtin(text)
+                && strpbrk(text, "*?[$") == NULL) {
+            parse_line(script_scratch(i), &script_arena, &parsed[i]);
+        }
+    }
+
+    for (size_t i = 0; i < num_lines; i++) {
+        jobs_reap(false);
+        set_prompt_status(0);
+        arena_reset(&line_arena);
+
+        char *text = script_line(i);
+        char *command = text;
+        TRACE_START(builtins_start);
+        int check_builtins = handle_builtins(&command, &line_arena);
+        TRACE_SPAN("builtins", builtins_start, text);
+        if (check_builtins == -1) {
+            break;
+        } else if (check_builtins == 0) {
+            continue;
+        }
+
+        hist_add(command);
+        if (command == text) {
+            if (parsed[i].tokens == NULL) {
+                parse_line(script_scratch(i), &line_arena, &parsed[i]);
+            }
+            run_parsed(&parsed[i], text);
+        } else {
+            struct parsed_line expanded;
+            char *line = arena_strdup(&line_arena, command);
+            parse_line(command, &line_arena, &expanded);
+            run_parsed(&expanded, line);
+        }
     }
-    return 0; // why do we have to include if above else has exit??
+
+    arena_destroy(&line_arena);
+    arena_destroy(&script_arena);
+    script_unload();
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
+    /* 'ash -c command' runs the command like a one-line script */
+    const char *command = NULL;
+    if (argc == 3 && strcmp(argv[1], "-c") == 0) {
+        command = argv[2];
+    } else if (argc != 1) {
+        fprintf(stderr, "usage: %s [-c command]\n", argv[0]);
+        return 2;
+    }
+
+    /* Shell variables start out as the environment */
+    vars_init();
+
     /* Ignore CTRL+C signal */
     signal(SIGINT, SIG_IGN);
 
-    /* Set up ui and history struct */
-    init_ui();
-    hist_init(100);
+    /* Pipelines run in their own process groups; the shell must be able to
+     * take the terminal back from them */
+    interactive = (command == NULL && isatty(STDIN_FILENO));
+    if (interactive) {
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+        tcgetattr(terminal_fd, &shell_tmodes);
+    }
+    jobs_init();
 
-    char *command;
-    while (true) {
-        command = read_command();
+    /* ASH_TRACE=path records where the time goes, as Chrome trace JSON */
+    char *trace_file = getenv("ASH_TRACE");
+    if (trace_file != NULL && trace_file[0] != '\0') {
+        trace_init(trace_file);
+    }
+
+    /* Scripts start without the prompt's lookups or readline */
+    if (interactive) {
+        init_ui();
+        /* Tab completion offers the builtins along with PATH */
+        for (size_t i = 0; i < NUM_SHELL_BUILTINS; i++) {
+            complete_add_name(shell_builtins[i]);
+        }
+        for (size_t i = 0; builtin_name(i) != NULL; i++) {
+            complete_add_name(builtin_name(i));
+        }
+    } else {
+        LOGP("Not reading from a terminal; entering script mode\n");
+    }
+    hist_init(size_env("HISTSIZE", DEFAULT_HIST_SZ));
+
+    /* ASH_TIMELOG=path appends every command's metrics as JSON lines */
+    char *time_log = getenv("ASH_TIMELOG");
+    if (time_log != NULL) {
+        time_log_open(time_log);
+    }
+
+    /* ASH_STATS=path appends the session's per-command statistics at exit */
+    char *stats_file = getenv("ASH_STATS");
+    if (stats_file != NULL && stats_file[0] != '\0') {
+        stats_init(stats_file);
+    }
+
+    /* Only interactive sessions are saved across runs, like other shells */
+    if (interactive) {
+        load_history_file();
+    }
+
+    if (!interactive) {
+        run_script(command);
+    }
+
+    /* Parsing allocates from an arena that is reset for every line */
+    struct arena line_arena;
+    arena_init(&line_arena, 0);
+
+    while (interactive) {
+        /* Announce background jobs that finished while the last command ran */
+        jobs_reap(true);
+        arena_reset(&line_arena);
+
+        TRACE_START(read_start);
+        char *input = read_command();
+        TRACE_SPAN("read", read_start, NULL);
         set_prompt_status(0); // reset prompt status
 
-        if (command == NULL) {
-            free(command);
+        if (input == NULL) {
             break;
         }
         
         /* Handle built in commands */
-        int check_builtins = handle_builtins(&command);
+        char *command = input;
+        TRACE_START(builtins_start);
+        int check_builtins = handle_builtins(&command, &line_arena);
+        TRACE_SPAN("builtins", builtins_start, input);
         if (check_builtins == -1) {
-            free(command);
+            free(input);
             break;
         } else if (check_builtins == 0) {
-            free(command);
+            free(input);
             continue;
         }
 
         hist_add(command);
-        
-        /* Tokenize command */
-        struct elist *tokens = tokenize(command);
-
-        /* Execute commands - handler process will call execute_pipeline */
-        struct elist *cmds = setup_commands(tokens);
-        pid_t child = fork();
-        if (child == 0) {
-            execute_pipeline(cmds, 0);
-        } else {
-            int status;
-            wait(&status); // waiting to know that the pipeline is finished
-            set_prompt_status(status);
-        }
 
-        /* Free user commad, each command and then all tokens and cmds list */
-        free(command);
-        for (int i = 0; i < elist_size(cmds); i++) {
-            struct command_line *cmd = elist_get(cmds, i);
-            free(cmd);
-        }
-        elist_destroy(tokens);
-        elist_destroy(cmds);
+        /* Tokenize and run command; the history keeps its original text */
+        struct parsed_line parsed;
+        parse_line(command, &line_arena, &parsed);
+        const char *line = hist_search_cnum(hist_last_cnum());
+        run_parsed(&parsed, (line != NULL) ? line : "");
+
+        /* Free user command; everything parsed goes with the arena */
+        free(input);
     }
 
+    arena_destroy(&line_arena);
+    time_log_close();
     hist_destroy();
-    return 0;
+
+    /* Like sh, a script (or 'ash -c') exits with its last command's status */
+    return interactive ? 0 : vars_status();
 }
@@ -0,0 +1,313 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "timing.h"
+#include "logger.h"
+
+#define DEFAULT_TABLE_SZ 64
+#define MAX_LOAD_PERCENT 70
+
+/* Histogram layout: values below 2 * SUB_BUCKETS microseconds have a bucket
+ * each; above that every power of two is split into SUB_BUCKETS buckets.
+ * Anything over 2^MAX_EXP us (about 12 days) goes in the last bucket. */
+#define SUB_BITS 5
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define MAX_EXP 40
+#define NUM_BUCKETS ((MAX_EXP - SUB_BITS + 2) * SUB_BUCKETS)
+
+struct cmd_stats {
+    char *name;               /*!< Command name, NULL marks a free slot */
+    unsigned long count;
+    unsigned long failures;   /*!< Runs with a non-zero exit code */
+    double total;             /*!< Seconds */
+    uint64_t max_us;
+    uint32_t *buckets;        /*!< NUM_BUCKETS counts */
+};
+
+/* Open addressing with linear probing, like the PATH hash table; entries are
+ * only dropped all at once by 'stats -r' */
+static struct cmd_stats *table;
+static size_t table_sz;
+static size_t used;
+
+static char *stats_path;
+static pid_t stats_pid;
+static time_t session_start;
+
+static struct cmd_stats *entry_find(const char *name);
+static int table_grow(void);
+static size_t bucket_index(uint64_t us);
+static uint64_t bucket_highest(size_t idx);
+static uint64_t entry_percentile(struct cmd_stats *entry, double pct);
+static int compare_total(const void *a, const void *b);
+static void stats_flush(void);
+
+/* Appends the session's statistics to 'path' when the shell exits */
+int stats_init(const char *path)
+{
+    stats_path = strdup(path);
+    if (stats_path == NULL) {
+        perror("stats strdup");
+        return -1;
+    }
+    stats_pid = getpid();
+    session_start = time(NULL);
+    atexit(stats_flush);
+    return 0;
+}
+
+/* Adds the stages of a finished pipeline, each under its command name */
+void stats_record(struct stage_time *stages, size_t num_stages)
+{
+    for (size_t i = 0; i < num_stages; i++) {
+        if (stages[i].name == NULL) {
+            continue;
+        }
+        if (table == NULL || (used + 1) * 100 > table_sz * MAX_LOAD_PERCENT) {
+            if (table_grow() == -1) {
+                return;
+            }
+        }
+
+        struct cmd_stats *entry = entry_find(stages[i].name);
+        if (entry->name == NULL) {
+            uint32_t *buckets = calloc(NUM_BUCKETS, sizeof(uint32_t));
+            char *name = strdup(stages[i].name);
+            if (buckets == NULL || name == NULL) {
+                perror("stats calloc");
+                free(buckets);
+                free(name);
+                return;
+            }
+            entry->name = name;
+            entry->buckets = buckets;
+            used++;
+        }
+
+        uint64_t us = (stages[i].elapsed > 0) ? stages[i].elapsed * 1e6 + 0.5 : 0;
+        entry->count++;
+        entry->total += stages[i].elapsed;
+        if (status_exit_code(stages[i].status) != 0) {
+            entry->failures++;
+        }
+        if (us > entry->max_us) {
+            entry->max_us = us;
+        }
+        entry->buckets[bucket_index(us)]++;
+    }
+}
+
+/* The 'pct' percentile of the time 'name' took, in seconds, or -1 if it
+ * never ran */
+double stats_percentile(const char *name, double pct)
+{
+    if (table == NULL) {
+        return -1;
+    }
+    struct cmd_stats *entry = entry_find(name);
+    if (entry->name == NULL) {
+        return -1;
+    }
+    return entry_percentile(entry, pct) / 1e6;
+}
+
+/* Prints a table of the commands run so far, most total time first */
+void stats_print(FILE *out)
+{
+    if (used == 0) {
+        fprintf(out, "stats: no commands run\n");
+        fflush(out);
+        return;
+    }
+
+    struct cmd_stats **sorted = malloc(used * sizeof(struct cmd_stats *));
+    if (sorted == NULL) {
+        perror("stats malloc");
+        return;
+    }
+    size_t num = 0;
+    for (size_t i = 0; i < table_sz; i++) {
+        if (table[i].name != NULL) {
+            sorted[num++] = &table[i];
+        }
+    }
+    qsort(sorted, num, sizeof(struct cmd_stats *), compare_total);
+
+    fprintf(out, "%-20s %8s %6s %10s %10s %10s %10s %10s\n", "command", "count",
+            "fail", "total(s)", "p50(ms)", "p90(ms)", "p99(ms)", "max(ms)");
+    for (size_t i = 0; i < num; i++) {
+        struct cmd_stats *entry = sorted[i];
+        fprintf(out, "%-20s %8lu %6lu %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+                entry->name, entry->count, entry->failures, entry->total,
+                entry_percentile(entry, 50) / 1e3,
+                entry_percentile(entry, 90) / 1e3,
+                entry_percentile(entry, 99) / 1e3, entry->max_us / 1e3);
+    }
+    fflush(out);
+    free(sorted);
+}
+
+/* Writes the statistics as one line of JSON. The non-empty buckets are given
+ * as [lowest microseconds, count] pairs, so histograms from many sessions
+ * can be added up. */
+void stats_write_json(FILE *out)
+{
+    fprintf(out, "{\"pid\":%d,\"start\":%ld,\"end\":%ld,\"commands\":{",
+            (int) getpid(), (long) session_start, (long) time(NULL));
+    bool first = true;
+    for (size_t i = 0; i < table_sz; i++) {
+        struct cmd_stats *entry = &table[i];
+        if (entry->name == NULL) {
+            continue;
+        }
+        fprintf(out, "%s", first ? "" : ",");
+        json_string(out, entry->name);
+        fprintf(out, ":{\"count\":%lu,\"failures\":%lu,\"total\":%.6f,"
+                "\"p50_us\":%lu,\"p90_us\":%lu,\"p99_us\":%lu,\"max_us\":%lu,"
+                "\"buckets\":[", entry->count, entry->failures, entry->total,
+                (unsigned long) entry_percentile(entry, 50),
+                (unsigned long) entry_percentile(entry, 90),
+                (unsigned long) entry_percentile(entry, 99),
+                (unsigned long) entry->max_us);
+        bool first_bucket = true;
+        for (size_t b = 0; b < NUM_BUCKETS; b++) {
+            if (entry->buckets[b] != 0) {
+                uint64_t lowest = (b == 0) ? 0 : bucket_highest(b - 1) + 1;
+                fprintf(out, "%s[%lu,%u]", first_bucket ? "" : ",",
+                        (unsigned long) lowest, entry->buckets[b]);
+                first_bucket = false;
+            }
+        }
+        fprintf(out, "]}");
+        first = false;
+    }
+    fprintf(out, "}}\n");
+    fflush(out);
+}
+
+/* Forgets everything recorded so far ('stats -r') */
+void stats_reset(void)
+{
+    for (size_t i = 0; i < table_sz; i++) {
+        free(table[i].name);
+        free(table[i].buckets);
+    }
+    free(table);
+    table = NULL;
+    table_sz = 0;
+    used = 0;
+}
+
+struct cmd_stats *entry_find(const char *name)
+{
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037ull;
+    for (const char *c = name; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char) *c) * 1099511628211ull;
+    }
+
+    size_t mask = table_sz - 1;
+    size_t slot = hash & mask;
+    while (table[slot].name != NULL && strcmp(table[slot].name, name) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return &table[slot];
+}
+
+int table_grow(void)
+{
+    struct cmd_stats *old_table = table;
+    size_t old_sz = table_sz;
+
+    size_t new_sz = (old_sz == 0) ? DEFAULT_TABLE_SZ : old_sz * 2;
+    struct cmd_stats *new_table = calloc(new_sz, sizeof(struct cmd_stats));
+    if (new_table == NULL) {
+        perror("stats calloc");
+        return -1;
+    }
+    table = new_table;
+    table_sz = new_sz;
+
+    for (size_t i = 0; i < old_sz; i++) {
+        if (old_table[i].name != NULL) {
+            *entry_find(old_table[i].name) = old_table[i];
+        }
+    }
+    free(old_table);
+    return 0;
+}
+
+size_t bucket_index(uint64_t us)
+{
+    if (us < 2 * SUB_BUCKETS) {
+        return us;
+    }
+    int exp = 63 - __builtin_clzll(us);
+    if (exp > MAX_EXP) {
+        return NUM_BUCKETS - 1;
+    }
+    int shift = exp - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((us >> shift) - SUB_BUCKETS);
+}
+
+/* The largest value that lands in bucket 'idx' */
+uint64_t bucket_highest(size_t idx)
+{
+    if (idx < 2 * SUB_BUCKETS) {
+        return idx;
+    }
+    int shift = idx / SUB_BUCKETS - 1;
+    uint64_t lowest = (uint64_t) (SUB_BUCKETS + idx % SUB_BUCKETS) << shift;
+    return lowest + ((uint64_t) 1 << shift) - 1;
+}
+
+/* In microseconds; the bucket's largest value, but never above the maximum */
+uint64_t entry_percentile(struct cmd_stats *entry, double pct)
+{
+    uint64_t rank = entry->count * pct / 100 + 0.5;
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t b = 0; b < NUM_BUCKETS; b++) {
+        seen += entry->buckets[b];
+        if (seen >= rank) {
+            uint64_t highest = bucket_highest(b);
+            return (highest < entry->max_us) ? highest : entry->max_us;
+        }
+    }
+    return entry->max_us;
+}
+
+int compare_total(const void *a, const void *b)
+{
+    const struct cmd_stats *x = *(const struct cmd_stats **) a;
+    const struct cmd_stats *y = *(const struct cmd_stats **) b;
+    if (x->total != y->total) {
+        return (x->total < y->total) ? 1 : -1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+/* Only the shell itself writes its statistics, not a child that inherited
+ * the handler */
+void stats_flush(void)
+{
+    if (getpid() != stats_pid || used == 0) {
+        return;
+    }
+    FILE *out = fopen(stats_path, "a");
+    if (out == NULL) {
+        perror(stats_path);
+        return;
+    }
+    stats_write_json(out);
+    fclose(out);
+    LOG("Wrote statistics for %zu commands to %s\n", used, stats_path);
+}
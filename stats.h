@@ -0,0 +1,27 @@
+/**
+ * @file
+ *
+ * Per-command statistics for the session: how often each command ran, how
+ * often it failed, the time it took in total and a latency histogram, for
+ * the 'stats' builtin. With ASH_STATS=path they are appended to 'path' as
+ * one JSON object per session when the shell exits.
+ *
+ * The histograms are log-linear like HDR histograms: every power of two of
+ * microseconds is split into 32 buckets, so percentiles are within about 3%.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+
+#include "timing.h"
+
+int stats_init(const char *path);
+void stats_record(struct stage_time *stages, size_t num_stages);
+double stats_percentile(const char *name, double pct);
+void stats_print(FILE *out);
+void stats_write_json(FILE *out);
+void stats_reset(void);
+
+#endif
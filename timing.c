@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "timing.h"
+#include "logger.h"
+
+static FILE *time_log;
+
+static double tv_sec(struct timeval tv);
+
+/* Monotonic clock in seconds */
+double time_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Converts a wait status into an exit code the way other shells report it */
+int status_exit_code(int status)
+{
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+/* Resources the shell itself used since getrusage() filled in 'start', for
+ * commands that run inside the shell. maxrss is the shell's own peak. */
+void time_usage_since(const struct rusage *start, struct rusage *usage)
+{
+    struct rusage now;
+    getrusage(RUSAGE_SELF, &now);
+    timersub(&now.ru_utime, &start->ru_utime, &usage->ru_utime);
+    timersub(&now.ru_stime, &start->ru_stime, &usage->ru_stime);
+    usage->ru_maxrss = now.ru_maxrss;
+    usage->ru_nvcsw = now.ru_nvcsw - start->ru_nvcsw;
+    usage->ru_nivcsw = now.ru_nivcsw - start->ru_nivcsw;
+    usage->ru_minflt = now.ru_minflt - start->ru_minflt;
+    usage->ru_majflt = now.ru_majflt - start->ru_majflt;
+}
+
+/* Prints the 'time' report: pipeline totals, then one line per stage */
+void time_print(FILE *out, struct stage_time *stages, size_t num_stages, double wall)
+{
+    struct rusage total = { 0 };
+    double user = 0;
+    double sys = 0;
+    for (size_t i = 0; i < num_stages; i++) {
+        struct rusage *ru = &stages[i].usage;
+        user += tv_sec(ru->ru_utime);
+        sys += tv_sec(ru->ru_stime);
+        total.ru_maxrss = (ru->ru_maxrss > total.ru_maxrss) ? ru->ru_maxrss : total.ru_maxrss;
+        total.ru_nvcsw += ru->ru_nvcsw;
+        total.ru_nivcsw += ru->ru_nivcsw;
+        total.ru_minflt += ru->ru_minflt;
+        total.ru_majflt += ru->ru_majflt;
+    }
+
+    fprintf(out, "real %.3fs  user %.3fs  sys %.3fs  maxrss %ldKiB  "
+            "csw %ld/%ld  faults %ld/%ld\n",
+            wall, user, sys, total.ru_maxrss,
+            total.ru_nvcsw, total.ru_nivcsw, total.ru_minflt, total.ru_majflt);
+
+    /* Context switches are voluntary/involuntary, faults minor/major */
+    for (size_t i = 0; num_stages > 1 && i < num_stages; i++) {
+        struct rusage *ru = &stages[i].usage;
+        fprintf(out, "  [%zu] %-12s real %.3fs  user %.3fs  sys %.3fs  "
+                "maxrss %ldKiB  csw %ld/%ld  faults %ld/%ld  exit %d\n",
+                i, stages[i].name ? stages[i].name : "-", stages[i].elapsed,
+                tv_sec(ru->ru_utime), tv_sec(ru->ru_stime), ru->ru_maxrss,
+                ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt, ru->ru_majflt,
+                status_exit_code(stages[i].status));
+    }
+    fflush(out);
+}
+
+/* Starts logging every command's metrics to 'path' as JSON lines */
+int time_log_open(const char *path)
+{
+    time_log = fopen(path, "a");
+    if (time_log == NULL) {
+        perror("time log");
+        return -1;
+    }
+    LOG("Logging command metrics to %s\n", path);
+    return 0;
+}
+
+void time_log_close(void)
+{
+    if (time_log != NULL) {
+        fclose(time_log);
+        time_log = NULL;
+    }
+}
+
+/* Appends one record for a finished pipeline, if logging is enabled */
+void time_log_write(unsigned int cmd_num, const char *line,
+        struct stage_time *stages, size_t num_stages, double wall)
+{
+    if (time_log == NULL) {
+        return;
+    }
+
+    fprintf(time_log, "{\"cmd\":%u,\"line\":", cmd_num);
+    json_string(time_log, line);
+    fprintf(time_log, ",\"real\":%.6f,\"stages\":[", wall);
+    for (size_t i = 0; i < num_stages; i++) {
+        struct rusage *ru = &stages[i].usage;
+        fprintf(time_log, "%s{\"name\":", (i == 0) ? "" : ",");
+        json_string(time_log, stages[i].name ? stages[i].name : "");
+        fprintf(time_log, ",\"status\":%d,\"real\":%.6f,\"user\":%.6f,"
+                "\"sys\":%.6f,\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld,"
+                "\"minflt\":%ld,\"majflt\":%ld}",
+                status_exit_code(stages[i].status), stages[i].elapsed,
+                tv_sec(ru->ru_utime), tv_sec(ru->ru_stime), ru->ru_maxrss,
+                ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt, ru->ru_majflt);
+    }
+    fprintf(time_log, "]}\n");
+    fflush(time_log);
+}
+
+double tv_sec(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Writes 'str' as a quoted JSON string */
+void json_string(FILE *out, const char *str)
+{
+    fputc('"', out);
+    for (; *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\') {
+            fprintf(out, "\\%c", *str);
+        } else if ((unsigned char) *str < 0x20) {
+            fprintf(out, "\\u%04x", *str);
+        } else {
+            fputc(*str, out);
+        }
+    }
+    fputc('"', out);
+}
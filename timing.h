@@ -0,0 +1,31 @@
+/**
+ * @file
+ *
+ * Resource accounting for pipelines: the 'time' report and the optional
+ * per-command metrics log (ASH_TIMELOG).
+ */
+
+#ifndef _TIMING_H_
+#define _TIMING_H_
+
+#include <stdio.h>
+#include <sys/resource.h>
+
+struct stage_time {
+    const char *name;      /*!< Command the stage ran */
+    int status;            /*!< Wait status */
+    double elapsed;        /*!< Seconds from pipeline start to exit */
+    struct rusage usage;   /*!< Resources used, from wait4 */
+};
+
+double time_now(void);
+int status_exit_code(int status);
+void time_usage_since(const struct rusage *start, struct rusage *usage);
+void time_print(FILE *out, struct stage_time *stages, size_t num_stages, double wall);
+int time_log_open(const char *path);
+void time_log_close(void);
+void time_log_write(unsigned int cmd_num, const char *line,
+        struct stage_time *stages, size_t num_stages, double wall);
+void json_string(FILE *out, const char *str);
+
+#endif
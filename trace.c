@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "timing.h"
+#include "logger.h"
+
+#define DEFAULT_TRACE_EVENTS 65536
+#define DETAIL_SZ 40
+
+struct trace_event {
+    const char *name;
+    uint64_t start;          /*!< ns on the monotonic clock */
+    uint64_t duration;       /*!< ns */
+    char detail[DETAIL_SZ];
+};
+
+bool trace_enabled;
+
+/* The ring buffer: 'next' only grows, and an event goes to slot
+ * next % capacity, so once it wraps the oldest events are overwritten.
+ * Slots are claimed with an atomic increment, so recording needs no lock. */
+static struct trace_event *events;
+static size_t capacity;
+static uint64_t next;
+static char *trace_path;
+static pid_t trace_pid;
+
+
+/* Turns tracing on; the trace is written to 'path' at exit */
+int trace_init(const char *path)
+{
+    const char *env_events = getenv("ASH_TRACE_EVENTS");
+    capacity = (env_events != NULL) ? strtoul(env_events, NULL, 10) : 0;
+    if (capacity == 0) {
+        capacity = DEFAULT_TRACE_EVENTS;
+    }
+
+    events = calloc(capacity, sizeof(struct trace_event));
+    trace_path = strdup(path);
+    if (events == NULL || trace_path == NULL) {
+        perror("trace buffer");
+        free(events);
+        free(trace_path);
+        return -1;
+    }
+
+    trace_pid = getpid();
+    trace_enabled = true;
+    atexit(trace_flush);
+    return 0;
+}
+
+uint64_t trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_span(const char *name, uint64_t start, const char *detail)
+{
+    uint64_t idx = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+    struct trace_event *event = &events[idx % capacity];
+    event->name = name;
+    event->start = start;
+    event->duration = trace_now() - start;
+    if (detail != NULL) {
+        strncpy(event->detail, detail, DETAIL_SZ - 1);
+        event->detail[DETAIL_SZ - 1] = '\0';
+    } else {
+        event->detail[0] = '\0';
+    }
+}
+
+/* Writes the spans still in the buffer, oldest first, as Chrome trace
+ * "complete" events with microsecond timestamps */
+void trace_flush(void)
+{
+    /* Only the shell itself writes the trace, not a child that inherited it */
+    if (!trace_enabled || getpid() != trace_pid) {
+        return;
+    }
+    trace_enabled = false;
+
+    FILE *out = fopen(trace_path, "w");
+    if (out == NULL) {
+        perror(trace_path);
+        return;
+    }
+
+    uint64_t end = __atomic_load_n(&next, __ATOMIC_RELAXED);
+    uint64_t first = (end > capacity) ? end - capacity : 0;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":\"ash\"}}", trace_pid);
+    for (uint64_t i = first; i < end; i++) {
+        struct trace_event *event = &events[i % capacity];
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"ash\",\"ph\":\"X\","
+                "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+                event->name, event->start / 1e3, event->duration / 1e3,
+                trace_pid, trace_pid);
+        if (event->detail[0] != '\0') {
+            fprintf(out, ",\"args\":{\"detail\":");
+            json_string(out, event->detail);
+            fprintf(out, "}");
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n]}\n");
+    if (first > 0) {
+        LOG("Trace buffer wrapped; dropped %lu oldest spans\n", (unsigned long) first);
+    }
+    fclose(out);
+
+    free(events);
+    free(trace_path);
+    events = NULL;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file
+ *
+ * Runtime tracing. With ASH_TRACE=path the shell records timestamped spans
+ * (reading a command, builtins, tokenize, setup_commands, spawn, wait, ...)
+ * in an in-memory ring buffer, which is written to 'path' as Chrome trace
+ * JSON when the shell exits; open it in Perfetto or chrome://tracing.
+ * ASH_TRACE_EVENTS sets how many of the most recent spans are kept.
+ *
+ * When tracing is off, each trace point costs one branch on 'trace_enabled'.
+ *
+ * Example Usage:
+ * TRACE_START(start);
+ * do_work();
+ * TRACE_SPAN("work", start, NULL);
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+extern bool trace_enabled;
+
+int trace_init(const char *path);
+uint64_t trace_now(void);
+void trace_span(const char *name, uint64_t start, const char *detail);
+void trace_flush(void);
+
+/**
+ * Declares 'start' and records the time in it if tracing is on.
+ */
+#define TRACE_START(start) \
+    uint64_t start = __builtin_expect(trace_enabled, 0) ? trace_now() : 0
+
+/**
+ * Records a span called 'name' (a string literal) from 'start' until now.
+ * 'detail', if not NULL, is copied and shown as the span's argument.
+ */
+#define TRACE_SPAN(name, start, detail) \
+    do { \
+        if (__builtin_expect(trace_enabled, 0)) { \
+            trace_span(name, start, detail); \
+        } \
+    } while (0)
+
+#endif
@@ -0,0 +1,187 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trigram.h"
+#include "elist.h"
+#include "logger.h"
+
+#define DEFAULT_TABLE_SZ 1024
+#define MAX_LOAD_PERCENT 70
+
+/* Posting list of one trigram: the values of every text containing it, in
+ * increasing order. Values are removed oldest first, so removal only moves
+ * 'start' forward; the array is compacted once half of it is dead. Most
+ * trigrams are in only a few texts, and their values stay inside the table
+ * slot itself. */
+struct posting {
+    uint32_t key;        /*!< Packed lowercase trigram, 0 marks a free slot */
+    unsigned int start;  /*!< First live value */
+    struct vlist values; /*!< unsigned int */
+};
+
+/* Open-addressing (linear probing) table of posting lists */
+struct trigram_index {
+    struct posting *table;
+    size_t table_sz;
+    size_t used;
+};
+
+static struct posting *posting_find(struct trigram_index *index, uint32_t key);
+static int table_grow(struct trigram_index *index);
+
+struct trigram_index *trigram_create(void)
+{
+    struct trigram_index *index = malloc(sizeof(struct trigram_index));
+    if (index == NULL) {
+        perror("trigram index malloc");
+        return NULL;
+    }
+
+    index->table_sz = DEFAULT_TABLE_SZ;
+    index->used = 0;
+    index->table = calloc(index->table_sz, sizeof(struct posting));
+    if (index->table == NULL) {
+        perror("trigram table calloc");
+        free(index);
+        return NULL;
+    }
+    return index;
+}
+
+void trigram_destroy(struct trigram_index *index)
+{
+    for (size_t i = 0; i < index->table_sz; i++) {
+        if (index->table[i].key != 0) {
+            vlist_destroy(&index->table[i].values);
+        }
+    }
+    free(index->table);
+    free(index);
+}
+
+/* Packs the (case-folded) trigram starting at 'str' */
+uint32_t trigram_key(const char *str)
+{
+    return (uint32_t) tolower((unsigned char) str[0]) << 16
+        | (uint32_t) tolower((unsigned char) str[1]) << 8
+        | (uint32_t) tolower((unsigned char) str[2]);
+}
+
+/* Folds the trigrams of 'text' into a 64-bit Bloom signature. A text can only
+ * contain a query's trigrams if its signature has all of the query's bits. */
+uint64_t trigram_signature(const char *text)
+{
+    uint64_t sig = 0;
+    for (size_t i = 0; text[i] != '\0' && text[i + 1] != '\0' && text[i + 2] != '\0'; i++) {
+        sig |= 1ull << (((uint64_t) trigram_key(text + i) * 11400714819323198485ull) >> 58);
+    }
+    return sig;
+}
+
+/* Adds 'value' to the posting list of every trigram in 'text'. Values must be
+ * added in increasing order. */
+void trigram_add(struct trigram_index *index, const char *text, unsigned int value)
+{
+    size_t len = strlen(text);
+    for (size_t i = 0; i + 3 <= len; i++) {
+        if ((index->used + 1) * 100 > index->table_sz * MAX_LOAD_PERCENT
+                && table_grow(index) == -1) {
+            return;
+        }
+
+        uint32_t key = trigram_key(text + i);
+        struct posting *post = posting_find(index, key);
+        if (post->key == 0) {
+            post->key = key;
+            vlist_init(&post->values, sizeof(unsigned int));
+            index->used++;
+        }
+
+        /* A trigram repeated within the same text is only listed once */
+        size_t num = vlist_size(&post->values);
+        if (num > post->start
+                && *(unsigned int *) vlist_get(&post->values, num - 1) == value) {
+            continue;
+        }
+
+        unsigned int *slot = vlist_push(&post->values);
+        if (slot == NULL) {
+            perror("trigram posting realloc");
+            return;
+        }
+        *slot = value;
+    }
+}
+
+/* Removes 'value' from the posting lists of 'text'. It must be the oldest
+ * value still in the index. */
+void trigram_remove(struct trigram_index *index, const char *text, unsigned int value)
+{
+    size_t len = strlen(text);
+    for (size_t i = 0; i + 3 <= len; i++) {
+        struct posting *post = posting_find(index, trigram_key(text + i));
+        if (post->key == 0 || post->start == vlist_size(&post->values)
+                || *(unsigned int *) vlist_get(&post->values, post->start) != value) {
+            continue;
+        }
+
+        post->start++;
+        if (post->start == vlist_size(&post->values)) {
+            post->start = 0;
+            vlist_clear(&post->values);
+        } else if (post->start > vlist_size(&post->values) / 2) {
+            vlist_remove_range(&post->values, 0, post->start);
+            post->start = 0;
+        }
+    }
+}
+
+/* Returns the values of texts containing the trigram at 'tri', oldest first.
+ * The number of values is stored in 'count'. */
+const unsigned int *trigram_postings(struct trigram_index *index,
+        const char *tri, size_t *count)
+{
+    struct posting *post = posting_find(index, trigram_key(tri));
+    if (post->key == 0) {
+        *count = 0;
+        return NULL;
+    }
+    *count = vlist_size(&post->values) - post->start;
+    return (unsigned int *) vlist_elements(&post->values) + post->start;
+}
+
+struct posting *posting_find(struct trigram_index *index, uint32_t key)
+{
+    /* Fibonacci hashing spreads the packed characters over the table */
+    size_t mask = index->table_sz - 1;
+    size_t slot = ((uint64_t) key * 11400714819323198485ull) >> 32 & mask;
+    while (index->table[slot].key != 0 && index->table[slot].key != key) {
+        slot = (slot + 1) & mask;
+    }
+    return &index->table[slot];
+}
+
+int table_grow(struct trigram_index *index)
+{
+    struct posting *old_table = index->table;
+    size_t old_sz = index->table_sz;
+
+    struct posting *new_table = calloc(old_sz * 2, sizeof(struct posting));
+    if (new_table == NULL) {
+        perror("trigram table calloc");
+        return -1;
+    }
+    index->table = new_table;
+    index->table_sz = old_sz * 2;
+    LOG("Growing trigram table to %zu slots\n", index->table_sz);
+
+    for (size_t i = 0; i < old_sz; i++) {
+        if (old_table[i].key != 0) {
+            *posting_find(index, old_table[i].key) = old_table[i];
+        }
+    }
+    free(old_table);
+    return 0;
+}
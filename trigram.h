@@ -0,0 +1,25 @@
+/**
+ * @file
+ *
+ * Trigram index: maps every three-character substring (case-insensitive) to
+ * the values of the texts containing it. Used for fuzzy history search.
+ */
+
+#ifndef _TRIGRAM_H_
+#define _TRIGRAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct trigram_index;
+
+struct trigram_index *trigram_create(void);
+void trigram_destroy(struct trigram_index *index);
+uint32_t trigram_key(const char *str);
+uint64_t trigram_signature(const char *text);
+void trigram_add(struct trigram_index *index, const char *text, unsigned int value);
+void trigram_remove(struct trigram_index *index, const char *text, unsigned int value);
+const unsigned int *trigram_postings(struct trigram_index *index,
+        const char *tri, size_t *count);
+
+#endif
@@ -1,26 +1,54 @@
+#include <dlfcn.h>
 #include <stdio.h>
-#include <readline/readline.h>
 #include <locale.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <limits.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "complete.h"
 #include "history.h"
+#include "lineedit.h"
 #include "logger.h"
 #include "ui.h"
 
 static const char *good_str = "😋";
 static const char *bad_str  = "😭";
-static bool scripting = false;
 static int prompt_status;
-static char *user;
+static char user[LOGIN_NAME_MAX + 1];
 static char host[HOST_NAME_MAX + 1];
 // + 1 to deal with possible truncation in gethostname()
-
-static int readline_init(void);
-
+static char home[PATH_MAX];
+
+/* The prompt stays rendered between commands. It is split into a head,
+ * "[status]-[num]-[", which is patched whenever the status or command number
+ * changes, and a tail, "user@host:cwd]$ ", which is only rebuilt after cd
+ * changed the working directory. */
+#define PROMPT_MAX (LOGIN_NAME_MAX + HOST_NAME_MAX + PATH_MAX + 64)
+static char prompt_buf[PROMPT_MAX];
+static size_t head_len;
+static size_t tail_len;
+static int shown_status = -1;
+static unsigned int shown_cmd_num;
+
+static char cwd[PATH_MAX];
+static const char *cwd_display = cwd;
+static bool cwd_stale = true;
+
+/* Line editing comes from the readline plugin, loaded before the first
+ * prompt; without it lines are read as they are */
+static char *(*read_line)(const char *prompt);
+
+static void render_head(int status, unsigned int cmd_num);
+static void render_tail(void);
+static void load_line_editor(void);
+static char *read_plain_line(const char *prompt);
+
+/* Sets up the prompt for an interactive session. Scripts skip this: their
+ * only need, the home directory for 'cd', is looked up when it is used. */
 void init_ui(void)
 {
     LOGP("Initializing UI...\n");
@@ -29,95 +57,111 @@ void init_ui(void)
     LOG("Setting locale: %s\n",
             (locale != NULL) ? locale : "could not set locale!");
     
-    user = prompt_username();
-    strcpy(host, prompt_hostname());
+    /* The user's name, host and home directory do not change while the shell
+     * runs, so they are looked up once */
+    snprintf(user, sizeof(user), "%s", prompt_username());
+    prompt_hostname();
+    get_home();
+}
 
-    rl_startup_hook = readline_init;
+/* Returns the prompt, which stays valid until the next call. Nothing is
+ * allocated and, unless the working directory changed, no system calls are
+ * made. */
+const char *prompt_line(void)
+{
+    if (cwd_stale) {
+        render_tail();
+    }
 
-    if (!isatty(STDIN_FILENO)) {
-        LOGP("Data piped in on stdin; entering script mode\n");
-        scripting = true;
+    int status = (get_prompt_status() != 0);
+    unsigned int cmd_num = prompt_cmd_num();
+    if (status != shown_status || cmd_num != shown_cmd_num) {
+        render_head(status, cmd_num);
     }
+    return prompt_buf;
 }
 
-char *prompt_line(void)
+/* Writes "[status]-[num]-[" at the start of the prompt. The tail is only
+ * moved if the head changed length (e.g. the command number gained a digit). */
+void render_head(int status, unsigned int cmd_num)
 {
-    const char *status = get_prompt_status() ? bad_str : good_str;
-
-    char cmd_num[25];
-    snprintf(cmd_num, 25, "%u", prompt_cmd_num());
-
-    //char *user = prompt_username();
-    //char *host = prompt_hostname();
-    char *cwd = prompt_cwd();
-
-    char *format_str = "[%s]-[%s]-[%s@%s:%s]$ ";
+    char head[64];
+    int len = snprintf(head, sizeof(head), "[%s]-[%u]-[",
+            status ? bad_str : good_str, cmd_num);
 
-    size_t prompt_sz
-        = strlen(format_str)
-        + strlen(status)
-        + strlen(cmd_num)
-        + strlen(user)
-        + strlen(host)
-        + strlen(cwd)
-        + 1;
-
-    char *prompt_str = malloc(sizeof(char) * prompt_sz);
-
-    snprintf(prompt_str, prompt_sz, format_str,
-            status,
-            cmd_num,
-            user,
-            host,
-            cwd);
+    if (len != head_len) {
+        memmove(prompt_buf + len, prompt_buf + head_len, tail_len + 1);
+        head_len = len;
+    }
+    memcpy(prompt_buf, head, len);
+    shown_status = status;
+    shown_cmd_num = cmd_num;
+}
 
-    return prompt_str;
+/* Rebuilds "user@host:cwd]$ " after the working directory changed */
+void render_tail(void)
+{
+    size_t space = sizeof(prompt_buf) - head_len;
+    int len = snprintf(prompt_buf + head_len, space, "%s@%s:%s]$ ",
+            user, host, prompt_cwd());
+    tail_len = (len < 0) ? 0 : ((len < space) ? len : space - 1);
 }
 
-char *prompt_username(void)
+const char *prompt_username(void)
 {
     uid_t uid = getuid();
     /* Password struct exists in memory when our program
      * runs so not actually allocating memory here */
     struct passwd *pwd = getpwuid(uid);
-    return pwd->pw_name;        
+    return (pwd != NULL) ? pwd->pw_name : "?";
 }
 
-char *prompt_hostname(void)
+const char *prompt_hostname(void)
 {
     gethostname(host, HOST_NAME_MAX);
     return host;
 }
 
-char *get_home(void)
+/* The user's home directory, looked up the first time it is needed */
+const char *get_home(void)
 {
-    char *home_dir = malloc(strlen("/home/") + strlen(user) + 1);
-    if (home_dir == NULL) {
-        perror("home_dir malloc error");
-        return NULL;
+    if (home[0] == '\0') {
+        struct passwd *pwd = getpwuid(getuid());
+        const char *home_dir = (pwd != NULL) ? pwd->pw_dir : getenv("HOME");
+        snprintf(home, sizeof(home), "%s", (home_dir != NULL) ? home_dir : "/");
     }
-    memcpy(home_dir, "/home/", strlen("/home/"));
-    strcat(home_dir, user);
-
-    return home_dir;
+    return home;
 }
 
-char *prompt_cwd(void)
+/* The working directory as shown in the prompt, with the home directory
+ * abbreviated to '~'. It is only looked up again after prompt_cwd_changed(). */
+const char *prompt_cwd(void)
 {
-    char *cwd = malloc(PATH_MAX);
-    if (cwd == NULL) {
-        perror("cwd malloc error");
+    if (!cwd_stale) {
+        return cwd_display;
     }
-    cwd = getcwd(cwd, PATH_MAX);
 
-    char *home_dir = get_home();
-    if (strncmp(cwd, home_dir, strlen(home_dir)) == 0) {
-        *(cwd + strlen(home_dir) - 1) = '~';
-        cwd = cwd + strlen(home_dir) - 1;
+    cwd_stale = false;
+    cwd_display = cwd;
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        strcpy(cwd, "?");
+        return cwd_display;
     }
 
-    free(home_dir);
-    return cwd;
+    /* Only a whole path component matches: /home/ab is not under /home/a */
+    size_t home_len = strlen(get_home());
+    if (home_len > 1 && strncmp(cwd, home, home_len) == 0
+            && (cwd[home_len] == '/' || cwd[home_len] == '\0')) {
+        cwd[home_len - 1] = '~';
+        cwd_display = cwd + home_len - 1;
+    }
+    return cwd_display;
+}
+
+/* Called after a successful cd so the next prompt shows the new directory */
+void prompt_cwd_changed(void)
+{
+    cwd_stale = true;
 }
 
 int get_prompt_status(void)
@@ -135,30 +179,63 @@ unsigned int prompt_cmd_num(void)
     return hist_last_cnum() + 1;
 }
 
+/* Reads one line interactively; scripts are read by script.c instead */
 char *read_command(void)
 {
-    if (scripting) {
-        char *line = NULL;
-        size_t buf_sz = 0;
-        ssize_t read_sz = getline(&line, &buf_sz, stdin);
-        if (read_sz == -1) {
-            free(line);
-            return NULL;
-        }
-        line[read_sz - 1] = '\0';
-        return line;
-    } else {
-        char *prompt = prompt_line();
-        /* Allows us to arrow back and forth over the line we are typing */
-        char *command = readline(prompt);
-        free(prompt);
-        return command;
+    if (read_line == NULL) {
+        load_line_editor();
+    }
+    return read_line(prompt_line());
+}
+
+/* Loads the readline plugin from the shell's own directory (its rpath) */
+void load_line_editor(void)
+{
+    read_line = read_plain_line;
+    void *plugin = dlopen(LINEEDIT_PLUGIN, RTLD_NOW | RTLD_LOCAL);
+    if (plugin == NULL) {
+        fprintf(stderr, "ash: no line editing: %s\n", dlerror());
+        return;
+    }
+
+    void (*init)(lineedit_search_fn, lineedit_complete_fn) =
+        (void (*)(lineedit_search_fn, lineedit_complete_fn))
+        dlsym(plugin, "lineedit_init");
+    char *(*read_fn)(const char *) = (char *(*)(const char *))
+        dlsym(plugin, "lineedit_read");
+    if (init == NULL || read_fn == NULL) {
+        fprintf(stderr, "ash: no line editing: %s\n", dlerror());
+        dlclose(plugin);
+        return;
+    }
+    init(hist_fuzzy_search, complete_command);
+    read_line = read_fn;
+
+    /* PATH is indexed on the first Tab, which can take tens of milliseconds
+     * with thousands of programs; ASH_COMPLETE_PRELOAD moves that to startup */
+    const char *preload = getenv("ASH_COMPLETE_PRELOAD");
+    if (preload != NULL && preload[0] != '\0') {
+        const char **names;
+        complete_command("", &names);
     }
+    LOGP("Loaded " LINEEDIT_PLUGIN "\n");
 }
 
-int readline_init(void)
+/* Reads a line without editing, for when the plugin is missing */
+char *read_plain_line(const char *prompt)
 {
-    rl_variable_bind("show-all-if-ambiguous", "on");
-    rl_variable_bind("colored-completion-prefix", "on");
-    return 0;
+    fputs(prompt, stdout);
+    fflush(stdout);
+
+    char *line = NULL;
+    size_t line_sz = 0;
+    ssize_t len = getline(&line, &line_sz, stdin);
+    if (len == -1) {
+        free(line);
+        return NULL;
+    }
+    if (len > 0 && line[len - 1] == '\n') {
+        line[len - 1] = '\0';
+    }
+    return line;
 }
@@ -9,11 +9,12 @@
 #define _UI_H_
 
 void init_ui(void);
-char *prompt_line(void);
-char *prompt_username(void);
-char *prompt_hostname(void);
-char *get_home(void);
-char *prompt_cwd(void);
+const char *prompt_line(void);
+const char *prompt_username(void);
+const char *prompt_hostname(void);
+const char *get_home(void);
+const char *prompt_cwd(void);
+void prompt_cwd_changed(void);
 int get_prompt_status(void);
 void set_prompt_status(int val);
 unsigned int prompt_cmd_num(void);
@@ -0,0 +1,337 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vars.h"
+#include "logger.h"
+
+extern char **environ;
+
+#define DEFAULT_TABLE_SZ 64
+#define MAX_LOAD_PERCENT 70
+#define STR_ROUND 32
+
+/* Open addressing with linear probing, like the PATH hash table. Each
+ * variable is a single "NAME=value" string, so an exported one goes into
+ * envp as it is. An unset variable keeps its slot and name, like a stale
+ * path in pathhash.c, so lookups still probe past it. */
+struct var {
+    char *str;            /*!< "NAME=value", NULL marks a free slot */
+    uint32_t hash;
+    uint32_t name_len;
+    uint32_t str_cap;     /*!< Bytes allocated for 'str' */
+    bool set;
+    bool exported;
+};
+
+static struct var *table;
+static size_t table_sz;
+static size_t used;
+
+/* NULL-terminated "NAME=value" pointers of the exported variables */
+static char **envp;
+static size_t envp_cap;
+static unsigned long envp_builds;   /* For benchmarks */
+
+static int status;                  /* $? */
+static char status_str[16] = "0";
+
+static struct var *entry_get(const char *name, size_t name_len, bool create);
+static struct var *entry_find(const char *name, size_t name_len, uint32_t hash);
+static int table_grow(void);
+static int store(const char *name, size_t name_len, const char *value,
+        bool export, bool *envp_changed);
+static int envp_rebuild(void);
+static int compare_vars(const void *a, const void *b);
+
+/* Imports the environment the shell was started with */
+int vars_init(void)
+{
+    bool envp_changed = false;
+    for (char **env = environ; *env != NULL; env++) {
+        char *eq = strchr(*env, '=');
+        if (eq != NULL && store(*env, eq - *env, eq + 1, true, &envp_changed) == -1) {
+            return -1;
+        }
+    }
+    LOG("Imported %zu environment variables\n", used);
+    return envp_rebuild();
+}
+
+/* The value of the variable 'name' ('name_len' bytes, not necessarily
+ * terminated), or NULL if it is not set. "?" is the last exit code. */
+const char *var_get(const char *name, size_t name_len)
+{
+    if (name_len == 1 && name[0] == '?') {
+        return status_str;
+    }
+    if (table == NULL) {
+        return NULL;
+    }
+    struct var *entry = entry_get(name, name_len, false);
+    return (entry != NULL && entry->set) ? entry->str + name_len + 1 : NULL;
+}
+
+/* Sets a variable, which stays exported if it was; 'export' exports it */
+int var_set(const char *name, size_t name_len, const char *value, bool export)
+{
+    bool envp_changed = false;
+    if (store(name, name_len, value, export, &envp_changed) == -1) {
+        return -1;
+    }
+    return envp_changed ? envp_rebuild() : 0;
+}
+
+/* Exports a variable; one that is not set yet is exported once it is */
+int var_export(const char *name, size_t name_len)
+{
+    struct var *entry = entry_get(name, name_len, true);
+    if (entry == NULL) {
+        return -1;
+    }
+    if (entry->exported) {
+        return 0;
+    }
+    entry->exported = true;
+    return entry->set ? envp_rebuild() : 0;
+}
+
+void var_unset(const char *name, size_t name_len)
+{
+    struct var *entry = (table != NULL) ? entry_get(name, name_len, false) : NULL;
+    if (entry == NULL || !entry->set) {
+        return;
+    }
+    bool was_exported = entry->exported;
+    entry->set = false;
+    entry->exported = false;
+    if (was_exported) {
+        envp_rebuild();
+    }
+}
+
+/* Whether 'name' can be a variable: a letter or '_', then also digits */
+bool var_name_valid(const char *name, size_t name_len)
+{
+    if (name_len == 0 || !(isalpha((unsigned char) name[0]) || name[0] == '_')) {
+        return false;
+    }
+    for (size_t i = 1; i < name_len; i++) {
+        if (!isalnum((unsigned char) name[i]) && name[i] != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Records the exit code $? expands to */
+void vars_set_status(int code)
+{
+    status = code;
+    snprintf(status_str, sizeof(status_str), "%d", code);
+}
+
+int vars_status(void)
+{
+    return status;
+}
+
+/* The environment for new commands: the exported variables */
+char **vars_envp(void)
+{
+    return (envp != NULL) ? envp : environ;
+}
+
+/* Lists the exported variables, sorted, as 'export' commands that would
+ * set them again */
+void vars_print_exported(FILE *out)
+{
+    struct var **sorted = malloc((used + 1) * sizeof(struct var *));
+    if (sorted == NULL) {
+        perror("vars malloc");
+        return;
+    }
+    size_t num = 0;
+    for (size_t i = 0; i < table_sz; i++) {
+        if (table[i].str != NULL && table[i].set && table[i].exported) {
+            sorted[num++] = &table[i];
+        }
+    }
+    qsort(sorted, num, sizeof(struct var *), compare_vars);
+
+    for (size_t i = 0; i < num; i++) {
+        struct var *entry = sorted[i];
+        fprintf(out, "export %.*s='", (int) entry->name_len, entry->str);
+        for (const char *c = entry->str + entry->name_len + 1; *c != '\0'; c++) {
+            if (*c == '\'') {
+                fputs("'\\''", out);
+            } else {
+                fputc(*c, out);
+            }
+        }
+        fputs("'\n", out);
+    }
+    fflush(out);
+    free(sorted);
+}
+
+unsigned long vars_envp_builds(void)
+{
+    return envp_builds;
+}
+
+/* Finds the entry for 'name'; with 'create', a new unset one is added if
+ * there is none */
+struct var *entry_get(const char *name, size_t name_len, bool create)
+{
+    if (create && (table == NULL || (used + 1) * 100 > table_sz * MAX_LOAD_PERCENT)) {
+        if (table_grow() == -1) {
+            return NULL;
+        }
+    }
+    if (table == NULL) {
+        return NULL;
+    }
+
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < name_len; i++) {
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    }
+
+    struct var *entry = entry_find(name, name_len, hash);
+    if (entry->str != NULL || !create) {
+        return (entry->str != NULL) ? entry : NULL;
+    }
+
+    size_t cap = (name_len + 2 + STR_ROUND - 1) / STR_ROUND * STR_ROUND;
+    entry->str = malloc(cap);
+    if (entry->str == NULL) {
+        perror("vars malloc");
+        return NULL;
+    }
+    memcpy(entry->str, name, name_len);
+    entry->str[name_len] = '=';
+    entry->str[name_len + 1] = '\0';
+    entry->hash = hash;
+    entry->name_len = name_len;
+    entry->str_cap = cap;
+    entry->set = false;
+    entry->exported = false;
+    used++;
+    return entry;
+}
+
+struct var *entry_find(const char *name, size_t name_len, uint32_t hash)
+{
+    size_t mask = table_sz - 1;
+    size_t slot = hash & mask;
+    while (table[slot].str != NULL && (table[slot].hash != hash
+                || table[slot].name_len != name_len
+                || memcmp(table[slot].str, name, name_len) != 0)) {
+        slot = (slot + 1) & mask;
+    }
+    return &table[slot];
+}
+
+int table_grow(void)
+{
+    struct var *old_table = table;
+    size_t old_sz = table_sz;
+
+    size_t new_sz = (old_sz == 0) ? DEFAULT_TABLE_SZ : old_sz * 2;
+    struct var *new_table = calloc(new_sz, sizeof(struct var));
+    if (new_table == NULL) {
+        perror("vars calloc");
+        return -1;
+    }
+    table = new_table;
+    table_sz = new_sz;
+
+    for (size_t i = 0; i < old_sz; i++) {
+        struct var *old = &old_table[i];
+        if (old->str != NULL) {
+            *entry_find(old->str, old->name_len, old->hash) = *old;
+        }
+    }
+    free(old_table);
+    return 0;
+}
+
+/* Sets the value, in place when it fits. 'envp_changed' is set when envp
+ * has to be rebuilt: an exported string moved, or one was added. */
+int store(const char *name, size_t name_len, const char *value,
+        bool export, bool *envp_changed)
+{
+    struct var *entry = entry_get(name, name_len, true);
+    if (entry == NULL) {
+        return -1;
+    }
+
+    size_t value_len = strlen(value);
+    size_t str_sz = name_len + value_len + 2;
+    bool in_envp = entry->set && entry->exported;
+    if (str_sz > entry->str_cap) {
+        size_t cap = (str_sz + STR_ROUND - 1) / STR_ROUND * STR_ROUND;
+        char *str = realloc(entry->str, cap);
+        if (str == NULL) {
+            perror("vars realloc");
+            return -1;
+        }
+        entry->str = str;
+        entry->str_cap = cap;
+        *envp_changed |= in_envp;
+    }
+    memcpy(entry->str + name_len + 1, value, value_len + 1);
+
+    entry->set = true;
+    entry->exported |= export;
+    *envp_changed |= (entry->exported && !in_envp);
+    return 0;
+}
+
+/* Points envp, and environ with it, at the exported strings */
+int envp_rebuild(void)
+{
+    size_t num = 0;
+    for (size_t i = 0; i < table_sz; i++) {
+        num += (table[i].str != NULL && table[i].set && table[i].exported);
+    }
+    if (num + 1 > envp_cap) {
+        size_t cap = (envp_cap == 0) ? 64 : envp_cap;
+        while (cap < num + 1) {
+            cap *= 2;
+        }
+        char **new_envp = realloc(envp, cap * sizeof(char *));
+        if (new_envp == NULL) {
+            perror("vars realloc");
+            return -1;
+        }
+        envp = new_envp;
+        envp_cap = cap;
+    }
+
+    num = 0;
+    for (size_t i = 0; i < table_sz; i++) {
+        if (table[i].str != NULL && table[i].set && table[i].exported) {
+            envp[num++] = table[i].str;
+        }
+    }
+    envp[num] = NULL;
+    environ = envp;
+    envp_builds++;
+    LOG("Rebuilt envp: %zu exported variables\n", num);
+    return 0;
+}
+
+int compare_vars(const void *a, const void *b)
+{
+    const struct var *x = *(const struct var **) a;
+    const struct var *y = *(const struct var **) b;
+    size_t len = (x->name_len < y->name_len) ? x->name_len : y->name_len;
+    int cmp = memcmp(x->str, y->str, len);
+    return (cmp != 0) ? cmp : (int) x->name_len - (int) y->name_len;
+}
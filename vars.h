@@ -0,0 +1,30 @@
+/**
+ * @file
+ *
+ * Shell variables, for $NAME expansion and the 'export' and 'unset'
+ * builtins. The environment the shell started with is imported as exported
+ * variables. Exported ones are kept as a ready envp array (which 'environ'
+ * also points at), rebuilt only when the set of exported strings changes, so
+ * spawning a command costs nothing extra.
+ */
+
+#ifndef _VARS_H_
+#define _VARS_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+int vars_init(void);
+const char *var_get(const char *name, size_t name_len);
+int var_set(const char *name, size_t name_len, const char *value, bool export);
+int var_export(const char *name, size_t name_len);
+void var_unset(const char *name, size_t name_len);
+bool var_name_valid(const char *name, size_t name_len);
+void vars_set_status(int code);
+int vars_status(void);
+char **vars_envp(void);
+void vars_print_exported(FILE *out);
+unsigned long vars_envp_builds(void);
+
+#endif
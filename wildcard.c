@@ -0,0 +1,572 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wildcard.h"
+#include "logger.h"
+
+#define DIR_CACHE_SZ 32
+#define DENTS_BUF_SZ (1 << 17)
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct dir_entry {
+    const char *name;
+    unsigned char type;   /*!< d_type: DT_DIR, DT_REG, ... or DT_UNKNOWN */
+};
+
+/* One directory's entries, sorted by name. The listing is reused while the
+ * directory's mtime stays the same, unless it was read in the same clock
+ * tick as that mtime: a change later in that tick would not move the mtime,
+ * so such a 'racy' listing is read again next time. */
+struct dir_listing {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    bool racy;
+    char *names;                /*!< NUL-terminated names, back to back */
+    struct dir_entry *entries;
+    size_t num_entries;
+    unsigned long last_used;
+};
+
+static struct dir_listing cache[DIR_CACHE_SZ];
+static unsigned long use_clock;
+static unsigned long dir_reads;   /* Directories read, for benchmarks */
+
+/* State of one expansion: the path built so far and the matches */
+struct expansion {
+    char path[PATH_MAX];
+    char **matches;
+    size_t num_matches;
+    size_t cap;
+    bool dirs_only;     /*!< The pattern ends with '/' */
+    struct arena *arena;
+};
+
+static struct dir_listing *dir_list(const char *path);
+static int dir_read(struct dir_listing *listing, int fd);
+static void dir_free(struct dir_listing *listing);
+static void expand_from(struct expansion *ex, size_t path_len,
+        char **components, size_t num_components, bool verify);
+static int add_match(struct expansion *ex, const char *path);
+static bool match_bracket(const char *p, char c, const char **end, bool *matched);
+static void unescape(char *dst, const char *src);
+static int compare_entries(const void *a, const void *b);
+static int compare_strings(const void *a, const void *b);
+
+/* Expands 'pattern' into the paths it matches, sorted, in 'arena'. Quoted
+ * characters are escaped with '\' in the pattern. A '*' or '?' does not
+ * match a leading '.', and '.' and '..' are never matched. Returns NULL
+ * with 'num_matches' 0 if nothing matches. */
+char **wildcard_expand(const char *pattern, struct arena *arena, size_t *num_matches)
+{
+    *num_matches = 0;
+    size_t len = strlen(pattern);
+    char *copy = arena_alloc(arena, len + 1);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, pattern, len + 1);
+
+    /* Split into path components; an absolute pattern starts from "/" */
+    size_t max_components = 1;
+    for (const char *c = copy; *c != '\0'; c++) {
+        max_components += (*c == '/');
+    }
+    char **components = arena_alloc(arena, max_components * sizeof(char *));
+    if (components == NULL) {
+        return NULL;
+    }
+    size_t num_components = 0;
+    size_t num_globs = 0;
+    char *saveptr;
+    for (char *comp = strtok_r(copy, "/", &saveptr); comp != NULL;
+            comp = strtok_r(NULL, "/", &saveptr)) {
+        components[num_components++] = comp;
+        num_globs += wildcard_has_magic(comp);
+    }
+
+    struct expansion ex = { .arena = arena };
+    ex.dirs_only = (len > 1 && pattern[len - 1] == '/');
+    size_t path_len = 0;
+    if (pattern[0] == '/') {
+        ex.path[path_len++] = '/';
+    }
+    ex.path[path_len] = '\0';
+    expand_from(&ex, path_len, components, num_components, false);
+    if (ex.num_matches == 0) {
+        free(ex.matches);
+        return NULL;
+    }
+
+    char **matches = arena_alloc(arena, (ex.num_matches + 1) * sizeof(char *));
+    if (matches == NULL) {
+        free(ex.matches);
+        return NULL;
+    }
+    memcpy(matches, ex.matches, ex.num_matches * sizeof(char *));
+    matches[ex.num_matches] = NULL;
+    free(ex.matches);
+
+    /* Listings are sorted, so with one wildcard component so are the results */
+    if (num_globs > 1) {
+        qsort(matches, ex.num_matches, sizeof(char *), compare_strings);
+    }
+    *num_matches = ex.num_matches;
+    return matches;
+}
+
+/* Matches one file name against one component of a pattern, the way
+ * fnmatch() does without flags: '*', '?', '[abc]', '[a-z]', '[!x]' (or
+ * '[^x]') and '\' escapes. A '[' without a closing ']' is literal. */
+bool wildcard_match(const char *pattern, const char *name)
+{
+    const char *star_pattern = NULL;
+    const char *star_name = NULL;
+
+    while (*name != '\0') {
+        const char *end;
+        bool matched;
+        switch (*pattern) {
+        case '*':
+            star_pattern = ++pattern;
+            star_name = name;
+            continue;
+        case '?':
+            pattern++;
+            name++;
+            continue;
+        case '[':
+            if (match_bracket(pattern, *name, &end, &matched)) {
+                if (matched) {
+                    pattern = end;
+                    name++;
+                    continue;
+                }
+                break;
+            }
+            if (*name == '[') {
+                pattern++;
+                name++;
+                continue;
+            }
+            break;
+        case '\\':
+            if (pattern[1] != '\0') {
+                pattern++;
+            }
+            /* Fall through */
+        default:
+            if (*pattern == *name && *pattern != '\0') {
+                pattern++;
+                name++;
+                continue;
+            }
+            break;
+        }
+
+        /* Mismatch: let the last '*' take one more character */
+        if (star_pattern == NULL) {
+            return false;
+        }
+        pattern = star_pattern;
+        name = ++star_name;
+    }
+
+    while (*pattern == '*') {
+        pattern++;
+    }
+    return *pattern == '\0';
+}
+
+/* Whether 'pattern' has an unescaped '*', '?' or '[' */
+bool wildcard_has_magic(const char *pattern)
+{
+    for (const char *c = pattern; *c != '\0'; c++) {
+        if (*c == '\\' && c[1] != '\0') {
+            c++;
+        } else if (*c == '*' || *c == '?' || *c == '[') {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Drops every cached listing */
+void wildcard_cache_clear(void)
+{
+    for (size_t i = 0; i < DIR_CACHE_SZ; i++) {
+        dir_free(&cache[i]);
+    }
+}
+
+unsigned long wildcard_dir_reads(void)
+{
+    return dir_reads;
+}
+
+/* Returns the listing of directory 'path', from the cache if it is still
+ * current, or NULL if it cannot be read */
+struct dir_listing *dir_list(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+
+    /* A stale listing is read again in place; a new directory takes a free
+     * slot or the least recently used one */
+    struct dir_listing *slot = NULL;
+    for (size_t i = 0; i < DIR_CACHE_SZ; i++) {
+        struct dir_listing *listing = &cache[i];
+        if (listing->names != NULL && listing->dev == st.st_dev
+                && listing->ino == st.st_ino) {
+            if (!listing->racy && listing->mtime.tv_sec == st.st_mtim.tv_sec
+                    && listing->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                listing->last_used = ++use_clock;
+                return listing;
+            }
+            slot = listing;
+            break;
+        }
+        if (slot == NULL || (slot->names != NULL && (listing->names == NULL
+                        || listing->last_used < slot->last_used))) {
+            slot = listing;
+        }
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    dir_free(slot);
+    int result = dir_read(slot, fd);
+    close(fd);
+    if (result == -1) {
+        dir_free(slot);
+        return NULL;
+    }
+    slot->last_used = ++use_clock;
+    return slot;
+}
+
+/* Reads every entry of the directory open as 'fd' into 'listing' */
+int dir_read(struct dir_listing *listing, int fd)
+{
+    struct timespec read_start;
+    struct stat st;
+    clock_gettime(CLOCK_REALTIME_COARSE, &read_start);
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+    listing->dev = st.st_dev;
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    listing->racy = (st.st_mtim.tv_sec > read_start.tv_sec
+            || (st.st_mtim.tv_sec == read_start.tv_sec
+                && st.st_mtim.tv_nsec >= read_start.tv_nsec));
+
+    char *buf = malloc(DENTS_BUF_SZ);
+    size_t names_cap = DENTS_BUF_SZ;
+    size_t names_len = 0;
+    size_t offsets_cap = 1024;
+    size_t *offsets = malloc(offsets_cap * sizeof(size_t));
+    unsigned char *types = malloc(offsets_cap);
+    listing->names = malloc(names_cap);
+    if (buf == NULL || offsets == NULL || types == NULL || listing->names == NULL) {
+        perror("wildcard malloc");
+        goto error;
+    }
+
+    size_t num = 0;
+    long read_sz;
+    while ((read_sz = syscall(SYS_getdents64, fd, buf, DENTS_BUF_SZ)) > 0) {
+        for (long pos = 0; pos < read_sz; ) {
+            struct linux_dirent64 *dent = (struct linux_dirent64 *) (buf + pos);
+            pos += dent->d_reclen;
+            const char *name = dent->d_name;
+            if (name[0] == '.' && (name[1] == '\0'
+                        || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+
+            size_t name_sz = strlen(name) + 1;
+            if (names_len + name_sz > names_cap) {
+                names_cap *= 2;
+                char *new_names = realloc(listing->names, names_cap);
+                if (new_names == NULL) {
+                    perror("wildcard realloc");
+                    goto error;
+                }
+                listing->names = new_names;
+            }
+            if (num == offsets_cap) {
+                offsets_cap *= 2;
+                size_t *new_offsets = realloc(offsets, offsets_cap * sizeof(size_t));
+                unsigned char *new_types = realloc(types, offsets_cap);
+                if (new_offsets != NULL) {
+                    offsets = new_offsets;
+                }
+                if (new_types != NULL) {
+                    types = new_types;
+                }
+                if (new_offsets == NULL || new_types == NULL) {
+                    perror("wildcard realloc");
+                    goto error;
+                }
+            }
+            memcpy(listing->names + names_len, name, name_sz);
+            offsets[num] = names_len;
+            types[num] = dent->d_type;
+            names_len += name_sz;
+            num++;
+        }
+    }
+    if (read_sz == -1) {
+        perror("getdents64");
+        goto error;
+    }
+
+    /* The names stay where they are now, so entries can point at them */
+    listing->entries = malloc((num + 1) * sizeof(struct dir_entry));
+    if (listing->entries == NULL) {
+        perror("wildcard malloc");
+        goto error;
+    }
+    for (size_t i = 0; i < num; i++) {
+        listing->entries[i].name = listing->names + offsets[i];
+        listing->entries[i].type = types[i];
+    }
+    qsort(listing->entries, num, sizeof(struct dir_entry), compare_entries);
+    listing->num_entries = num;
+    dir_reads++;
+    LOG("Read directory: %zu entries%s\n", num, listing->racy ? " (racy)" : "");
+
+    free(buf);
+    free(offsets);
+    free(types);
+    return 0;
+
+error:
+    free(buf);
+    free(offsets);
+    free(types);
+    return -1;
+}
+
+void dir_free(struct dir_listing *listing)
+{
+    free(listing->names);
+    free(listing->entries);
+    listing->names = NULL;
+    listing->entries = NULL;
+    listing->num_entries = 0;
+}
+
+/* Matches the remaining 'components' under the directory in ex->path (of
+ * length 'path_len'). Literal components are appended without reading
+ * anything; if one follows a wildcard, 'verify' is set and the path is
+ * checked with lstat() once complete. */
+void expand_from(struct expansion *ex, size_t path_len,
+        char **components, size_t num_components, bool verify)
+{
+    if (num_components == 0) {
+        struct stat st;
+        if (!verify || lstat(ex->path, &st) == 0) {
+            add_match(ex, ex->path);
+        }
+        return;
+    }
+
+    const char *comp = components[0];
+    bool last = (num_components == 1);
+    if (!wildcard_has_magic(comp)) {
+        size_t comp_len = strlen(comp);
+        if (path_len + comp_len + 2 > sizeof(ex->path)) {
+            return;
+        }
+        unescape(ex->path + path_len, comp);
+        path_len += strlen(ex->path + path_len);
+        if (!last) {
+            ex->path[path_len++] = '/';
+            ex->path[path_len] = '\0';
+        }
+        expand_from(ex, path_len, components + 1, num_components - 1, verify);
+        return;
+    }
+
+    struct dir_listing *listing = dir_list(path_len > 0 ? ex->path : ".");
+    if (listing == NULL) {
+        return;
+    }
+
+    /* Expanding further may read other directories and evict this listing,
+     * so the matches are collected before going deeper */
+    bool hidden = (comp[0] == '.' || (comp[0] == '\\' && comp[1] == '.'));
+    size_t num_entries = listing->num_entries;
+    struct dir_entry *entries = listing->entries;
+    if (!last) {
+        size_t num = 0;
+        struct dir_entry *subdirs = malloc((num_entries + 1) * sizeof(struct dir_entry));
+        if (subdirs == NULL) {
+            perror("wildcard malloc");
+            return;
+        }
+        for (size_t i = 0; i < num_entries; i++) {
+            const char *name = entries[i].name;
+            unsigned char type = entries[i].type;
+            if ((name[0] == '.' && !hidden) || !wildcard_match(comp, name)
+                    || (type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN)) {
+                continue;
+            }
+            subdirs[num].name = arena_strdup(ex->arena, name);
+            subdirs[num].type = type;
+            num++;
+        }
+        for (size_t i = 0; i < num; i++) {
+            if (subdirs[i].name == NULL) {
+                continue;
+            }
+            size_t name_len = strlen(subdirs[i].name);
+            if (path_len + name_len + 2 > sizeof(ex->path)) {
+                continue;
+            }
+            memcpy(ex->path + path_len, subdirs[i].name, name_len);
+            ex->path[path_len + name_len] = '/';
+            ex->path[path_len + name_len + 1] = '\0';
+
+            /* Symbolic links and unknown types have to be checked */
+            struct stat st;
+            if (subdirs[i].type != DT_DIR
+                    && (stat(ex->path, &st) == -1 || !S_ISDIR(st.st_mode))) {
+                continue;
+            }
+            expand_from(ex, path_len + name_len + 1, components + 1,
+                    num_components - 1, true);
+        }
+        free(subdirs);
+        return;
+    }
+
+    for (size_t i = 0; i < num_entries; i++) {
+        const char *name = entries[i].name;
+        if ((name[0] == '.' && !hidden) || !wildcard_match(comp, name)) {
+            continue;
+        }
+        size_t name_len = strlen(name);
+        if (path_len + name_len + 2 > sizeof(ex->path)) {
+            continue;
+        }
+        memcpy(ex->path + path_len, name, name_len + 1);
+        if (ex->dirs_only) {
+            struct stat st;
+            if (entries[i].type != DT_DIR
+                    && (stat(ex->path, &st) == -1 || !S_ISDIR(st.st_mode))) {
+                continue;
+            }
+            strcpy(ex->path + path_len + name_len, "/");
+        }
+        if (add_match(ex, ex->path) == -1) {
+            return;
+        }
+    }
+}
+
+int add_match(struct expansion *ex, const char *path)
+{
+    if (ex->num_matches == ex->cap) {
+        size_t new_cap = (ex->cap == 0) ? 64 : ex->cap * 2;
+        char **new_matches = realloc(ex->matches, new_cap * sizeof(char *));
+        if (new_matches == NULL) {
+            perror("wildcard realloc");
+            return -1;
+        }
+        ex->matches = new_matches;
+        ex->cap = new_cap;
+    }
+    char *copy = arena_strdup(ex->arena, path);
+    if (copy == NULL) {
+        return -1;
+    }
+    ex->matches[ex->num_matches++] = copy;
+    return 0;
+}
+
+/* Matches 'c' against the bracket expression at 'p'. Returns false if it is
+ * not terminated; otherwise 'end' is set after the ']' */
+bool match_bracket(const char *p, char c, const char **end, bool *matched)
+{
+    const char *q = p + 1;
+    bool negate = (*q == '!' || *q == '^');
+    if (negate) {
+        q++;
+    }
+
+    /* A ']' right at the start is part of the set */
+    bool found = false;
+    bool first = true;
+    while (*q != ']' || first) {
+        first = false;
+        if (*q == '\0') {
+            return false;
+        }
+        unsigned char lo = *q;
+        if (lo == '\\' && q[1] != '\0') {
+            lo = *++q;
+        }
+        unsigned char hi = lo;
+        if (q[1] == '-' && q[2] != ']' && q[2] != '\0') {
+            q += 2;
+            hi = *q;
+            if (hi == '\\' && q[1] != '\0') {
+                hi = *++q;
+            }
+        }
+        if (lo <= (unsigned char) c && (unsigned char) c <= hi) {
+            found = true;
+        }
+        q++;
+    }
+    *end = q + 1;
+    *matched = (found != negate);
+    return true;
+}
+
+void unescape(char *dst, const char *src)
+{
+    for (; *src != '\0'; src++) {
+        if (*src == '\\' && src[1] != '\0') {
+            src++;
+        }
+        *dst++ = *src;
+    }
+    *dst = '\0';
+}
+
+int compare_entries(const void *a, const void *b)
+{
+    return strcmp(((const struct dir_entry *) a)->name,
+            ((const struct dir_entry *) b)->name);
+}
+
+int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
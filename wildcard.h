@@ -0,0 +1,26 @@
+/**
+ * @file
+ *
+ * Pathname expansion for words containing '*', '?' or '[...]'. Directories
+ * are read with getdents64 and their listings kept for the session, sorted,
+ * so globbing the same large directory again costs one stat() as long as
+ * its mtime has not changed.
+ *
+ * (Named wildcard rather than glob so it does not hide the system's glob.h.)
+ */
+
+#ifndef _WILDCARD_H_
+#define _WILDCARD_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+
+char **wildcard_expand(const char *pattern, struct arena *arena, size_t *num_matches);
+bool wildcard_match(const char *pattern, const char *name);
+bool wildcard_has_magic(const char *pattern);
+void wildcard_cache_clear(void);
+unsigned long wildcard_dir_reads(void);
+
+#endif